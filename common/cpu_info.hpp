@@ -38,6 +38,27 @@ constexpr static uint32_t PUSH = 0x1D;
 constexpr static uint32_t POP = 0x1E;
 constexpr static uint32_t CIP = 0x1F;
 constexpr static uint32_t BNC = 0x20;
+constexpr static uint32_t MUL_REG = 0x21;
+constexpr static uint32_t MUL_IMM = 0x22;
+constexpr static uint32_t DIV_REG = 0x23;
+constexpr static uint32_t DIV_IMM = 0x24;
+constexpr static uint32_t DIVU_REG = 0x25;
+constexpr static uint32_t DIVU_IMM = 0x26;
+constexpr static uint32_t MOD_REG = 0x27;
+constexpr static uint32_t MOD_IMM = 0x28;
+constexpr static uint32_t MODU_REG = 0x29;
+constexpr static uint32_t MODU_IMM = 0x2A;
+constexpr static uint32_t RSH_REG = 0x2B;
+constexpr static uint32_t RSH_IMM = 0x2C;
+constexpr static uint32_t ASR_REG = 0x2D;
+constexpr static uint32_t ASR_IMM = 0x2E;
+constexpr static uint32_t MEMSET = 0x2F;
+constexpr static uint32_t MEMCPY = 0x30;
+constexpr static uint32_t PADDUSB = 0x31;
+constexpr static uint32_t PSUBUSB = 0x32;
+constexpr static uint32_t PAVGB = 0x33;
+constexpr static uint32_t PBLEND = 0x34;
+constexpr static uint32_t LUI = 0x35;
 } // namespace Instructions
 
 namespace Registers {
@@ -1,4 +1,6 @@
 #pragma once
+#include <array>
+#include <cstddef>
 #include <cstdint>
 #include <string>
 #include <unordered_map>
@@ -32,6 +34,20 @@ struct InstMetadata {
     }                                                                          \
   };
 
+// Three registers and no immediate form; registered with imm 0 so the
+// assemblers reject a literal third operand.
+#define THREE_REG_INST(class_name, mnemonic, op)                               \
+  template <typename Dest, typename Src1, typename Src2> struct class_name {}; \
+  static inline bool reg##class_name =                                         \
+      Registry::register_inst(mnemonic, {InstFormat::THREE_OP, op, 0});        \
+                                                                               \
+  template <uint8_t Dest, uint8_t Reg1, uint8_t Reg2>                          \
+  struct class_name<Reg<Dest>, Reg<Reg1>, Reg<Reg2>> {                         \
+    static constexpr auto emit() {                                             \
+      return Emitter::three_op(op, Dest, Reg1, Reg2);                          \
+    }                                                                          \
+  };
+
 #define TWO_OP_INST(class_name, mnemonic, reg_op, imm_op)                      \
   template <typename Dest, typename Src1> struct class_name {};                \
   static inline bool reg##class_name =                                         \
@@ -51,6 +67,20 @@ struct InstMetadata {
     }                                                                          \
   };
 
+// Two operands, immediate only; registered with reg 0 so the assemblers
+// reject a register second operand.
+#define TWO_IMM_INST(class_name, mnemonic, op)                                 \
+  template <typename Dest, typename Src1> struct class_name {};                \
+  static inline bool reg##class_name =                                         \
+      Registry::register_inst(mnemonic, {InstFormat::TWO_OP, 0, op});          \
+                                                                               \
+  template <uint8_t Dest, uint16_t Imm>                                        \
+  struct class_name<Reg<Dest>, Literal<Imm>> {                                 \
+    static constexpr auto emit() {                                             \
+      return Emitter::two_op_imm(op, Dest, Imm);                               \
+    }                                                                          \
+  };
+
 #define JUMP_INST(class_name, mnemonic, op)                                    \
   template <typename Dest> struct class_name {};                               \
   static inline bool reg##class_name =                                         \
@@ -206,6 +236,26 @@ THREE_OP_INST(Xor, "XOR", 0x1B, 0x1C)
 STACK_INST(Push, "PUSH", 0x1D)
 STACK_INST(Pop, "POP", 0x1E)
 JUMP_INST(Cip, "CIP", 0x1F)
+// Low 32 bits of the product, so one MUL serves signed and unsigned.
+THREE_OP_INST(Mul, "MUL", 0x21, 0x22)
+THREE_OP_INST(Div, "DIV", 0x23, 0x24)
+THREE_OP_INST(Divu, "DIVU", 0x25, 0x26)
+THREE_OP_INST(Mod, "MOD", 0x27, 0x28)
+THREE_OP_INST(Modu, "MODU", 0x29, 0x2A)
+THREE_OP_INST(Rsh, "RSH", 0x2B, 0x2C)
+THREE_OP_INST(Asr, "ASR", 0x2D, 0x2E)
+// MEMSET Rd, Rv, Rn: Rn words of Rv from [Rd]. MEMCPY Rd, Rs, Rn: Rn words
+// from [Rs] to [Rd].
+THREE_REG_INST(Memset, "MEMSET", 0x2F)
+THREE_REG_INST(Memcpy, "MEMCPY", 0x30)
+// Packed pixels: four unsigned bytes per register. PBLEND Rd, Rs, Rb draws
+// Rs over Rb using Rs's alpha (the top byte).
+THREE_REG_INST(Paddusb, "PADDUSB", 0x31)
+THREE_REG_INST(Psubusb, "PSUBUSB", 0x32)
+THREE_REG_INST(Pavgb, "PAVGB", 0x33)
+THREE_REG_INST(Pblend, "PBLEND", 0x34)
+// LUI Rd, imm: Rd = imm << 16. See load_imm() for whole 32-bit constants.
+TWO_IMM_INST(Lui, "LUI", 0x35)
 
 struct Ret {
   static constexpr auto emit() {
@@ -236,4 +286,22 @@ inline auto parse_two(uint32_t op, uint32_t dest, uint32_t other, bool isImm)
 inline auto parse_one(uint32_t op, uint32_t dest) -> std::uint32_t {
   return (op << 26) | (dest & 0x3FFFFFF);
 }
+
+// The LI pseudo-op: the shortest sequence that puts `value` in `dest`. MOV if
+// it fits in 16 bits, LUI if its low half is zero, and LUI then OR otherwise.
+struct LoadImm {
+  std::array<uint32_t, 2> words;
+  std::size_t size;
+};
+
+constexpr auto load_imm(uint8_t dest, uint32_t value) -> LoadImm {
+  auto hi = static_cast<uint16_t>(value >> 16);
+  auto lo = static_cast<uint16_t>(value);
+  if (hi == 0)
+    return {{Emitter::two_op_imm(0x4, dest, lo), 0}, 1};
+  auto lui = Emitter::two_op_imm(0x35, dest, hi);
+  if (lo == 0)
+    return {{lui, 0}, 1};
+  return {{lui, Emitter::three_op_imm(0x1A, dest, dest, lo)}, 2};
+}
 } // namespace Instructions
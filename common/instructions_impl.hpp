@@ -1,215 +1,441 @@
 #pragma once
 
+#include <algorithm>
+#include <type_traits>
+
 #include "../common/cpu_info.hpp"
 #include "cpu.hpp"
+#include "observer.hpp"
+#include "packed.hpp"
+
+inline auto parse_as_signed(uint32_t data) -> std::int32_t {
+  std::int32_t temp = data;
+  temp = temp << 6;
+  return temp >> 6;
+}
+
+// Operand field accessors. Every decoder and handler below is templated on
+// the instruction view, so the same code runs on raw words (switch/threaded
+// engines) and on pre-decoded DecodedInst records (PREDECODED engine).
+inline auto field_dest(uint32_t inst) -> uint32_t {
+  return (inst >> 21) & 0x1F;
+}
+inline auto field_dest(const DecodedInst &inst) -> uint32_t {
+  return inst.dest;
+}
+
+inline auto field_s1(uint32_t inst) -> uint32_t { return (inst >> 16) & 0x1F; }
+inline auto field_s1(const DecodedInst &inst) -> uint32_t { return inst.s1; }
+
+inline auto field_s2(uint32_t inst) -> uint32_t { return (inst >> 11) & 0x1F; }
+inline auto field_s2(const DecodedInst &inst) -> uint32_t { return inst.s2; }
+
+inline auto field_imm(uint32_t inst) -> uint32_t { return inst & 0xFFFF; }
+inline auto field_imm(const DecodedInst &inst) -> uint32_t { return inst.imm; }
+
+// Unsigned 26-bit payload: JMP target, CIP line, PUSH/POP register.
+inline auto field_payload(uint32_t inst) -> uint32_t {
+  return inst & 0x3FFFFFF;
+}
+inline auto field_payload(const DecodedInst &inst) -> uint32_t {
+  return inst.payload;
+}
+
+// Signed 26-bit PC-relative branch offset.
+inline auto field_offset(uint32_t inst) -> int32_t {
+  return parse_as_signed(inst & 0x3FFFFFF);
+}
+inline auto field_offset(const DecodedInst &inst) -> int32_t {
+  return inst.offset;
+}
+
+// Every architectural write a handler makes goes through one of these, so
+// the observer hears about it just before it lands. Memory reads are reported
+// too, for watchpoints.
+template <typename Obs>
+inline auto set_reg(CPU &cpu, Obs &obs, uint32_t r, uint32_t value) -> void {
+  obs.write_reg(cpu, r, value);
+  cpu.registers[r] = value;
+}
+
+template <typename Obs>
+inline auto set_mem(CPU &cpu, Obs &obs, uint32_t addr, uint32_t value)
+    -> void {
+  obs.write_mem(cpu, addr, value);
+  cpu.store(addr, value);
+}
+
+template <typename Obs>
+inline auto get_mem(CPU &cpu, Obs &obs, uint32_t addr) -> uint32_t {
+  obs.read_mem(cpu, addr);
+  return cpu.load(addr);
+}
+
+template <typename Obs>
+inline auto jump(CPU &cpu, Obs &obs, uint32_t target) -> void {
+  obs.write_pc(cpu, target);
+  cpu.set_pc(target);
+}
+
+template <typename Obs>
+inline auto push(CPU &cpu, Obs &obs, uint32_t value) -> void {
+  using Fanta::Info::Registers::SP;
+  set_mem(cpu, obs, cpu.registers[SP], value);
+  set_reg(cpu, obs, SP, cpu.registers[SP] - 4);
+}
+
+template <typename Obs> inline auto pop(CPU &cpu, Obs &obs) -> uint32_t {
+  using Fanta::Info::Registers::SP;
+  set_reg(cpu, obs, SP, cpu.registers[SP] + 4);
+  return get_mem(cpu, obs, cpu.registers[SP]);
+}
 
 struct DecodeDest {
-  static auto store(CPU &cpu, std::uint32_t inst, uint32_t result) -> void {
-    auto reg = (inst >> 21) & 0x1F;
-    cpu.registers[reg] = result;
+  template <typename Inst, typename Obs>
+  static auto store(CPU &cpu, const Inst &inst, uint32_t result, Obs &obs)
+      -> void {
+    set_reg(cpu, obs, field_dest(inst), result);
   }
 };
 
 struct DecodeLoadDest {
-  static auto store(CPU &cpu, std::uint32_t inst, uint32_t result) -> void {
-    auto reg = (inst >> 21) & 0x1F;
-    cpu.registers[reg] = result;
+  template <typename Inst, typename Obs>
+  static auto store(CPU &cpu, const Inst &inst, uint32_t result, Obs &obs)
+      -> void {
+    set_reg(cpu, obs, field_dest(inst), result);
   }
 };
 
 struct DecodeS1Cmp {
-  static auto decode(CPU &cpu, std::uint32_t inst) -> std::uint32_t {
-    auto reg = (inst >> 21) & 0x1F;
-    return cpu.registers[reg];
+  template <typename Inst>
+  static auto decode(CPU &cpu, const Inst &inst) -> std::uint32_t {
+    return cpu.registers[field_dest(inst)];
   }
 };
 
 struct DecodeSource1 {
-  static auto decode(CPU &cpu, std::uint32_t inst) -> std::uint32_t {
-    return cpu.registers[(inst >> 16) & 0x1F];
+  template <typename Inst>
+  static auto decode(CPU &cpu, const Inst &inst) -> std::uint32_t {
+    return cpu.registers[field_s1(inst)];
   }
 };
 
 struct DecodeSource2 {
-  static auto decode(CPU &cpu, std::uint32_t inst) -> std::uint32_t {
-    return cpu.registers[(inst >> 11) & 0x1F];
+  template <typename Inst>
+  static auto decode(CPU &cpu, const Inst &inst) -> std::uint32_t {
+    return cpu.registers[field_s2(inst)];
   }
 };
 
 struct DecodeImm {
-  static auto decode(CPU &cpu, std::uint32_t inst) -> std::uint32_t {
-    return inst & 0xFFFF;
+  template <typename Inst>
+  static auto decode(CPU &cpu, const Inst &inst) -> std::uint32_t {
+    return field_imm(inst);
+  }
+};
+
+// LUI's immediate, in the upper half.
+struct DecodeUpperImm {
+  template <typename Inst>
+  static auto decode(CPU &cpu, const Inst &inst) -> std::uint32_t {
+    return field_imm(inst) << 16;
   }
 };
 
 struct DecodeStorageDest {
-  static auto store(CPU &cpu, std::uint32_t inst, uint32_t result) -> void {
-    auto base = cpu.registers[(inst >> 16) & 0x1F] + (inst & 0xFFFF);
-    cpu.store(base, result);
+  template <typename Inst, typename Obs>
+  static auto store(CPU &cpu, const Inst &inst, uint32_t result, Obs &obs)
+      -> void {
+    auto base = cpu.registers[field_s1(inst)] + field_imm(inst);
+    set_mem(cpu, obs, base, result);
   }
 };
 
 struct DecodeLoadSource {
-  static auto decode(CPU &cpu, std::uint32_t inst) -> std::uint32_t {
-    auto base = cpu.registers[(inst >> 16) & 0x1F] + (inst & 0xFFFF);
-    return cpu.load(base);
+  template <typename Inst, typename Obs>
+  static auto decode(CPU &cpu, const Inst &inst, Obs &obs) -> std::uint32_t {
+    auto base = cpu.registers[field_s1(inst)] + field_imm(inst);
+    return get_mem(cpu, obs, base);
   }
 };
 
-enum OpType { ARITH_ADD, ARITH_SUB, LOGICAL, LSHIFT };
+enum OpType { ARITH_ADD, ARITH_SUB, LOGICAL, LSHIFT, RSHIFT, ASHIFT };
+
+// C is the last bit shifted out, or 0 for a zero count. Counts of 32 and up
+// shift everything out rather than wrapping, so bits past the word are 0 and,
+// for ASR, copies of the sign.
+template <OpType type>
+constexpr auto shift_carry(uint32_t value, uint32_t count) -> uint32_t {
+  if (count == 0)
+    return 0;
+  if constexpr (type == ASHIFT)
+    return value >> (count < 32 ? count - 1 : 31) & 0x1;
+  if (count > 32)
+    return 0;
+  if constexpr (type == LSHIFT)
+    return value >> (32 - count) & 0x1;
+  return value >> (count - 1) & 0x1;
+}
 
 template <typename DestDecoder, typename S1Decoder, typename OptDecoder,
           auto OpFunc, OpType type>
 struct OpArithLogical {
-  static auto exec(CPU &cpu, uint32_t inst) {
+  template <typename Inst, typename Obs>
+  static auto exec(CPU &cpu, const Inst &inst, Obs &obs) {
     auto s1_data = S1Decoder::decode(cpu, inst);
     auto opt_data = OptDecoder::decode(cpu, inst);
     auto result = OpFunc(s1_data, opt_data);
     if constexpr (type == ARITH_ADD) {
+      obs.write_flags(cpu, FLAGS_ALL);
       cpu.check_arith(s1_data, opt_data, result, false);
     } else if constexpr (type == ARITH_SUB) {
+      obs.write_flags(cpu, FLAGS_ALL);
       cpu.check_arith(s1_data, opt_data, result, true);
     } else if constexpr (type == LOGICAL) {
-      cpu.set_neg(result);
-      cpu.set_zero(result);
-    } else if constexpr (type == LSHIFT) {
-      cpu.set_neg(result);
-      cpu.set_carry(opt_data > 0 ? s1_data >> (32 - opt_data) & 0x1 : 0);
-      cpu.set_zero(result);
+      obs.write_flags(cpu, FLAGS_ZN);
+      cpu.set_nz(result);
+    } else {
+      obs.write_flags(cpu, FLAGS_ZNC);
+      cpu.flags.shift(result, shift_carry<type>(s1_data, opt_data));
     }
-    DestDecoder::store(cpu, inst, result);
+    DestDecoder::store(cpu, inst, result, obs);
   }
 };
 
 template <typename DestDecoder, typename OptDecoder> struct OpMov {
-  static auto exec(CPU &cpu, uint32_t inst) {
+  template <typename Inst, typename Obs>
+  static auto exec(CPU &cpu, const Inst &inst, Obs &obs) {
     auto data = OptDecoder::decode(cpu, inst);
-    DestDecoder::store(cpu, inst, data);
-    cpu.set_neg(data);
-    cpu.set_zero(data);
+    DestDecoder::store(cpu, inst, data, obs);
+    obs.write_flags(cpu, FLAGS_ZN);
+    cpu.set_nz(data);
   }
 };
 
 template <typename SrcVal, typename DestAddr> struct OpMem {
-  static auto exec(CPU &cpu, uint32_t inst) {
-    auto val = SrcVal::decode(cpu, inst);
-    DestAddr::store(cpu, inst, val);
-    cpu.set_neg(val);
-    cpu.set_zero(val);
+  template <typename Inst, typename Obs>
+  static auto exec(CPU &cpu, const Inst &inst, Obs &obs) {
+    auto val = [&] {
+      // Sources that read memory report the read.
+      if constexpr (requires { SrcVal::decode(cpu, inst, obs); })
+        return SrcVal::decode(cpu, inst, obs);
+      else
+        return SrcVal::decode(cpu, inst);
+    }();
+    DestAddr::store(cpu, inst, val, obs);
+    obs.write_flags(cpu, FLAGS_ZN);
+    cpu.set_nz(val);
   }
 };
 
 // One of the few non composable
 struct Jmp {
-  static auto exec(CPU &cpu, uint32_t inst) { cpu.set_pc(inst & 0x3FFFFFF); }
+  template <typename Inst, typename Obs>
+  static auto exec(CPU &cpu, const Inst &inst, Obs &obs) {
+    jump(cpu, obs, field_payload(inst));
+  }
 };
 
-auto parse_as_signed(uint32_t data) -> std::int32_t {
-  std::int32_t temp = data;
-  temp = temp << 6;
-  return temp >> 6;
-}
-
 template <CPU::FLAG f, bool isNeg> struct Branch {
-  static auto exec(CPU &cpu, uint32_t inst) {
+  template <typename Inst, typename Obs>
+  static auto exec(CPU &cpu, const Inst &inst, Obs &obs) {
     if (cpu.flag_check(f, isNeg)) {
       auto prev = cpu.get_prev_pc();
       auto res = static_cast<uint32_t>(static_cast<int32_t>(prev) +
-                                       parse_as_signed(inst & 0x3FFFFFF));
-      cpu.set_pc(res);
+                                       field_offset(inst));
+      jump(cpu, obs, res);
     }
   }
 };
 
 struct Jrel {
-  static auto exec(CPU &cpu, uint32_t inst) {
+  template <typename Inst, typename Obs>
+  static auto exec(CPU &cpu, const Inst &inst, Obs &obs) {
     auto prev = cpu.get_prev_pc();
     auto res = static_cast<uint32_t>(static_cast<int32_t>(prev) +
-                                     parse_as_signed(inst & 0x3FFFFFF));
-    cpu.set_pc(res);
+                                     field_offset(inst));
+    jump(cpu, obs, res);
   }
 };
 
 struct Halt {
-  static auto exec(CPU &cpu, uint32_t inst) { cpu.halted = true; }
+  template <typename Inst, typename Obs>
+  static auto exec(CPU &cpu, const Inst &inst, Obs &obs) {
+    cpu.halted = true;
+  }
 };
 
 struct Nop {
-  static auto exec(CPU &cpu, uint32_t inst) {}
+  template <typename Inst, typename Obs>
+  static auto exec(CPU &cpu, const Inst &inst, Obs &obs) {}
 };
 
 template <typename DestDecoder, typename OptDecoder> struct OpCmp {
-  static auto exec(CPU &cpu, uint32_t inst) {
-    auto data = static_cast<std::int32_t>(DestDecoder::decode(cpu, inst));
-    auto data2 = static_cast<std::int32_t>(OptDecoder::decode(cpu, inst));
-    if (data == data2) {
-      cpu.set_zero(0);
-    } else {
-      cpu.set_zero(1);
-    }
-    if (data > data2) {
-      cpu.set_carry(1);
-    } else {
-      cpu.set_carry(0);
-    }
-
-    cpu.set_neg(data - data2);
+  template <typename Inst, typename Obs>
+  static auto exec(CPU &cpu, const Inst &inst, Obs &obs) {
+    // Z, N and the signed "greater than" carry are all worked out from the
+    // operands when a branch asks for them.
+    obs.write_flags(cpu, FLAGS_ZNC);
+    cpu.flags.compare(DestDecoder::decode(cpu, inst),
+                      OptDecoder::decode(cpu, inst));
   }
 };
 
 struct Ret {
-  static auto exec(CPU &cpu, uint32_t inst) {
-    auto pc = cpu.pop_stack();
-    cpu.set_pc(pc);
+  template <typename Inst, typename Obs>
+  static auto exec(CPU &cpu, const Inst &inst, Obs &obs) {
+    auto pc = pop(cpu, obs);
+    jump(cpu, obs, pc);
   }
 };
 
 struct Call {
-  static auto exec(CPU &cpu, uint32_t inst) {
-    cpu.push_stack();
+  template <typename Inst, typename Obs>
+  static auto exec(CPU &cpu, const Inst &inst, Obs &obs) {
+    push(cpu, obs, cpu.get_pc());
     auto prev = cpu.get_prev_pc();
     auto res = static_cast<uint32_t>(static_cast<int32_t>(prev) +
-                                     parse_as_signed(inst & 0x3FFFFFF));
-    cpu.set_pc(res);
+                                     field_offset(inst));
+    jump(cpu, obs, res);
   }
 };
 
 struct Pop {
-  static auto exec(CPU &cpu, uint32_t inst) {
-    auto dest = inst & 0x3FFFFFF;
-    auto res = cpu.pop_stack();
-    cpu.registers[dest] = res;
+  template <typename Inst, typename Obs>
+  static auto exec(CPU &cpu, const Inst &inst, Obs &obs) {
+    auto dest = field_payload(inst);
+    auto res = pop(cpu, obs);
+    set_reg(cpu, obs, dest, res);
   }
 };
 
 struct Push {
-  static auto exec(CPU &cpu, uint32_t inst) {
-    auto dest = inst & 0x3FFFFFF;
-    cpu.push_stack(cpu.registers[dest]);
+  template <typename Inst, typename Obs>
+  static auto exec(CPU &cpu, const Inst &inst, Obs &obs) {
+    auto dest = field_payload(inst);
+    push(cpu, obs, cpu.registers[dest]);
   }
 };
 
 struct Cip {
-  static auto exec(CPU &cpu, uint32_t inst) {
-    auto checkInt = inst & 0x3FFFFFF;
+  template <typename Inst, typename Obs>
+  static auto exec(CPU &cpu, const Inst &inst, Obs &obs) {
+    auto checkInt = field_payload(inst);
     if (cpu.cip_interrupts[checkInt] == 1) {
       cpu.cip_interrupts[checkInt] = 0;
-      cpu.push_stack();
-      auto prev = cpu.get_prev_pc();
+      push(cpu, obs, cpu.get_pc());
       auto res = static_cast<uint32_t>(
           Fanta::Info::Cpu::INTERRUPT_BASE +
           (4 * checkInt)); // decide where the interrupt table is
-      cpu.set_pc(res);
+      jump(cpu, obs, res);
     }
   }
 };
 
+// MEMSET Rd, Rv, Rn / MEMCPY Rd, Rs, Rn. One execution moves up to
+// CPU::BLOCK_WORDS words, lowest address first, advances Rd (and Rs) past
+// them and counts Rn down; while Rn is not yet 0 it branches back to itself.
+// So a transfer costs a cycle per chunk, and a budget, breakpoint or VBLANK
+// can fall between chunks like in any loop. Flags are left alone.
+//
+// Word order is the whole definition of overlap: a copy to a destination
+// below the source behaves like memmove, one just above it repeats the
+// words in between. Words outside guest memory are skipped and read as 0.
+template <bool Copy> struct OpBlock {
+  template <typename Inst, typename Obs>
+  static auto exec(CPU &cpu, const Inst &inst, Obs &obs) {
+    // Read the operands up front: the transfer may overwrite this very
+    // instruction's decoded record.
+    auto dest = field_dest(inst);
+    auto src = field_s1(inst);
+    auto count_reg = field_s2(inst);
+    auto addr = cpu.registers[dest];
+    auto value = cpu.registers[src];
+    auto count = cpu.registers[count_reg];
+    auto words = std::min(count, CPU::BLOCK_WORDS);
+    if constexpr (std::is_same_v<Obs, NullObserver>) {
+      if constexpr (Copy)
+        cpu.copy_words(addr, value, words);
+      else
+        cpu.fill_words(addr, value, words);
+    } else {
+      // Observers hear about every word, as they would for STOREs.
+      for (uint32_t i = 0; i < words; i++) {
+        auto word = value;
+        if constexpr (Copy) {
+          auto from = value + 4 * i;
+          word = from <= CPU::MEMORY_SIZE - 4 ? get_mem(cpu, obs, from) : 0;
+        }
+        if (auto to = addr + 4 * i; to <= CPU::MEMORY_SIZE - 4)
+          set_mem(cpu, obs, to, word);
+      }
+    }
+    set_reg(cpu, obs, dest, addr + 4 * words);
+    if constexpr (Copy)
+      set_reg(cpu, obs, src, value + 4 * words);
+    set_reg(cpu, obs, count_reg, count - words);
+    if (count > words)
+      jump(cpu, obs, cpu.get_prev_pc());
+  }
+};
+
+using Memset = OpBlock<false>;
+using Memcpy = OpBlock<true>;
+
 constexpr auto op_plus = [](uint32_t a, uint32_t b) { return a + b; };
 constexpr auto op_minus = [](uint32_t a, uint32_t b) { return a - b; };
 constexpr auto op_and = [](uint32_t a, uint32_t b) { return a & b; };
-constexpr auto op_lsh = [](uint32_t a, uint32_t b) { return a << b; };
+constexpr auto op_lsh = [](uint32_t a, uint32_t b) -> uint32_t {
+  return b < 32 ? a << b : 0;
+};
+constexpr auto op_rsh = [](uint32_t a, uint32_t b) -> uint32_t {
+  return b < 32 ? a >> b : 0;
+};
+constexpr auto op_asr = [](uint32_t a, uint32_t b) -> uint32_t {
+  return static_cast<uint32_t>(static_cast<int32_t>(a) >> (b < 32 ? b : 31));
+};
 constexpr auto op_or = [](uint32_t a, uint32_t b) { return a | b; };
 constexpr auto op_xor = [](uint32_t a, uint32_t b) { return a ^ b; };
+constexpr auto op_mul = [](uint32_t a, uint32_t b) { return a * b; };
+
+// Division never traps: x / 0 is all ones and x % 0 is x, and the one signed
+// overflow, INT_MIN / -1, gives INT_MIN remainder 0 (as RISC-V does).
+constexpr auto op_divu = [](uint32_t a, uint32_t b) -> uint32_t {
+  return b == 0 ? UINT32_MAX : a / b;
+};
+constexpr auto op_modu = [](uint32_t a, uint32_t b) -> uint32_t {
+  return b == 0 ? a : a % b;
+};
+constexpr auto op_div = [](uint32_t a, uint32_t b) -> uint32_t {
+  if (b == 0)
+    return UINT32_MAX;
+  if (a == 0x80000000u && b == UINT32_MAX)
+    return a;
+  return static_cast<uint32_t>(static_cast<int32_t>(a) /
+                               static_cast<int32_t>(b));
+};
+constexpr auto op_mod = [](uint32_t a, uint32_t b) -> uint32_t {
+  if (b == 0)
+    return a;
+  if (a == 0x80000000u && b == UINT32_MAX)
+    return 0;
+  return static_cast<uint32_t>(static_cast<int32_t>(a) %
+                               static_cast<int32_t>(b));
+};
+
+// Per-byte ops on packed ARGB pixels; see vm/packed.hpp.
+constexpr auto op_paddusb = [](uint32_t a, uint32_t b) {
+  return Packed::add_sat(a, b);
+};
+constexpr auto op_psubusb = [](uint32_t a, uint32_t b) {
+  return Packed::sub_sat(a, b);
+};
+constexpr auto op_pavgb = [](uint32_t a, uint32_t b) {
+  return Packed::avg(a, b);
+};
+constexpr auto op_pblend = [](uint32_t a, uint32_t b) {
+  return Packed::blend(a, b);
+};
 
 #define INSTRUCTION_3(Name, Op, FlagType)                                      \
   using Name##Reg =                                                            \
@@ -223,6 +449,23 @@ INSTRUCTION_3(And, op_and, LOGICAL)
 INSTRUCTION_3(Or, op_or, LOGICAL)
 INSTRUCTION_3(Xor, op_xor, LOGICAL)
 INSTRUCTION_3(Lsh, op_lsh, LSHIFT)
+INSTRUCTION_3(Rsh, op_rsh, RSHIFT)
+INSTRUCTION_3(Asr, op_asr, ASHIFT)
+// Like the logical ops, these only define N and Z.
+INSTRUCTION_3(Mul, op_mul, LOGICAL)
+INSTRUCTION_3(Div, op_div, LOGICAL)
+INSTRUCTION_3(Divu, op_divu, LOGICAL)
+INSTRUCTION_3(Mod, op_mod, LOGICAL)
+INSTRUCTION_3(Modu, op_modu, LOGICAL)
+
+// Register-only, and also defining just N and Z.
+template <auto Op>
+using OpPacked =
+    OpArithLogical<DecodeDest, DecodeSource1, DecodeSource2, Op, LOGICAL>;
+using Paddusb = OpPacked<op_paddusb>;
+using Psubusb = OpPacked<op_psubusb>;
+using Pavgb = OpPacked<op_pavgb>;
+using Pblend = OpPacked<op_pblend>;
 
 using CmpReg = OpCmp<DecodeS1Cmp, DecodeSource1>;
 using CmpImm = OpCmp<DecodeS1Cmp, DecodeImm>;
@@ -232,6 +475,7 @@ using StoreReg = OpMem<DecodeS1Cmp, DecodeStorageDest>;
 using LoadReg = OpMem<DecodeLoadSource, DecodeLoadDest>;
 using MovReg = OpMov<DecodeDest, DecodeSource1>;
 using MovImm = OpMov<DecodeDest, DecodeImm>;
+using LuiImm = OpMov<DecodeDest, DecodeUpperImm>;
 
 // Branches
 using Beq = Branch<CPU::FLAG::ZERO, false>;
@@ -2,7 +2,9 @@
 #include "ast.hpp"
 #include "cpu_info.hpp"
 #include "ir.hpp"
+#include <bit>
 #include <fanta_utils.hpp>
+#include <utility>
 #include <variant>
 
 namespace Fanta {
@@ -130,11 +132,62 @@ auto getOpcodeFromString(Lexer::TokenType t, bool isReg) -> uint32_t {
     return isReg ? 0x3 : 0x4;
   case Lexer::TokenType::Minus:
     return isReg ? 0x5 : 0x6;
+  // `int` is signed, so / and % use the signed divide and >> shifts in the
+  // sign.
+  case Lexer::TokenType::Mult:
+    return isReg ? Info::Instructions::MUL_REG : Info::Instructions::MUL_IMM;
+  case Lexer::TokenType::Slash:
+    return isReg ? Info::Instructions::DIV_REG : Info::Instructions::DIV_IMM;
+  case Lexer::TokenType::Percent:
+    return isReg ? Info::Instructions::MOD_REG : Info::Instructions::MOD_IMM;
+  case Lexer::TokenType::ShiftLeft:
+    return isReg ? Info::Instructions::LSH_REG : Info::Instructions::LSH_IMM;
+  case Lexer::TokenType::ShiftRight:
+    return isReg ? Info::Instructions::ASR_REG : Info::Instructions::ASR_IMM;
   default:
     return 0;
   }
 }
 
+// Rewrites an op with a constant right-hand side into a cheaper equivalent.
+// Every Fanta instruction retires in one cycle, MUL included, so only
+// single-instruction replacements pay off: a shift-and-add chain for, say,
+// x * 320 is three instructions where MUL is one. Likewise x / 2^k stays a
+// DIV: ASR alone rounds negative x down rather than towards zero, and the
+// fix-up takes three more instructions. The JIT turns it into shifts.
+auto reduceConstantOp(IROp &op) -> void {
+  auto constant = op.source2.val;
+  auto moveImm = [&](uint32_t value) {
+    op.opcode = Info::Instructions::MOV_IMM;
+    op.source2 = {value, false};
+  };
+  auto moveLhs = [&] {
+    op.opcode = Info::Instructions::MOV_REG;
+    op.source2 = op.source1;
+    op.s2type = Register;
+  };
+  switch (op.opcode) {
+  case Info::Instructions::MUL_IMM:
+    if (constant == 0) {
+      moveImm(0);
+    } else if (constant == 1) {
+      moveLhs();
+    } else if (std::has_single_bit(constant)) {
+      op.opcode = Info::Instructions::LSH_IMM;
+      op.source2 = {static_cast<uint32_t>(std::countr_zero(constant)), false};
+    }
+    break;
+  case Info::Instructions::DIV_IMM:
+    if (constant == 1)
+      moveLhs();
+    break;
+  case Info::Instructions::MOD_IMM:
+    if (constant == 1)
+      moveImm(0);
+    break;
+  }
+}
+
 auto SimpleIRPass::emitComparison(const Parser &p,
                                   const AST::BinaryOperator &bcall,
                                   IRListing &ir, const GlobalTable &gt,
@@ -186,23 +239,33 @@ auto SimpleIRPass::emitExpression(const Parser &p, const AST::AstNode &node,
             moveOp.s2type = Source2Type::Immediate;
             ir.push_back(moveOp);
           },
-          [&](const AST::BinaryOperator &binaryOp) {
+          [&](AST::BinaryOperator binaryOp) {
+            // Multiplication commutes, so put a constant factor on the right
+            // where it can become an immediate.
+            if (binaryOp.type == Lexer::TokenType::Mult &&
+                std::holds_alternative<AST::IntLiteral>(
+                    p.getNodeAtIndex(binaryOp.lhsOp).t) &&
+                !std::holds_alternative<AST::IntLiteral>(
+                    p.getNodeAtIndex(binaryOp.rhsOp).t))
+              std::swap(binaryOp.lhsOp, binaryOp.rhsOp);
+
             auto lhsReg = lt.allocateAnonymous();
             emitExpression(p, p.getNodeAtIndex(binaryOp.lhsOp), ir, gt, lt,
                            lhsReg);
 
-            if (std::holds_alternative<AST::IntLiteral>(
-                    p.getNodeAtIndex(binaryOp.rhsOp).t)) {
+            // Immediates are 16 bits; a wider constant goes through a
+            // register, which the emitter loads with LUI + OR.
+            auto rhsNode = p.getNodeAtIndex(binaryOp.rhsOp);
+            const auto *rhsLiteral = std::get_if<AST::IntLiteral>(&rhsNode.t);
+            if (rhsLiteral &&
+                static_cast<uint32_t>(rhsLiteral->literal) <= 0xFFFF) {
               IROp op{};
               op.opcode = getOpcodeFromString(binaryOp.type, false);
               op.source1 = {lhsReg, true};
-              op.source2 = {
-                  static_cast<uint32_t>(std::get<AST::IntLiteral>(
-                                            p.getNodeAtIndex(binaryOp.rhsOp).t)
-                                            .literal),
-                  false};
+              op.source2 = {static_cast<uint32_t>(rhsLiteral->literal), false};
               op.destination = {dest, true};
               op.s2type = Immediate;
+              reduceConstantOp(op);
               ir.push_back(op);
             } else {
               auto rhsReg = lt.allocateAnonymous();
@@ -14,17 +14,27 @@ auto InstructionEmitter::outputInstructions(RegAllocIR &rir, GlobalTable &gt)
     -> InstructionList {
   InstructionList list{};
 
-  reset();
-
-  // Emit the actual instructions within the instruction
-  for (const auto &func : rir.functions) {
-    auto baseAddr = list.size();
-    resolvedAddresses[func.name] = baseAddr;
-    if (func.name == "__init") {
-      outputInitFunc(func, gt, list);
-    } else {
-      outputInstructionsForFunc(func, gt, list);
+  // Globals sit right after the code. A 16-bit MOV reaches them in all but
+  // the largest images; past 64K, emit again with room for LUI + OR.
+  wideGlobalBase = false;
+  while (true) {
+    list.clear();
+    reset();
+
+    // Emit the actual instructions within the instruction
+    for (const auto &func : rir.functions) {
+      auto baseAddr = list.size();
+      resolvedAddresses[func.name] = baseAddr;
+      if (func.name == "__init") {
+        outputInitFunc(func, gt, list);
+      } else {
+        outputInstructionsForFunc(func, gt, list);
+      }
     }
+
+    if (wideGlobalBase || globalBase(list) <= 0xFFFF)
+      break;
+    wideGlobalBase = true;
   }
 
   link(list);
@@ -32,13 +42,28 @@ auto InstructionEmitter::outputInstructions(RegAllocIR &rir, GlobalTable &gt)
   return list;
 }
 
+auto InstructionEmitter::globalBase(const InstructionList &il) -> uint32_t {
+  return ((il.size() * 4 + 15) / 16) * 16;
+}
+
+auto InstructionEmitter::emitGlobalBase(const LocalGlobalBase &lgb,
+                                        InstructionList &il) -> void {
+  globalBaseMovs.push_back(il.size());
+  il.push_back(Instructions::Emitter::two_op_imm(Info::Instructions::MOV_IMM,
+                                                 lgb.dest.val, 0));
+  if (wideGlobalBase)
+    il.push_back(Instructions::Nop::emit());
+}
+
 auto InstructionEmitter::link(InstructionList &il) -> void {
-  auto globalBaseAddr = ((il.size() * 4 + 15) / 16) * 16;
+  auto globalBaseAddr = globalBase(il);
 
   for (const auto &movId : globalBaseMovs) {
-    auto reg = (il[movId] >> 21) & 0x1F;
-    il[movId] = Instructions::Emitter::two_op_imm(Info::Instructions::MOV_IMM,
-                                                  reg, globalBaseAddr);
+    auto reg = static_cast<uint8_t>((il[movId] >> 21) & 0x1F);
+    auto li = Instructions::load_imm(reg, globalBaseAddr);
+    il[movId] = li.words[0];
+    if (wideGlobalBase && li.size > 1)
+      il[movId + 1] = li.words[1];
   }
   for (const auto &[idx, linkName] : missingLinks) {
     if (!resolvedAddresses.contains(linkName)) {
@@ -78,12 +103,7 @@ auto InstructionEmitter::outputInitFunc(const FunctionIR &fir, GlobalTable &gt,
                            Info::Instructions::MOV_REG, op.dest->val, 0));
                      }
                    },
-                   [&](const LocalGlobalBase &lgb) {
-                     auto movGlobal = Instructions::Emitter::two_op_imm(
-                         Info::Instructions::MOV_IMM, lgb.dest.val, 0);
-                     il.push_back(movGlobal);
-                     globalBaseMovs.push_back(il.size() - 1);
-                   },
+                   [&](const LocalGlobalBase &lgb) { emitGlobalBase(lgb, il); },
                    [](const auto &other) {}},
         ir);
   }
@@ -139,12 +159,7 @@ auto InstructionEmitter::outputInstructionsForFunc(const FunctionIR &fir,
                      missingLinks.push_back({il.size() - 1, bop.label});
                    },
                    [&](const Return &ret) { emitEpilogue(fir, maxOffset, il); },
-                   [&](const LocalGlobalBase &lgb) {
-                     auto movGlobal = Instructions::Emitter::two_op_imm(
-                         Info::Instructions::MOV_IMM, lgb.dest.val, 0);
-                     il.push_back(movGlobal);
-                     globalBaseMovs.push_back(il.size() - 1);
-                   },
+                   [&](const LocalGlobalBase &lgb) { emitGlobalBase(lgb, il); },
                    [&](const IRLabel &label) {
                      resolvedAddresses[label.name] = il.size();
                    },
@@ -216,7 +231,12 @@ auto InstructionEmitter::emitInst(const IROp &op, GlobalTable &gt,
     THREE_REG(Info::Instructions::ADD_REG)
     THREE_IMM(Info::Instructions::ADD_IMM)
     TWO_REG(Info::Instructions::MOV_REG)
-    TWO_IMM(Info::Instructions::MOV_IMM)
+  case Info::Instructions::MOV_IMM: {
+    // Constants wider than the 16-bit immediate become LUI + OR.
+    auto li = Instructions::load_imm(op.destination.val, op.source2.val);
+    il.insert(il.end(), li.words.begin(), li.words.begin() + li.size);
+    break;
+  }
     THREE_REG(Info::Instructions::SUB_REG)
     THREE_IMM(Info::Instructions::SUB_IMM)
     SINGLE(Info::Instructions::JUMP)
@@ -244,6 +264,20 @@ auto InstructionEmitter::emitInst(const IROp &op, GlobalTable &gt,
     SINGLE(Info::Instructions::PUSH)
     SINGLE(Info::Instructions::POP)
     SINGLE(Info::Instructions::BNC)
+    THREE_REG(Info::Instructions::MUL_REG)
+    THREE_IMM(Info::Instructions::MUL_IMM)
+    THREE_REG(Info::Instructions::DIV_REG)
+    THREE_IMM(Info::Instructions::DIV_IMM)
+    THREE_REG(Info::Instructions::DIVU_REG)
+    THREE_IMM(Info::Instructions::DIVU_IMM)
+    THREE_REG(Info::Instructions::MOD_REG)
+    THREE_IMM(Info::Instructions::MOD_IMM)
+    THREE_REG(Info::Instructions::MODU_REG)
+    THREE_IMM(Info::Instructions::MODU_IMM)
+    THREE_REG(Info::Instructions::RSH_REG)
+    THREE_IMM(Info::Instructions::RSH_IMM)
+    THREE_REG(Info::Instructions::ASR_REG)
+    THREE_IMM(Info::Instructions::ASR_IMM)
   }
 }
 
@@ -20,6 +20,11 @@ private:
 
   auto link(InstructionList &il) -> void;
 
+  // Where the globals start: the first 16-byte boundary after the code.
+  static auto globalBase(const InstructionList &il) -> uint32_t;
+  // A placeholder link() patches with the global base; two words when wide.
+  auto emitGlobalBase(const LocalGlobalBase &lgb, InstructionList &il) -> void;
+
   auto dummy() -> void;
 
   auto reset() -> void;
@@ -30,6 +35,7 @@ private:
   std::vector<std::pair<index, globalName>> missingLinks;
   std::unordered_map<funcName, uint32_t> resolvedAddresses;
   std::vector<index> globalBaseMovs;
+  bool wideGlobalBase = false;
 };
 
 } // namespace Fanta
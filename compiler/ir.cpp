@@ -71,6 +71,34 @@ auto getopName(const InstOp op) -> std::string {
     return "Cip";
   if (op == 0x20)
     return "Bnc";
+  if (op == 0x21)
+    return "Mul";
+  if (op == 0x22)
+    return "Mul";
+  if (op == 0x23)
+    return "Div";
+  if (op == 0x24)
+    return "Div";
+  if (op == 0x25)
+    return "Divu";
+  if (op == 0x26)
+    return "Divu";
+  if (op == 0x27)
+    return "Mod";
+  if (op == 0x28)
+    return "Mod";
+  if (op == 0x29)
+    return "Modu";
+  if (op == 0x2A)
+    return "Modu";
+  if (op == 0x2B)
+    return "Rsh";
+  if (op == 0x2C)
+    return "Rsh";
+  if (op == 0x2D)
+    return "Asr";
+  if (op == 0x2E)
+    return "Asr";
   return "Nop";
 }
 
@@ -141,6 +169,34 @@ auto numberOfSources(const InstOp op) -> int {
     return 1;
   if (op == 0x20)
     return 0;
+  if (op == 0x21)
+    return 2;
+  if (op == 0x22)
+    return 2;
+  if (op == 0x23)
+    return 2;
+  if (op == 0x24)
+    return 2;
+  if (op == 0x25)
+    return 2;
+  if (op == 0x26)
+    return 2;
+  if (op == 0x27)
+    return 2;
+  if (op == 0x28)
+    return 2;
+  if (op == 0x29)
+    return 2;
+  if (op == 0x2A)
+    return 2;
+  if (op == 0x2B)
+    return 2;
+  if (op == 0x2C)
+    return 2;
+  if (op == 0x2D)
+    return 2;
+  if (op == 0x2E)
+    return 2;
   return 0;
 }
 
@@ -32,6 +32,9 @@ struct Lexer {
     Minus,
     Slash,
     Mult,
+    Percent,
+    ShiftLeft,
+    ShiftRight,
     Arrow,
     Identifier,
     Equal,
@@ -168,6 +171,12 @@ private:
         return Token{TokenType::GreaterEq, body_.substr(start, 2), 0, start,
                      cursor_++};
       }
+      if (next == '>') {
+        auto start = cursor_;
+        cursor_++;
+        return Token{TokenType::ShiftRight, body_.substr(start, 2), 0, start,
+                     cursor_++};
+      }
       return Token{
           TokenType::Greater, body_.substr(cursor_, 1), 0, cursor_,
           cursor_++}; // Ugly hack but I need to increment cursor at some point
@@ -180,6 +189,12 @@ private:
         return Token{TokenType::LesserEq, body_.substr(start, 2), 0, start,
                      cursor_++};
       }
+      if (next == '<') {
+        auto start = cursor_;
+        cursor_++;
+        return Token{TokenType::ShiftLeft, body_.substr(start, 2), 0, start,
+                     cursor_++};
+      }
       return Token{
           TokenType::Lesser, body_.substr(cursor_, 1), 0, cursor_,
           cursor_++}; // Ugly hack but I need to increment cursor at some point
@@ -219,6 +234,9 @@ private:
     case '/':
       return Token{TokenType::Slash, body_.substr(cursor_, 1), 0, cursor_,
                    cursor_++};
+    case '%':
+      return Token{TokenType::Percent, body_.substr(cursor_, 1), 0, cursor_,
+                   cursor_++};
     case ';':
       return Token{TokenType::SemiColon, body_.substr(cursor_, 1), 0, cursor_,
                    cursor_++};
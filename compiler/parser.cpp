@@ -57,6 +57,12 @@ auto Parser::tokenTypeToString(Lexer::TokenType t) -> std::string_view {
     return "*";
   case Lexer::TokenType::Slash:
     return "/";
+  case Lexer::TokenType::Percent:
+    return "%";
+  case Lexer::TokenType::ShiftLeft:
+    return "<<";
+  case Lexer::TokenType::ShiftRight:
+    return ">>";
   case Lexer::TokenType::KeywordLet:
     return "let";
   case Lexer::TokenType::KeywordFn:
@@ -406,7 +412,11 @@ auto Parser::getPrecedence(Lexer::TokenType t) -> Precedence {
   case Lexer::TokenType::CloseParam:
     return Precedence::LOWEST;
   case Lexer::TokenType::Slash:
+  case Lexer::TokenType::Percent:
     return Precedence::DIVIDE;
+  case Lexer::TokenType::ShiftLeft:
+  case Lexer::TokenType::ShiftRight:
+    return Precedence::SHIFT;
   case Lexer::TokenType::NotEq:
   case Lexer::TokenType::EqualComp:
   case Lexer::TokenType::Lesser:
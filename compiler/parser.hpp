@@ -26,10 +26,11 @@ private:
     ASSIGN_OR_RET = 2,
     LOGIC = 3,
     COMP = 4,
-    SUM = 5,
-    MINUS = 5, // Same precedence as SUM (left-associative +/-)
-    MULT = 6,  // Should collapse mult-divide to one
-    DIVIDE = 6,
+    SHIFT = 5, // Between comparisons and +/-, as in C
+    SUM = 6,
+    MINUS = 6, // Same precedence as SUM (left-associative +/-)
+    MULT = 7,  // Should collapse mult-divide to one
+    DIVIDE = 7,
     CALL = 8,
   };
 
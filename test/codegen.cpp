@@ -114,6 +114,17 @@ auto compileAndRun(const std::string &code) -> CPU {
     cpu.store(i * 4, insts[i]);
   }
   cpu.run_until_halt();
+
+  // Every compiled program doubles as a JIT conformance test.
+  CPU jit{};
+  jit.engine = CPU::Engine::JIT;
+  for (size_t i = 0; i < insts.size(); i++) {
+    jit.store(i * 4, insts[i]);
+  }
+  jit.run_until_halt();
+  REQUIRE_TRUE(jit.registers == cpu.registers);
+  REQUIRE_TRUE(jit.status_reg() == cpu.status_reg());
+  REQUIRE_SAME(cpu.get_pc(), jit.get_pc());
   return cpu;
 }
 
@@ -488,3 +499,53 @@ TEST_CASE("For Loop - Nested If Inside Body") {
                      "}";
   REQUIRE_SAME(5, compileAndRun(code).registers[0]);
 }
+
+// --- multiply, divide and modulo ---
+
+TEST_CASE("Arithmetic - Multiply, Divide And Modulo") {
+  // Covers MUL with a register and an immediate, the reductions to a shift,
+  // a move and a constant, and / binding tighter than +.
+  std::string code = "fn main() -> int {"
+                     "let a: int = 7;"
+                     "let b: int = 0 - 9;"
+                     "return a * 320 + 8 * a + a * b + a / 2 + b / 2 + "
+                     "b % 4 + a * 1 + a / 1 + a % 1 + a * 0;"
+                     "}";
+  REQUIRE_SAME(2240 + 56 - 63 + 3 - 4 - 1 + 7 + 7,
+               compileAndRun(code).registers[0]);
+}
+
+TEST_CASE("Arithmetic - Shifts Bind Looser Than Sums") {
+  // >> keeps the sign; `1 << 2 + 1` is 1 << 3.
+  std::string code = "fn main() -> int {"
+                     "let a: int = 0 - 100;"
+                     "let s: int = 2;"
+                     "return (a >> 3) + (a >> s) + (1 << 2 + 1) + (3 << s);"
+                     "}";
+  REQUIRE_SAME(static_cast<uint32_t>(-13 - 25 + 8 + 12),
+               compileAndRun(code).registers[0]);
+}
+
+// --- constants and globals past 16 bits ---
+
+TEST_CASE("Constants - Wider Than An Immediate") {
+  std::string code = "fn main() -> int {"
+                     "let a: int = 8388624;"
+                     "return a + 65536 - 100000 + a * 65535;"
+                     "}";
+  REQUIRE_SAME(8388624u + 65536 - 100000 + 8388624u * 65535,
+               compileAndRun(code).registers[0]);
+}
+
+TEST_CASE("Global Variable Past 64K Of Code") {
+  // Enough code that the globals start above 0xFFFF, where the base no
+  // longer fits one MOV.
+  std::string code = "let g: int = 3;"
+                     "fn main() -> int {"
+                     "let x: int = 0;";
+  for (int i = 0; i < 6000; i++)
+    code += "x = x + 1;";
+  code += "return x + g;"
+          "}";
+  REQUIRE_SAME(6003u, compileAndRun(code).registers[0]);
+}
@@ -1,8 +1,22 @@
 #include "cpu.hpp"
+#include "debug_spec.hpp"
+#include "frame_scheduler.hpp"
+#include "history.hpp"
+#include "packed.hpp"
+#include "profiler.hpp"
+#include "spsc_queue.hpp"
+#include "trace_file.hpp"
+#include "triple_buffer.hpp"
 #include "../common/cpu_info.hpp"
 #include "assembler.hpp"
 #include "instructions.hpp"
+#include "line.hpp"
+#include "observer.hpp"
+#include <filesystem>
 #include <testframework/testing.hpp>
+#include <thread>
+#include <utility>
+#include <vector>
 
 TEST_CASE("Basic Adds") {
   using namespace Instructions;
@@ -111,6 +125,192 @@ TEST_CASE("Flag Tests") {
   REQUIRE_TRUE(cpu.is_carry_set());
 }
 
+TEST_CASE("Flags Survive Partial Updates") {
+  using namespace Instructions;
+  // ADD overflows, CMP then replaces Z/N/C but must keep V, and MOV only
+  // replaces Z/N.
+  constexpr auto code =
+      Program<Mov<Reg<0>, Literal<0x7FFF>>, Lsh<Reg<0>, Reg<0>, Literal<16>>,
+              Add<Reg<1>, Reg<0>, Reg<0>>, Cmp<Reg<1>, Reg<1>>,
+              Mov<Reg<2>, Literal<5>>, Halt>::load();
+
+  for (auto engine : {CPU::Engine::SWITCH, CPU::Engine::THREADED,
+                      CPU::Engine::BLOCK, CPU::Engine::JIT}) {
+    CPU cpu{};
+    cpu.engine = engine;
+    cpu.load_rom(code);
+    cpu.run_until_halt();
+    REQUIRE_TRUE((cpu.status_reg() == std::array<uint8_t, 4>{0, 0, 1, 0}));
+  }
+}
+
+TEST_CASE("Multiply, Divide And Modulo") {
+  using namespace Instructions;
+  // R1 = -7, R2 = INT_MIN, R3 = -1.
+  constexpr auto code = Program<
+      Mov<Reg<0>, Literal<0>>, Sub<Reg<1>, Reg<0>, Literal<7>>,
+      Mov<Reg<2>, Literal<1>>, Lsh<Reg<2>, Reg<2>, Literal<31>>,
+      Sub<Reg<3>, Reg<0>, Literal<1>>, Mov<Reg<4>, Literal<2>>,
+      Mul<Reg<5>, Reg<1>, Literal<320>>, Mul<Reg<6>, Reg<1>, Reg<3>>,
+      Div<Reg<7>, Reg<1>, Reg<4>>, Mod<Reg<8>, Reg<1>, Reg<4>>,
+      Divu<Reg<9>, Reg<1>, Literal<16>>, Modu<Reg<10>, Reg<1>, Literal<16>>,
+      Div<Reg<11>, Reg<2>, Reg<3>>, Mod<Reg<12>, Reg<2>, Reg<3>>,
+      Div<Reg<13>, Reg<1>, Reg<0>>, Modu<Reg<14>, Reg<1>, Literal<0>>,
+      Halt>::load();
+
+  for (auto engine :
+       {CPU::Engine::SWITCH, CPU::Engine::THREADED, CPU::Engine::PREDECODED,
+        CPU::Engine::BLOCK, CPU::Engine::JIT}) {
+    CPU cpu{};
+    cpu.engine = engine;
+    cpu.load_rom(code);
+    cpu.run_until_halt();
+    REQUIRE_SAME(static_cast<uint32_t>(-2240), cpu.registers[5]);
+    REQUIRE_SAME(7, cpu.registers[6]);
+    // Signed division truncates towards zero.
+    REQUIRE_SAME(static_cast<uint32_t>(-3), cpu.registers[7]);
+    REQUIRE_SAME(static_cast<uint32_t>(-1), cpu.registers[8]);
+    REQUIRE_SAME(0x0FFFFFFF, cpu.registers[9]);
+    REQUIRE_SAME(9, cpu.registers[10]);
+    REQUIRE_SAME(0x80000000, cpu.registers[11]);
+    REQUIRE_SAME(0, cpu.registers[12]);
+    REQUIRE_SAME(UINT32_MAX, cpu.registers[13]);
+    REQUIRE_SAME(static_cast<uint32_t>(-7), cpu.registers[14]);
+    // MUL and DIV define Z and N from the result and leave V and C alone.
+    REQUIRE_TRUE((cpu.status_reg() == std::array<uint8_t, 4>{0, 1, 0, 0}));
+  }
+}
+
+TEST_CASE("Right Shifts Set Carry From The Last Bit Out") {
+  using namespace Instructions;
+  // R1 = -7 (0xFFFFFFF9), R3 = 32, R4 = 40; the last op sets R2 and flags.
+  auto shift = []<typename Op>(Op) {
+    return Program<Mov<Reg<0>, Literal<0>>, Sub<Reg<1>, Reg<0>, Literal<7>>,
+                   Mov<Reg<3>, Literal<32>>, Mov<Reg<4>, Literal<40>>, Op,
+                   Halt>::load();
+  };
+  struct Case {
+    std::array<uint32_t, 6> code;
+    uint32_t result;
+    std::array<uint8_t, 4> status; // Z, N, V, C
+  };
+  std::vector<Case> cases = {
+      {shift(Rsh<Reg<2>, Reg<1>, Literal<28>>{}), 0xF, {0, 0, 0, 1}},
+      {shift(Asr<Reg<2>, Reg<1>, Literal<1>>{}), static_cast<uint32_t>(-4),
+       {0, 1, 0, 1}},
+      {shift(Asr<Reg<2>, Reg<1>, Literal<2>>{}), static_cast<uint32_t>(-2),
+       {0, 1, 0, 0}},
+      // Counts of 32 and more shift everything out.
+      {shift(Rsh<Reg<2>, Reg<1>, Reg<3>>{}), 0, {1, 0, 0, 1}},
+      {shift(Rsh<Reg<2>, Reg<1>, Reg<4>>{}), 0, {1, 0, 0, 0}},
+      {shift(Lsh<Reg<2>, Reg<1>, Reg<4>>{}), 0, {1, 0, 0, 0}},
+      {shift(Asr<Reg<2>, Reg<1>, Reg<4>>{}), UINT32_MAX, {0, 1, 0, 1}},
+      {shift(Rsh<Reg<2>, Reg<1>, Reg<0>>{}), static_cast<uint32_t>(-7),
+       {0, 1, 0, 0}},
+  };
+
+  // Signed division by a power of two still truncates towards zero.
+  constexpr auto divide = Program<
+      Mov<Reg<0>, Literal<0>>, Sub<Reg<1>, Reg<0>, Literal<7>>,
+      Mov<Reg<2>, Literal<1>>, Lsh<Reg<2>, Reg<2>, Literal<31>>,
+      Div<Reg<3>, Reg<1>, Literal<4>>, Div<Reg<4>, Reg<1>, Literal<2>>,
+      Div<Reg<5>, Reg<1>, Literal<1>>, Divu<Reg<6>, Reg<1>, Literal<16>>,
+      Div<Reg<7>, Reg<2>, Literal<2>>, Div<Reg<8>, Reg<2>, Literal<0x8000>>,
+      Mov<Reg<9>, Literal<0x40>>, Div<Reg<10>, Reg<9>, Literal<8>>,
+      Halt>::load();
+
+  for (auto engine :
+       {CPU::Engine::SWITCH, CPU::Engine::THREADED, CPU::Engine::PREDECODED,
+        CPU::Engine::BLOCK, CPU::Engine::JIT}) {
+    for (auto &c : cases) {
+      CPU cpu{};
+      cpu.engine = engine;
+      cpu.load_rom(c.code);
+      cpu.run_until_halt();
+      REQUIRE_SAME(c.result, cpu.registers[2]);
+      REQUIRE_TRUE(cpu.status_reg() == c.status);
+    }
+
+    CPU cpu{};
+    cpu.engine = engine;
+    cpu.load_rom(divide);
+    cpu.run_until_halt();
+    REQUIRE_SAME(static_cast<uint32_t>(-1), cpu.registers[3]);
+    REQUIRE_SAME(static_cast<uint32_t>(-3), cpu.registers[4]);
+    REQUIRE_SAME(static_cast<uint32_t>(-7), cpu.registers[5]);
+    REQUIRE_SAME(0x0FFFFFFF, cpu.registers[6]);
+    REQUIRE_SAME(0xC0000000, cpu.registers[7]);
+    REQUIRE_SAME(0xFFFF0000, cpu.registers[8]);
+    REQUIRE_SAME(8, cpu.registers[10]);
+  }
+}
+
+TEST_CASE("Packed Pixel Ops Saturate, Average And Blend") {
+  using namespace Instructions;
+  // The host's SSE2 versions agree with the portable ones.
+  uint32_t x = 12345;
+  auto next = [&x] { return x = x * 1664525 + 1013904223; };
+  for (int i = 0; i < 100000; i++) {
+    auto a = next();
+    auto b = next();
+    REQUIRE_SAME(Packed::Portable::add_sat(a, b), Packed::add_sat(a, b));
+    REQUIRE_SAME(Packed::Portable::sub_sat(a, b), Packed::sub_sat(a, b));
+    REQUIRE_SAME(Packed::Portable::avg(a, b), Packed::avg(a, b));
+    REQUIRE_SAME(Packed::Portable::blend(a, b), Packed::blend(a, b));
+  }
+  for (uint32_t v = 0; v <= 255 * 255; v++)
+    REQUIRE_SAME((v + 127) / 255, Packed::Portable::div255(v));
+  // Opaque sources replace, transparent ones leave the destination.
+  REQUIRE_SAME(0xFF123456, Packed::blend(0xFF123456, 0x80ABCDEF));
+  REQUIRE_SAME(0x80ABCDEF, Packed::blend(0x00123456, 0x80ABCDEF));
+
+  constexpr auto code =
+      Program<Paddusb<Reg<3>, Reg<1>, Reg<2>>, Psubusb<Reg<4>, Reg<1>, Reg<2>>,
+              Pavgb<Reg<5>, Reg<1>, Reg<2>>, Pblend<Reg<6>, Reg<1>, Reg<2>>,
+              Paddusb<Reg<7>, Reg<0>, Reg<0>>, Halt>::load();
+  for (auto engine :
+       {CPU::Engine::SWITCH, CPU::Engine::THREADED, CPU::Engine::PREDECODED,
+        CPU::Engine::BLOCK, CPU::Engine::JIT}) {
+    CPU cpu{};
+    cpu.engine = engine;
+    cpu.load_rom(code);
+    cpu.registers[1] = 0x80FF4010;
+    cpu.registers[2] = 0x90205030;
+    cpu.run_until_halt();
+    REQUIRE_SAME(0xFFFF9040, cpu.registers[3]);
+    REQUIRE_SAME(0x00DF0000, cpu.registers[4]);
+    REQUIRE_SAME(0x88904820, cpu.registers[5]);
+    // Alpha is 0x80 + 0x90 * 127 / 255, colours (x * 128 + y * 127) / 255.
+    REQUIRE_SAME(0xC8904820, cpu.registers[6]);
+    REQUIRE_TRUE(cpu.flag_check(CPU::FLAG::ZERO, false));
+  }
+}
+
+TEST_CASE("Load Upper Immediate Builds 32-bit Constants") {
+  using namespace Instructions;
+  constexpr auto code =
+      Program<Lui<Reg<1>, Literal<0x80>>, Or<Reg<1>, Reg<1>, Literal<0x10>>,
+              Lui<Reg<2>, Literal<0x1234>>, Halt>::load();
+  for (auto engine :
+       {CPU::Engine::SWITCH, CPU::Engine::THREADED, CPU::Engine::PREDECODED,
+        CPU::Engine::BLOCK, CPU::Engine::JIT}) {
+    CPU cpu{};
+    cpu.engine = engine;
+    cpu.load_rom(code);
+    cpu.registers[2] = 0xFFFF;
+    cpu.run_until_halt();
+    REQUIRE_SAME(0x800010u, cpu.registers[1]);
+    // The low half is cleared, and the flags follow the result like MOV.
+    REQUIRE_SAME(0x12340000u, cpu.registers[2]);
+    REQUIRE_TRUE(cpu.flag_check(CPU::FLAG::ZERO, true));
+  }
+
+  // load_imm() picks the shortest sequence.
+  REQUIRE_SAME(std::size_t{1}, load_imm(1, 0xFFFF).size);
+  REQUIRE_SAME(std::size_t{1}, load_imm(1, 0x800000).size);
+  REQUIRE_SAME(std::size_t{2}, load_imm(1, 0x800010).size);
+}
+
 TEST_CASE("Cooperative Interrupt CIP") {
   using namespace Instructions;
   constexpr auto code =
@@ -154,3 +354,890 @@ TEST_CASE("Cooperative Interrupt CIP") {
     REQUIRE_SAME(11, cpu.registers[0]);
   }
 }
+
+namespace {
+// Same setup vm/main.cpp uses for the default line demo.
+auto lineDemoCpu(CPU::Engine engine) -> CPU {
+  CPU cpu{};
+  cpu.engine = engine;
+  cpu.load_rom(generate_line());
+  cpu.store(200, 10);
+  cpu.store(204, 20);
+  cpu.store(208, 15);
+  cpu.store(212, 15);
+  cpu.store(216, 0xFFFFFFFF);
+  return cpu;
+}
+} // namespace
+
+TEST_CASE("Threaded Engine Matches Switch Engine") {
+  auto reference = lineDemoCpu(CPU::Engine::SWITCH);
+  auto threaded = lineDemoCpu(CPU::Engine::THREADED);
+
+  // Long enough to draw the whole line, spin in the trailing loop and latch
+  // several VBLANK interrupts along the way.
+  REQUIRE_SAME(200000, reference.run_for(200000));
+  REQUIRE_SAME(200000, threaded.run_for(200000));
+
+  REQUIRE_TRUE(reference.registers == threaded.registers);
+  REQUIRE_TRUE(reference.status_reg() == threaded.status_reg());
+  REQUIRE_TRUE(reference.cip_interrupts == threaded.cip_interrupts);
+  REQUIRE_SAME(reference.get_pc(), threaded.get_pc());
+  for (uint32_t addr = 0; addr < 0x8000; addr += 4) {
+    REQUIRE_SAME(reference.load(addr), threaded.load(addr));
+  }
+}
+
+TEST_CASE("Threaded Engine Stops On Halt") {
+  using namespace Instructions;
+  constexpr auto code =
+      Program<Mov<Reg<0>, Literal<100>>, Add<Reg<1>, Reg<1>, Literal<1>>,
+              Sub<Reg<0>, Reg<0>, Literal<1>>, Bne<Target<-8>>, Halt>::load();
+
+  CPU cpu{};
+  cpu.engine = CPU::Engine::THREADED;
+  cpu.load_rom(code);
+  // 1 MOV + 100 * (ADD, SUB, BNE) + HALT
+  REQUIRE_SAME(302, cpu.run_for(1000));
+  REQUIRE_TRUE(cpu.halted);
+  REQUIRE_SAME(100, cpu.registers[1]);
+  REQUIRE_SAME(0, cpu.run_for(1000));
+}
+
+TEST_CASE("Predecoded Engine Matches Switch Engine") {
+  auto reference = lineDemoCpu(CPU::Engine::SWITCH);
+  auto predecoded = lineDemoCpu(CPU::Engine::PREDECODED);
+
+  REQUIRE_SAME(200000, reference.run_for(200000));
+  REQUIRE_SAME(200000, predecoded.run_for(200000));
+
+  REQUIRE_TRUE(reference.registers == predecoded.registers);
+  REQUIRE_TRUE(reference.status_reg() == predecoded.status_reg());
+  REQUIRE_TRUE(reference.cip_interrupts == predecoded.cip_interrupts);
+  REQUIRE_SAME(reference.get_pc(), predecoded.get_pc());
+  for (uint32_t addr = 0; addr < 0x8000; addr += 4) {
+    REQUIRE_SAME(reference.load(addr), predecoded.load(addr));
+  }
+}
+
+TEST_CASE("Predecoded Engine Sees Patched Code") {
+  using namespace Instructions;
+  constexpr auto code = Program<Mov<Reg<0>, Literal<1>>, Halt>::load();
+
+  CPU cpu{};
+  cpu.engine = CPU::Engine::PREDECODED;
+  cpu.load_rom(code);
+  cpu.run_until_halt();
+  REQUIRE_SAME(1, cpu.registers[0]);
+
+  // Same path the TUI editor takes: the store must drop the cached decode.
+  cpu.store(0, Mov<Reg<0>, Literal<2>>::emit());
+  cpu.set_pc(0);
+  cpu.halted = false;
+  cpu.run_until_halt();
+  REQUIRE_SAME(2, cpu.registers[0]);
+}
+
+TEST_CASE("Run Stops On Budget, VBLANK, Breakpoint And Halt") {
+  using namespace Instructions;
+  // R1 counts loop iterations; the loop body starts at address 4.
+  constexpr auto code =
+      Program<Mov<Reg<1>, Literal<0>>, Add<Reg<1>, Reg<1>, Literal<1>>,
+              Cmp<Reg<1>, Literal<30000>>, Bne<Target<-8>>, Halt>::load();
+
+  for (auto engine : {CPU::Engine::SWITCH, CPU::Engine::BLOCK,
+                      CPU::Engine::JIT}) {
+    CPU cpu{};
+    cpu.engine = engine;
+    cpu.load_rom(code);
+
+    auto result = cpu.run(1000);
+    REQUIRE_TRUE(result.reason == CPU::StopReason::BUDGET);
+    REQUIRE_SAME(1000, result.cycles);
+
+    // The frame runs out 49000 instructions later, well short of the budget.
+    result = cpu.run(1000000);
+    REQUIRE_TRUE(result.reason == CPU::StopReason::INTERRUPT);
+    REQUIRE_SAME(CPU::CYCLES_PER_FRAME - 1000, result.cycles);
+    REQUIRE_SAME(1, cpu.cip_interrupts[0]);
+
+    // Stops before the breakpoint instruction, then steps off it on resume.
+    cpu.breakpoints.insert(4);
+    result = cpu.run(1000000);
+    REQUIRE_TRUE(result.reason == CPU::StopReason::BREAKPOINT);
+    REQUIRE_SAME(4, cpu.get_pc());
+    auto iterations = cpu.registers[1];
+    result = cpu.run(1000000);
+    REQUIRE_TRUE(result.reason == CPU::StopReason::BREAKPOINT);
+    REQUIRE_SAME(3, result.cycles);
+    REQUIRE_SAME(iterations + 1, cpu.registers[1]);
+
+    cpu.breakpoints.clear();
+    result = cpu.run(1000000);
+    REQUIRE_TRUE(result.reason == CPU::StopReason::HALT);
+    REQUIRE_SAME(30000, cpu.registers[1]);
+    result = cpu.run(1000000);
+    REQUIRE_TRUE(result.reason == CPU::StopReason::HALT);
+    REQUIRE_SAME(0, result.cycles);
+  }
+}
+
+TEST_CASE("Guest Memory Is Committed On First Touch") {
+  CPU cpu{};
+  REQUIRE_TRUE(cpu.ram.committed_bytes() < 64 * 1024);
+
+  cpu.store(CPU::MEMORY_SIZE - 4, 0xDEADBEEF);
+  REQUIRE_SAME(0xDEADBEEF, cpu.load(CPU::MEMORY_SIZE - 4));
+  REQUIRE_SAME(0, cpu.load(CPU::MEMORY_SIZE / 2));
+
+  // The line demo only touches its code, a few words of data and the VRAM
+  // rows it draws on.
+  auto demo = lineDemoCpu(CPU::Engine::THREADED);
+  demo.run_for(1000000);
+  REQUIRE_TRUE(demo.ram.committed_bytes() < 1024 * 1024);
+}
+
+TEST_CASE("Restore Puts Back Registers, Memory And Code") {
+  using namespace Instructions;
+  // Overwrites its own first instruction with whatever is at 0x200, writes a
+  // marker far away from the program and halts.
+  constexpr auto code =
+      Program<Mov<Reg<1>, Literal<5>>, Load<Reg<4>, Reg<0>, Literal<0x200>>,
+              Store<Reg<4>, Reg<0>, Literal<0>>, Mov<Reg<2>, Literal<0x4000>>,
+              Lsh<Reg<2>, Reg<2>, Literal<8>>,
+              Store<Reg<1>, Reg<2>, Literal<0>>, Halt>::load();
+
+  for (auto engine : {CPU::Engine::SWITCH, CPU::Engine::BLOCK,
+                      CPU::Engine::JIT}) {
+    CPU cpu{};
+    cpu.engine = engine;
+    cpu.load_rom(code);
+    auto patch = Mov<Reg<1>, Literal<9>>::emit();
+    cpu.store(0x200, patch);
+    auto loaded = cpu.snapshot();
+
+    cpu.run_until_halt();
+    REQUIRE_SAME(5, cpu.load(0x400000));
+    REQUIRE_SAME(patch, cpu.load(0));
+
+    // Back to the freshly loaded image: the patched first word and the
+    // marker are gone, and the second run sees the original code again.
+    for (int run = 0; run < 3; run++) {
+      cpu.restore(loaded);
+      REQUIRE_TRUE(!cpu.halted);
+      REQUIRE_SAME(0, cpu.get_pc());
+      REQUIRE_SAME(0, cpu.registers[1]);
+      REQUIRE_SAME(0, cpu.load(0x400000));
+      REQUIRE_SAME(code[0], cpu.load(0));
+      cpu.run_until_halt();
+      REQUIRE_SAME(5, cpu.registers[1]);
+      REQUIRE_SAME(5, cpu.load(0x400000));
+    }
+
+    // A snapshot other than the latest one still restores exactly.
+    auto halted = cpu.snapshot();
+    cpu.restore(loaded);
+    REQUIRE_SAME(0, cpu.load(0x400000));
+    cpu.restore(halted);
+    REQUIRE_TRUE(cpu.halted);
+    REQUIRE_SAME(5, cpu.load(0x400000));
+
+    // Snapshots also carry over to other machines, and on from those.
+    CPU other{};
+    other.restore(halted);
+    auto copied = other.snapshot();
+    CPU third{};
+    third.restore(copied);
+    REQUIRE_SAME(5, third.load(0x400000));
+    REQUIRE_SAME(patch, third.load(0));
+  }
+}
+
+TEST_CASE("Block And JIT Engines Match Switch Engine") {
+  for (auto engine : {CPU::Engine::BLOCK, CPU::Engine::JIT}) {
+    auto reference = lineDemoCpu(CPU::Engine::SWITCH);
+    auto fast = lineDemoCpu(engine);
+
+    // Odd-sized batches so the budget regularly runs out mid-block.
+    for (int i = 0; i < 200; i++) {
+      REQUIRE_SAME(1013, reference.run_for(1013));
+      REQUIRE_SAME(1013, fast.run_for(1013));
+    }
+
+    REQUIRE_TRUE(reference.registers == fast.registers);
+    REQUIRE_TRUE(reference.status_reg() == fast.status_reg());
+    REQUIRE_TRUE(reference.cip_interrupts == fast.cip_interrupts);
+    REQUIRE_SAME(reference.get_pc(), fast.get_pc());
+    for (uint32_t addr = 0; addr < 0x8000; addr += 4) {
+      REQUIRE_SAME(reference.load(addr), fast.load(addr));
+    }
+  }
+}
+
+TEST_CASE("Block And JIT Engines Latch VBLANK On The Same Instruction") {
+  using namespace Instructions;
+  // Six-instruction straight line ending in a CIP, so VBLANK regularly falls
+  // due in the middle of a block.
+  constexpr auto code =
+      Program<Add<Reg<1>, Reg<1>, Literal<1>>, Add<Reg<1>, Reg<1>, Literal<1>>,
+              Add<Reg<1>, Reg<1>, Literal<1>>, Add<Reg<1>, Reg<1>, Literal<1>>,
+              Add<Reg<1>, Reg<1>, Literal<1>>, Cip<Target<0>>,
+              JmpRel<Target<-24>>>::load();
+
+  auto make = [&](CPU::Engine engine) {
+    CPU cpu{};
+    cpu.engine = engine;
+    cpu.load_rom(code);
+    // The ISR sums R1 as seen at each VBLANK, so any drift in when the
+    // interrupt is latched shows up in R2.
+    cpu.store(Fanta::Info::Cpu::INTERRUPT_BASE,
+              Add<Reg<2>, Reg<2>, Reg<1>>::emit());
+    cpu.store(Fanta::Info::Cpu::INTERRUPT_BASE + 4, Ret::emit());
+    return cpu;
+  };
+
+  for (auto engine : {CPU::Engine::BLOCK, CPU::Engine::JIT}) {
+    auto reference = make(CPU::Engine::SWITCH);
+    auto fast = make(engine);
+
+    REQUIRE_SAME(250001, reference.run_for(250001));
+    REQUIRE_SAME(250001, fast.run_for(250001));
+    REQUIRE_TRUE(reference.registers == fast.registers);
+    REQUIRE_SAME(reference.get_pc(), fast.get_pc());
+  }
+}
+
+TEST_CASE("CPUs On Separate Threads Do Not Share Frame State") {
+  using namespace Instructions;
+  // The ISR sums R1 at every VBLANK, so a frame counter shared between
+  // instances would show up as a different R2.
+  constexpr auto code =
+      Program<Add<Reg<1>, Reg<1>, Literal<1>>, Cip<Target<0>>,
+              JmpRel<Target<-8>>>::load();
+  auto make = [&] {
+    CPU cpu{};
+    cpu.load_rom(code);
+    cpu.store(Fanta::Info::Cpu::INTERRUPT_BASE,
+              Add<Reg<2>, Reg<2>, Reg<1>>::emit());
+    cpu.store(Fanta::Info::Cpu::INTERRUPT_BASE + 4, Ret::emit());
+    return cpu;
+  };
+
+  auto reference = make();
+  reference.run_for(500000);
+
+  std::vector<CPU> cpus;
+  for (int i = 0; i < 4; i++)
+    cpus.push_back(make());
+  std::vector<std::thread> threads;
+  for (auto &cpu : cpus)
+    threads.emplace_back([&cpu] {
+      // Small batches so the threads interleave as much as possible.
+      for (int i = 0; i < 500; i++)
+        cpu.run_for(1000);
+    });
+  for (auto &t : threads)
+    t.join();
+
+  for (auto &cpu : cpus) {
+    REQUIRE_TRUE(cpu.registers == reference.registers);
+    REQUIRE_SAME(reference.inst_count, cpu.inst_count);
+  }
+}
+
+TEST_CASE("Block And JIT Engines See Stores Into Running Code") {
+  using namespace Instructions;
+  // The STORE patches the MOV two words further on in the same block.
+  constexpr auto same_block =
+      Program<Load<Reg<4>, Reg<0>, Literal<0x200>>,
+              Store<Reg<4>, Reg<0>, Literal<12>>, Nop,
+              Mov<Reg<3>, Literal<1>>, Halt>::load();
+  // Count R1 to 3, then patch the loop's CMP to count to 5 instead and run
+  // the (by now translated and self-linked) loop again.
+  constexpr auto other_block =
+      Program<Add<Reg<1>, Reg<1>, Literal<1>>, Cmp<Reg<1>, Literal<3>>,
+              Bne<Target<-8>>, Cmp<Reg<2>, Literal<0>>, Bne<Target<20>>,
+              Load<Reg<4>, Reg<0>, Literal<0x200>>,
+              Store<Reg<4>, Reg<0>, Literal<4>>,
+              Add<Reg<2>, Reg<2>, Literal<1>>, JmpRel<Target<-32>>,
+              Halt>::load();
+
+  for (auto engine :
+       {CPU::Engine::SWITCH, CPU::Engine::BLOCK, CPU::Engine::JIT}) {
+    CPU cpu{};
+    cpu.engine = engine;
+    cpu.load_rom(same_block);
+    cpu.store(0x200, Mov<Reg<3>, Literal<7>>::emit());
+    REQUIRE_SAME(5, cpu.run_for(100));
+    REQUIRE_SAME(7, cpu.registers[3]);
+
+    CPU looping{};
+    looping.engine = engine;
+    looping.load_rom(other_block);
+    looping.store(0x200, Cmp<Reg<1>, Literal<5>>::emit());
+    looping.run_for(1000);
+    REQUIRE_TRUE(looping.halted);
+    REQUIRE_SAME(5, looping.registers[1]);
+  }
+}
+
+TEST_CASE("JIT Leaves For The Dispatcher On A Misaligned Return") {
+  using namespace Instructions;
+  // Run from 0x40 so nothing is translated at 0: RET to address 1 then
+  // probes that empty lookup slot.
+  constexpr auto code =
+      Program<Mov<Reg<1>, Literal<1>>, Push<Target<1>>, Ret, Halt>::load();
+  auto run = [&](CPU::Engine engine) {
+    CPU cpu{};
+    cpu.engine = engine;
+    for (uint32_t i = 0; i < code.size(); i++)
+      cpu.store(0x40 + i * 4, code[i]);
+    cpu.set_pc(0x40);
+    cpu.run_for(100);
+    return cpu;
+  };
+  auto reference = run(CPU::Engine::SWITCH);
+  auto jit = run(CPU::Engine::JIT);
+  REQUIRE_SAME(reference.get_pc(), jit.get_pc());
+  REQUIRE_TRUE(jit.registers == reference.registers);
+  REQUIRE_TRUE(jit.halted == reference.halted);
+}
+
+namespace {
+using namespace Instructions;
+// Sets up R1 = 5, R2 = start of VRAM, R3 = 256 bytes below it and R4 = 256
+// bytes before its end, then runs `Tail`. Rows are 1280 bytes.
+template <typename... Tail>
+using VramProgram =
+    Program<Mov<Reg<1>, Literal<5>>, Mov<Reg<2>, Literal<0x8000>>,
+            Lsh<Reg<2>, Reg<2>, Literal<8>>, Mov<Reg<3>, Literal<0x7FFF>>,
+            Lsh<Reg<3>, Reg<3>, Literal<8>>, Mov<Reg<4>, Literal<0x84AF>>,
+            Lsh<Reg<4>, Reg<4>, Literal<8>>, Tail...>;
+} // namespace
+
+TEST_CASE("VRAM Stores Report Dirty Rows") {
+  using namespace Instructions;
+  // Rows 3 and 10, then a misaligned word across the end of row 20.
+  constexpr auto rows = VramProgram<Store<Reg<1>, Reg<2>, Literal<3848>>,
+                                    Store<Reg<1>, Reg<2>, Literal<12800>>,
+                                    Store<Reg<1>, Reg<2>, Literal<26878>>,
+                                    Halt>::load();
+  // Words straddling either end of VRAM dirty only the row they reach into.
+  constexpr auto below =
+      VramProgram<Store<Reg<1>, Reg<3>, Literal<0xFE>>, Halt>::load();
+  constexpr auto above =
+      VramProgram<Store<Reg<1>, Reg<4>, Literal<0xFE>>, Halt>::load();
+  constexpr auto outside =
+      VramProgram<Store<Reg<1>, Reg<4>, Literal<0x100>>,
+                  Store<Reg<1>, Reg<3>, Literal<0>>, Halt>::load();
+
+  for (auto engine : {CPU::Engine::SWITCH, CPU::Engine::THREADED,
+                      CPU::Engine::BLOCK, CPU::Engine::JIT}) {
+    auto run = [engine](const auto &code) {
+      CPU cpu{};
+      cpu.engine = engine;
+      cpu.load_rom(code);
+      // Nothing has been presented yet, so everything starts dirty.
+      auto first = cpu.take_vram_dirty();
+      REQUIRE_SAME(0, first.first);
+      REQUIRE_SAME(CPU::VRAM_HEIGHT, first.end);
+      REQUIRE_TRUE(cpu.take_vram_dirty().empty());
+      cpu.run_until_halt();
+      return cpu.take_vram_dirty();
+    };
+
+    auto written = run(rows);
+    REQUIRE_SAME(3, written.first);
+    REQUIRE_SAME(22, written.end);
+    auto from_below = run(below);
+    REQUIRE_SAME(0, from_below.first);
+    REQUIRE_SAME(1, from_below.end);
+    auto from_above = run(above);
+    REQUIRE_SAME(239, from_above.first);
+    REQUIRE_SAME(240, from_above.end);
+    REQUIRE_TRUE(run(outside).empty());
+  }
+
+  // Restoring rewrites VRAM pages behind the guest's back.
+  CPU cpu{};
+  cpu.load_rom(rows);
+  auto loaded = cpu.snapshot();
+  cpu.run_until_halt();
+  cpu.take_vram_dirty();
+  cpu.restore(loaded);
+  auto restored = cpu.take_vram_dirty();
+  REQUIRE_TRUE(!restored.empty() && restored.first <= 3 && restored.end >= 22);
+}
+
+TEST_CASE("Block Fill And Copy") {
+  using namespace Instructions;
+  // Clears all of VRAM: 76800 words, 64 per MEMSET.
+  constexpr auto clear =
+      VramProgram<Mov<Reg<5>, Literal<0x12C0>>, Lsh<Reg<5>, Reg<5>, Literal<4>>,
+                  Mov<Reg<6>, Literal<0x1234>>, Memset<Reg<2>, Reg<6>, Reg<5>>,
+                  Halt>::load();
+  // R1 = 0x4000: copy 8 words down by 2, then 8 words up by 1, then 4 words
+  // across the end of memory, then nothing.
+  constexpr auto copies = Program<
+      Mov<Reg<1>, Literal<0x4000>>, Add<Reg<2>, Reg<1>, Literal<8>>,
+      Mov<Reg<3>, Literal<8>>, Memcpy<Reg<1>, Reg<2>, Reg<3>>,
+      Mov<Reg<4>, Literal<0x5000>>, Add<Reg<5>, Reg<4>, Literal<4>>,
+      Mov<Reg<3>, Literal<8>>, Memcpy<Reg<5>, Reg<4>, Reg<3>>,
+      Mov<Reg<6>, Literal<0x2000>>, Lsh<Reg<6>, Reg<6>, Literal<12>>,
+      Sub<Reg<6>, Reg<6>, Literal<8>>, Mov<Reg<3>, Literal<4>>,
+      Memcpy<Reg<6>, Reg<4>, Reg<3>>, Memcpy<Reg<1>, Reg<2>, Reg<3>>,
+      Halt>::load();
+  auto load_copies = [&](CPU &cpu) {
+    cpu.load_rom(copies);
+    for (uint32_t i = 0; i < 10; i++) {
+      cpu.store(0x4000 + 4 * i, 100 + i);
+      cpu.store(0x5000 + 4 * i, 200 + i);
+    }
+  };
+
+  for (auto engine :
+       {CPU::Engine::SWITCH, CPU::Engine::THREADED, CPU::Engine::PREDECODED,
+        CPU::Engine::BLOCK, CPU::Engine::JIT}) {
+    CPU cpu{};
+    cpu.engine = engine;
+    cpu.load_rom(clear);
+    cpu.take_vram_dirty();
+    // Each MEMSET moves at most 64 words and then runs again.
+    auto result = cpu.run(1 << 20);
+    REQUIRE_TRUE(result.reason == CPU::StopReason::HALT);
+    REQUIRE_SAME(uint64_t{7 + 3 + 1200 + 1}, result.cycles);
+    REQUIRE_SAME(CPU::VRAM_BASE + CPU::VRAM_BYTES, cpu.registers[2]);
+    REQUIRE_SAME(0, cpu.registers[5]);
+    REQUIRE_SAME(0x1234, cpu.load(CPU::VRAM_BASE));
+    REQUIRE_SAME(0x1234, cpu.load(CPU::VRAM_BASE + CPU::VRAM_BYTES - 4));
+    REQUIRE_SAME(0, cpu.load(CPU::VRAM_BASE + CPU::VRAM_BYTES));
+    auto dirty = cpu.take_vram_dirty();
+    REQUIRE_SAME(0, dirty.first);
+    REQUIRE_SAME(CPU::VRAM_HEIGHT, dirty.end);
+
+    CPU copy{};
+    copy.engine = engine;
+    load_copies(copy);
+    copy.run_until_halt();
+    // A destination below the source moves the block like memmove.
+    for (uint32_t i = 0; i < 8; i++)
+      REQUIRE_SAME(102 + i, copy.load(0x4000 + 4 * i));
+    REQUIRE_SAME(0x4020, copy.registers[1]);
+    REQUIRE_SAME(0x4028, copy.registers[2]);
+    // One just above it repeats the first word.
+    for (uint32_t i = 0; i < 9; i++)
+      REQUIRE_SAME(200, copy.load(0x5000 + 4 * i));
+    REQUIRE_SAME(209, copy.load(0x5024));
+    // Words past the end of memory are dropped.
+    REQUIRE_SAME(200, copy.load(CPU::MEMORY_SIZE - 8));
+    REQUIRE_SAME(209, copy.load(CPU::MEMORY_SIZE - 4));
+    REQUIRE_SAME(static_cast<uint32_t>(CPU::MEMORY_SIZE + 8),
+                 copy.registers[6]);
+    REQUIRE_SAME(0, copy.registers[3]);
+  }
+
+  // Observers see every word, and an observed run agrees with the engines.
+  CPU plain{};
+  load_copies(plain);
+  plain.run_until_halt();
+  CPU observed{};
+  load_copies(observed);
+  StoreLog log;
+  observed.run_observed(1000, log);
+  REQUIRE_SAME(std::size_t{8 + 8 + 2}, log.stores.size());
+  REQUIRE_TRUE(observed.registers == plain.registers);
+  for (uint32_t addr = 0x4000; addr < 0x5040; addr += 4)
+    REQUIRE_SAME(plain.load(addr), observed.load(addr));
+
+  // A trace records and replays more than three stores per instruction.
+  auto path = (std::filesystem::temp_directory_path() / "fanta_block_test.ftr")
+                  .string();
+  {
+    CPU cpu{};
+    cpu.load_rom(clear);
+    TraceWriter writer(cpu, path);
+    cpu.run_observed(1 << 20, writer);
+    writer.finish();
+  }
+  TraceReader trace(path);
+  TraceReader::Record record;
+  uint32_t most = 0;
+  while (trace.next(record))
+    most = std::max(most, record.nmems);
+  REQUIRE_SAME(CPU::BLOCK_WORDS, most);
+  REQUIRE_SAME(0x1234, trace.load(CPU::VRAM_BASE + CPU::VRAM_BYTES - 4));
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("Frame Scheduler Runs Whole VBLANK Frames") {
+  FrameScheduler::Config unthrottled;
+  unthrottled.pacing = FrameScheduler::Pacing::UNTHROTTLED;
+  auto cpu = lineDemoCpu(CPU::Engine::THREADED);
+  FrameScheduler scheduler(cpu, unthrottled);
+  for (int i = 0; i < 3; i++) {
+    auto frame = scheduler.advance();
+    REQUIRE_SAME(1, frame.frames);
+    REQUIRE_SAME(0, frame.skipped);
+    REQUIRE_SAME(CPU::CYCLES_PER_FRAME, frame.cycles);
+    REQUIRE_SAME(1, cpu.cip_interrupts[0]);
+    cpu.cip_interrupts[0] = 0;
+  }
+  auto stats = scheduler.stats();
+  REQUIRE_SAME(3, stats.frames);
+  REQUIRE_SAME(3ull * CPU::CYCLES_PER_FRAME, stats.cycles);
+  REQUIRE_TRUE(stats.guest_mhz > 0 && stats.p50_ms <= stats.max_ms);
+
+  // A frame is due every microsecond, which no host can keep up with, so
+  // every advance() runs max_skip frames unpresented and then resyncs.
+  FrameScheduler::Config realtime;
+  realtime.fps = 1e6;
+  realtime.max_skip = 2;
+  FrameScheduler behind(cpu, realtime);
+  for (int i = 0; i < 2; i++) {
+    auto frame = behind.advance();
+    REQUIRE_SAME(3, frame.frames);
+    REQUIRE_SAME(2, frame.skipped);
+  }
+
+  // Once halted there is nothing to run, but frames are still paced.
+  CPU stopped{};
+  stopped.halted = true;
+  FrameScheduler idle(stopped, realtime);
+  auto frame = idle.advance();
+  REQUIRE_TRUE(frame.halted);
+  REQUIRE_SAME(0, frame.frames);
+}
+
+TEST_CASE("Triple Buffer And SPSC Queue Hand Values Between Threads") {
+  constexpr uint32_t COUNT = 20000;
+
+  // Each value is published as a pair the reader can check for tearing.
+  TripleBuffer<std::pair<uint32_t, uint32_t>> latest;
+  std::thread writer([&] {
+    for (uint32_t i = 1; i <= COUNT; i++) {
+      latest.back() = {i, ~i};
+      latest.publish();
+    }
+  });
+  uint32_t seen = 0;
+  bool consistent = true;
+  while (seen < COUNT) {
+    if (!latest.update())
+      continue;
+    auto [value, check] = latest.front();
+    consistent &= check == ~value && value > seen;
+    seen = value;
+  }
+  writer.join();
+  REQUIRE_TRUE(consistent);
+  REQUIRE_TRUE(!latest.update());
+
+  // Nothing is lost or reordered, and a full queue refuses instead of
+  // blocking.
+  SpscQueue<uint32_t, 16> queue;
+  std::thread producer([&] {
+    for (uint32_t i = 0; i < COUNT; i++)
+      while (!queue.push(i))
+        std::this_thread::yield();
+  });
+  uint32_t expected = 0;
+  while (expected < COUNT) {
+    if (auto v = queue.pop()) {
+      consistent &= *v == expected;
+      expected++;
+    }
+  }
+  producer.join();
+  REQUIRE_TRUE(consistent);
+  REQUIRE_TRUE(!queue.pop());
+  for (uint32_t i = 0; i < 16; i++)
+    REQUIRE_TRUE(queue.push(i));
+  REQUIRE_TRUE(!queue.push(16));
+}
+
+TEST_CASE("Conditional Breakpoints And Watchpoints Stop Run") {
+  using namespace Instructions;
+  // Counts R1 to 100, storing it to 0x1000 and reading 0x1004 each time.
+  constexpr auto code =
+      Program<Mov<Reg<1>, Literal<0>>, Mov<Reg<0>, Literal<0x1000>>,
+              Add<Reg<1>, Reg<1>, Literal<1>>, Store<Reg<1>, Reg<0>, Literal<0>>,
+              Load<Reg<2>, Reg<0>, Literal<4>>, Cmp<Reg<1>, Literal<100>>,
+              Bne<Target<-16>>, Halt>::load();
+
+  CPU cpu{};
+  cpu.load_rom(code);
+  REQUIRE_TRUE(DebugSpec::add_breakpoint(cpu, "8 if r1 >= 10"));
+  auto result = cpu.run(1000000);
+  REQUIRE_TRUE(result.reason == CPU::StopReason::BREAKPOINT);
+  REQUIRE_SAME(8, cpu.get_pc());
+  REQUIRE_SAME(10, cpu.registers[1]);
+
+  // Watchpoints stop right after the access, whichever end of the word.
+  DebugSpec::clear(cpu);
+  REQUIRE_TRUE(DebugSpec::add_watchpoint(cpu, "0x1004/r"));
+  result = cpu.run(1000000);
+  REQUIRE_TRUE(result.reason == CPU::StopReason::WATCHPOINT);
+  REQUIRE_SAME(3, result.cycles);
+  REQUIRE_SAME(16, cpu.watch_hit.pc);
+  REQUIRE_SAME(0x1004, cpu.watch_hit.addr);
+  REQUIRE_TRUE(!cpu.watch_hit.write);
+
+  DebugSpec::clear(cpu);
+  REQUIRE_TRUE(DebugSpec::add_watchpoint(cpu, "0x1003:2/w"));
+  result = cpu.run(1000000);
+  REQUIRE_TRUE(result.reason == CPU::StopReason::WATCHPOINT);
+  REQUIRE_SAME(12, cpu.watch_hit.pc);
+  REQUIRE_SAME(12, cpu.watch_hit.value);
+  REQUIRE_TRUE(cpu.watch_hit.write);
+
+  // Writes elsewhere on the page and reads of a write-only watch pass.
+  DebugSpec::clear(cpu);
+  REQUIRE_TRUE(DebugSpec::add_watchpoint(cpu, "0x1008:0x100"));
+  REQUIRE_TRUE(DebugSpec::add_watchpoint(cpu, "0x1004"));
+  result = cpu.run(1000000);
+  REQUIRE_TRUE(result.reason == CPU::StopReason::HALT);
+  REQUIRE_SAME(100, cpu.registers[1]);
+
+  REQUIRE_TRUE(!DebugSpec::add_breakpoint(cpu, "8 if R16 == 1"));
+  REQUIRE_TRUE(!DebugSpec::add_breakpoint(cpu, "8 if Q < 1"));
+  REQUIRE_TRUE(!DebugSpec::add_watchpoint(cpu, "0x10/x"));
+}
+
+TEST_CASE("Breakpoints Fire On The First Instruction Of A Run") {
+  using namespace Instructions;
+  constexpr auto code =
+      Program<Add<Reg<1>, Reg<1>, Literal<1>>, JmpRel<Target<-4>>>::load();
+
+  // From reset: the breakpoint at 0 stops before anything runs, then
+  // resuming executes it and the loop comes back round to it.
+  CPU cpu{};
+  cpu.load_rom(code);
+  REQUIRE_TRUE(DebugSpec::add_breakpoint(cpu, "0"));
+  auto result = cpu.run(10);
+  REQUIRE_TRUE(result.reason == CPU::StopReason::BREAKPOINT);
+  REQUIRE_SAME(0, result.cycles);
+  result = cpu.run(10);
+  REQUIRE_TRUE(result.reason == CPU::StopReason::BREAKPOINT);
+  REQUIRE_SAME(2, result.cycles);
+
+  // Right after a VBLANK stop: the next run starts on the breakpoint.
+  CPU reference{};
+  reference.load_rom(code);
+  auto frame = reference.run(2 * CPU::CYCLES_PER_FRAME);
+  REQUIRE_TRUE(frame.reason == CPU::StopReason::INTERRUPT);
+  CPU paused{};
+  paused.load_rom(code);
+  REQUIRE_TRUE(DebugSpec::add_breakpoint(
+      paused, std::to_string(reference.get_pc()) + " if R1 == " +
+                  std::to_string(reference.registers[1])));
+  result = paused.run(2 * CPU::CYCLES_PER_FRAME);
+  REQUIRE_TRUE(result.reason == CPU::StopReason::INTERRUPT);
+  REQUIRE_SAME(frame.cycles, result.cycles);
+  result = paused.run(2 * CPU::CYCLES_PER_FRAME);
+  REQUIRE_TRUE(result.reason == CPU::StopReason::BREAKPOINT);
+  REQUIRE_SAME(0, result.cycles);
+  REQUIRE_SAME(reference.get_pc(), paused.get_pc());
+}
+
+TEST_CASE("Store Log Records Old And New Words") {
+  using namespace Instructions;
+  constexpr auto code =
+      Program<Mov<Reg<0>, Literal<0x100>>, Mov<Reg<1>, Literal<20>>,
+              Store<Reg<1>, Reg<0>, Literal<0>>, Mov<Reg<1>, Literal<30>>,
+              Store<Reg<1>, Reg<0>, Literal<0>>, Call<Target<8>>, Halt,
+              Halt>::load();
+
+  CPU cpu{};
+  cpu.load_rom(code);
+  StoreLog log;
+  REQUIRE_SAME(7, cpu.run_observed(UINT64_MAX, log));
+  REQUIRE_SAME(3, log.stores.size());
+  auto first = log.stores[0];
+  REQUIRE_SAME(0x100, first.addr);
+  REQUIRE_SAME(0, first.old_value);
+  REQUIRE_SAME(20, first.new_value);
+  auto second = log.stores[1];
+  REQUIRE_SAME(20, second.old_value);
+  REQUIRE_SAME(30, second.new_value);
+  // CALL pushes its return address.
+  auto call = log.stores[2];
+  REQUIRE_SAME(0x7FFFFF, call.addr);
+  REQUIRE_SAME(0x18, call.new_value);
+}
+
+TEST_CASE("Profiler Counts PCs, Branches And Calls") {
+  using namespace Instructions;
+  // Calls 0x14 three times from a loop, then halts.
+  constexpr auto code =
+      Program<Mov<Reg<1>, Literal<3>>, Call<Target<0x10>>,
+              Sub<Reg<1>, Reg<1>, Literal<1>>, Bne<Target<-8>>, Halt,
+              Add<Reg<0>, Reg<0>, Literal<1>>, Ret>::load();
+
+  CPU reference{};
+  reference.load_rom(code);
+  reference.run_until_halt();
+
+  CPU cpu{};
+  cpu.load_rom(code);
+  Profiler profile;
+  REQUIRE_SAME(17, cpu.run_observed(UINT64_MAX, profile));
+  REQUIRE_TRUE(cpu.halted);
+  REQUIRE_TRUE(reference.registers == cpu.registers);
+  REQUIRE_SAME(17, profile.total());
+
+  REQUIRE_SAME(1, profile.site(0x0).count);
+  REQUIRE_SAME(3, profile.site(0x14).count);
+  REQUIRE_SAME(0, profile.site(0x20).count);
+  auto loop = profile.site(0xC);
+  REQUIRE_SAME(3, loop.count);
+  REQUIRE_SAME(2, loop.taken);
+
+  namespace Op = Fanta::Info::Instructions;
+  REQUIRE_SAME(3, profile.opcode_counts()[Op::CALL]);
+  REQUIRE_SAME(3, profile.opcode_counts()[Op::RET]);
+  REQUIRE_SAME(1, profile.opcode_counts()[Op::HALT]);
+  REQUIRE_SAME(1, profile.call_counts().size());
+  REQUIRE_SAME(3, profile.call_counts().at(0x14));
+
+  auto hottest = profile.hot_spots(1);
+  REQUIRE_SAME(1, hottest.size());
+  REQUIRE_SAME(0x4, hottest[0].first);
+
+  // CALL retires in the caller and RET in the callee.
+  auto stacks = profile.folded(
+      [](uint32_t entry) { return entry ? "inc" : "main"; });
+  REQUIRE_SAME(std::string{"main 11\nmain;inc 6\n"}, stacks);
+}
+
+TEST_CASE("Binary Trace Rebuilds State At Any Cycle") {
+  auto path = (std::filesystem::temp_directory_path() / "fanta_cpu_test.ftr")
+                  .string();
+  // Spans a VBLANK, so the trace includes the CIP into the handler.
+  constexpr uint64_t cycles = 60000;
+  {
+    auto cpu = lineDemoCpu(CPU::Engine::SWITCH);
+    TraceWriter writer(cpu, path);
+    REQUIRE_SAME(cycles, cpu.run_observed(cycles, writer));
+    writer.finish();
+  }
+
+  auto reference = lineDemoCpu(CPU::Engine::SWITCH);
+  TraceReader trace(path);
+  REQUIRE_SAME(cycles, trace.records());
+
+  auto matches = [&](CPU &cpu) {
+    if (trace.registers() != cpu.registers ||
+        trace.flags() != cpu.status_reg() || trace.pc() != cpu.get_pc())
+      return false;
+    for (uint32_t addr = 0; addr < 0x8000; addr += 4)
+      if (trace.load(addr) != cpu.load(addr))
+        return false;
+    for (uint32_t off = 0; off < CPU::VRAM_BYTES; off += 4)
+      if (trace.load(CPU::VRAM_BASE + off) != cpu.load(CPU::VRAM_BASE + off))
+        return false;
+    return true;
+  };
+
+  // Records carry the word that ran and the state after it.
+  TraceReader::Record record;
+  uint64_t cycle = 0;
+  for (; cycle < 2000; cycle++) {
+    auto pc = reference.get_pc();
+    auto raw = reference.load(pc);
+    reference.run_cycle();
+    REQUIRE_TRUE(trace.next(record));
+    REQUIRE_SAME(cycle, record.cycle);
+    REQUIRE_SAME(pc, record.pc);
+    REQUIRE_SAME(raw, record.raw);
+    REQUIRE_TRUE(trace.registers() == reference.registers);
+  }
+  REQUIRE_TRUE(matches(reference));
+
+  for (uint64_t target : {uint64_t{31337}, cycles}) {
+    for (; cycle < target; cycle++)
+      reference.run_cycle();
+    REQUIRE_TRUE(trace.seek(target));
+    REQUIRE_TRUE(matches(reference));
+  }
+  REQUIRE_TRUE(!trace.next(record));
+  REQUIRE_TRUE(!trace.seek(cycles + 1));
+
+  // Seeking backwards replays from the start.
+  auto fresh = lineDemoCpu(CPU::Engine::SWITCH);
+  REQUIRE_TRUE(trace.seek(0));
+  REQUIRE_TRUE(matches(fresh));
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("History Steps Back Through Undo Log And Checkpoints") {
+  // The line demo as it was after `cycles` instructions.
+  auto at = [](uint64_t cycles) {
+    auto cpu = lineDemoCpu(CPU::Engine::SWITCH);
+    for (uint64_t i = 0; i < cycles; i++)
+      cpu.run_cycle();
+    return cpu;
+  };
+  auto same = [](CPU &a, CPU &b) {
+    if (a.registers != b.registers || a.status_reg() != b.status_reg() ||
+        a.get_pc() != b.get_pc())
+      return false;
+    for (uint32_t addr = 0; addr < 0x8000; addr += 4)
+      if (a.load(addr) != b.load(addr))
+        return false;
+    for (uint32_t off = 0; off < CPU::VRAM_BYTES; off += 4)
+      if (a.load(CPU::VRAM_BASE + off) != b.load(CPU::VRAM_BASE + off))
+        return false;
+    return true;
+  };
+
+  auto cpu = lineDemoCpu(CPU::Engine::THREADED);
+  History history(1000, 8, 256);
+  uint64_t ran = 0;
+  while (ran < 5000)
+    ran += history.run(cpu, 5000 - ran).cycles;
+  for (int i = 0; i < 300; i++)
+    history.step(cpu);
+  REQUIRE_SAME(5300, history.cycle());
+  auto now = at(5300);
+  REQUIRE_TRUE(same(cpu, now));
+
+  // Out of the undo log.
+  history.step_back(cpu);
+  auto one_back = at(5299);
+  REQUIRE_TRUE(same(cpu, one_back));
+  // Past it: restore the checkpoint at 3000 and replay.
+  history.step_back(cpu, 2000);
+  REQUIRE_SAME(3299, history.cycle());
+  auto far_back = at(3299);
+  REQUIRE_TRUE(same(cpu, far_back));
+  history.step_back(cpu);
+  auto next_back = at(3298);
+  REQUIRE_TRUE(same(cpu, next_back));
+  history.seek(cpu, 5300);
+  REQUIRE_TRUE(same(cpu, now));
+
+  // A VBLANK falls inside; only the newest 8 checkpoints are kept.
+  while (history.cycle() < 60000)
+    history.run(cpu, 60000 - history.cycle());
+  REQUIRE_SAME(8, history.checkpoints());
+  REQUIRE_SAME(53000, history.oldest());
+  history.seek(cpu, 0);
+  REQUIRE_SAME(53000, history.cycle());
+  auto oldest = at(53000);
+  REQUIRE_TRUE(same(cpu, oldest));
+
+  // Reverse-continue lands on the last time the PC was at a breakpoint.
+  history.seek(cpu, 60000);
+  auto probe = at(57000);
+  cpu.breakpoints.insert(probe.get_pc());
+  uint64_t last_hit = 0;
+  for (uint64_t c = 57000; c < 60000; c++) {
+    if (probe.get_pc() == *cpu.breakpoints.begin())
+      last_hit = c;
+    probe.run_cycle();
+  }
+  REQUIRE_TRUE(history.reverse_continue(cpu));
+  REQUIRE_SAME(last_hit, history.cycle());
+  auto hit = at(last_hit);
+  REQUIRE_TRUE(same(cpu, hit));
+}
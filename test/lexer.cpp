@@ -70,6 +70,22 @@ TEST_CASE("Basic Symbol Lexing") {
   Lexer arrow_lex{case2};
   auto res2 = arrow_lex.getToken();
   REQUIRE_TOKEN_TYPE(Lexer::TokenType::Arrow, res2);
+
+  std::string case3 = "%";
+  Lexer percent_lex{case3};
+  auto res3 = percent_lex.getToken();
+  REQUIRE_TOKEN_TYPE(Lexer::TokenType::Percent, res3);
+
+  std::string case4 = "<< >> <= >";
+  Lexer shift_lex{case4};
+  auto res4 = shift_lex.getToken();
+  REQUIRE_TOKEN_TYPE(Lexer::TokenType::ShiftLeft, res4);
+  res4 = shift_lex.getToken();
+  REQUIRE_TOKEN_TYPE(Lexer::TokenType::ShiftRight, res4);
+  res4 = shift_lex.getToken();
+  REQUIRE_TOKEN_TYPE(Lexer::TokenType::LesserEq, res4);
+  res4 = shift_lex.getToken();
+  REQUIRE_TOKEN_TYPE(Lexer::TokenType::Greater, res4);
 }
 
 TEST_CASE("Arrow and Minus Symbol Lexing") {
@@ -23,6 +23,40 @@ TEST_CASE("Parse add") {
   auto var5 = assembler.assemble("BNE -4", 0);
   auto expected5 = Instructions::parse_one(0xB, -0x4);
   REQUIRE_SAME(expected5, var5);
+
+  // NOP and HALT share a format but not an opcode.
+  auto var6 = assembler.assemble("NOP", 0);
+  REQUIRE_SAME(Instructions::Nop::emit(), var6);
+  auto var7 = assembler.assemble("HALT", 0);
+  REQUIRE_SAME(0, var7);
+
+  // Register-only instructions reject an immediate.
+  auto var8 = assembler.assemble("PBLEND R1, R2, R3", 0);
+  auto expected8 = Instructions::parse_three(0x34, 1, 2, 3, false);
+  REQUIRE_SAME(expected8, var8);
+  auto var9 = assembler.assemble("PADDUSB R1, R2, $10", 0);
+  REQUIRE_SAME(UINT32_MAX, var9);
+
+  // And LUI takes only an immediate.
+  auto var10 = assembler.assemble("LUI R1, $80", 0);
+  REQUIRE_SAME(Instructions::Emitter::two_op_imm(0x35, 1, 0x80), var10);
+  auto var11 = assembler.assemble("LUI R1, R2", 0);
+  REQUIRE_SAME(UINT32_MAX, var11);
+}
+
+TEST_CASE("LI expands to the shortest sequence") {
+  Assembler assem{};
+  std::vector<std::string> code = {"START:", "  li r1, $5", "  LI R2, $800000",
+                                   "  LI R3, $800010", "  BNE START"};
+  auto lines = assem.expand_pseudo_ops(code);
+  std::vector<std::string> expected = {
+      "START:",       "  MOV R1, $5",     "  LUI R2, $80",
+      "  LUI R3, $80", "  OR R3, R3, $10", "  BNE START"};
+  REQUIRE_TRUE(lines == expected);
+
+  auto li = Instructions::load_imm(3, 0x800010);
+  REQUIRE_SAME(li.words[0], assem.assemble(lines[3], 12));
+  REQUIRE_SAME(li.words[1], assem.assemble(lines[4], 16));
 }
 
 TEST_CASE("Labels") {
@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <iostream>
+#include <optional>
+#include <print>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cpu.hpp"
+#include "program.hpp"
+#include "work_stealing_pool.hpp"
+
+// Runs many programs (or many seeds of one program) in parallel, one CPU per
+// job, and reports how each one ended. Meant for regression farms: every job
+// is independent, so throughput scales with the number of workers.
+
+namespace {
+
+struct Job {
+    size_t program;             // Index into the loaded images
+    std::optional<uint32_t> seed;
+};
+
+struct JobResult {
+    uint64_t cycles = 0;
+    double wall_ms = 0;
+    bool halted = false;
+    std::array<uint32_t, 17> registers{};
+};
+
+void usage() {
+    std::println(std::cerr,
+        "Usage: fanta-batch [--jobs N] [--seeds N] [--seed-reg R] [--limit N]\n"
+        "                   [--engine switch|threaded|predecoded|block|jit]\n"
+        "                   <program.bin|program.asm>...\n"
+        "\n"
+        "  --jobs N      Worker threads (default: one per hardware thread)\n"
+        "  --seeds N     Run every program N times with R<seed-reg> = 0..N-1\n"
+        "  --seed-reg R  Register that receives the seed (default 1)\n"
+        "  --limit N     Instruction limit per job (default 100000000)");
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+    std::optional<uint32_t> seeds;
+    uint32_t seed_reg = 1;
+    uint64_t limit = 100'000'000;
+    std::optional<CPU::Engine> engine; // CPU default unless given
+    std::vector<std::string> files;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+            if (arg == "--jobs" && has_value) {
+                workers = std::stoul(argv[++i]);
+            } else if (arg == "--seeds" && has_value) {
+                seeds = std::stoul(argv[++i]);
+            } else if (arg == "--seed-reg" && has_value) {
+                seed_reg = std::stoul(argv[++i]);
+            } else if (arg == "--limit" && has_value) {
+                limit = std::stoull(argv[++i]);
+            } else if (arg == "--engine" && has_value) {
+                auto e = engine_from_name(argv[++i]);
+                if (!e) {
+                    std::println(std::cerr, "Error: Unknown engine {}", argv[i]);
+                    return 1;
+                }
+                engine = e;
+            } else if (arg.starts_with("--")) {
+                usage();
+                return 1;
+            } else {
+                files.push_back(arg);
+            }
+        }
+    } catch (const std::exception&) {
+        usage();
+        return 1;
+    }
+    if (files.empty() || seed_reg > 15) {
+        usage();
+        return 1;
+    }
+
+    // Load (and assemble) every program once; jobs only copy the image.
+    std::vector<std::vector<uint32_t>> images;
+    for (const auto& file : files) {
+        auto image = read_program(file);
+        if (!image) {
+            std::println(std::cerr, "Error: Could not open file {}", file);
+            return 1;
+        }
+        images.push_back(std::move(*image));
+    }
+
+    std::vector<Job> jobs;
+    for (size_t p = 0; p < images.size(); ++p) {
+        if (!seeds) {
+            jobs.push_back({p, std::nullopt});
+            continue;
+        }
+        for (uint32_t s = 0; s < *seeds; ++s) {
+            jobs.push_back({p, s});
+        }
+    }
+
+    std::vector<JobResult> results(jobs.size());
+    WorkStealingPool pool(workers);
+    auto batch_start = std::chrono::steady_clock::now();
+    pool.run(jobs.size(), [&](size_t i) {
+        const auto& job = jobs[i];
+        auto& result = results[i];
+        CPU cpu{};
+        if (engine) {
+            cpu.engine = *engine;
+        }
+        load_program(cpu, images[job.program]);
+        if (job.seed) {
+            cpu.registers[seed_reg] = *job.seed;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        while (result.cycles < limit && !cpu.halted) {
+            result.cycles += cpu.run(limit - result.cycles).cycles;
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        result.wall_ms = std::chrono::duration<double, std::milli>(end - start).count();
+        result.halted = cpu.halted;
+        result.registers = cpu.registers;
+    });
+    auto batch_end = std::chrono::steady_clock::now();
+
+    uint64_t total_cycles = 0;
+    size_t halted = 0;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        const auto& job = jobs[i];
+        const auto& result = results[i];
+        total_cycles += result.cycles;
+        halted += result.halted;
+
+        std::print("{}", files[job.program]);
+        if (job.seed) {
+            std::print(" seed={}", *job.seed);
+        }
+        std::println(" | {} | cycles: {} | wall: {:.3f} ms",
+            result.halted ? "HALT" : "LIMIT", result.cycles, result.wall_ms);
+        std::print(" ");
+        for (int r = 0; r < 16; ++r) {
+            std::print(" R{}=0x{:08X}", r, result.registers[r]);
+        }
+        std::println(" SP=0x{:08X}", result.registers[16]);
+    }
+
+    double wall_s = std::chrono::duration<double>(batch_end - batch_start).count();
+    std::println("--- {} jobs ({} halted) on {} workers | cycles: {} | wall: {:.3f} s | {:.1f} MIPS ---",
+        jobs.size(), halted, pool.workers(), total_cycles, wall_s,
+        wall_s > 0 ? total_cycles / wall_s / 1e6 : 0.0);
+
+    // Non-zero if anything ran into the limit instead of halting.
+    return halted == jobs.size() ? 0 : 2;
+}
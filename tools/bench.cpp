@@ -0,0 +1,455 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <print>
+#include <string>
+#include <utility>
+#include <vector>
+#include "SimpleIRPass.hpp"
+#include "allocator.hpp"
+#include "codegen.hpp"
+#include "cpu.hpp"
+#include "instruction_emit.hpp"
+#include "line.hpp"
+#include "parser.hpp"
+#include "program.hpp"
+
+// Throughput of the CPU core itself, per opcode and on whole programs.
+//
+// Micro benchmarks repeat one instruction (or a CALL/RET or PUSH/POP pair)
+// 64 times in an endless loop, so everything but one JMP in 65 is the
+// instruction under test. Macro benchmarks are real programs. Every result
+// is ns per retired instruction over several timed repetitions, each
+// restored from a snapshot of the loaded image, after an untimed warm-up.
+
+namespace {
+
+// Builds assembly one word per line, so `at()` is the address of the next
+// line. Branch and CALL offsets are relative, JMP targets absolute.
+struct Source {
+    std::vector<std::string> lines;
+
+    auto at() const -> uint32_t { return lines.size() * 4; }
+
+    auto add(const std::string& line) -> Source& {
+        lines.push_back(line);
+        return *this;
+    }
+
+    auto pad_to(uint32_t addr) -> Source& {
+        while (at() < addr) {
+            add("NOP");
+        }
+        return *this;
+    }
+
+    static auto imm(int64_t value) -> std::string {
+        return std::format("{}${:X}", value < 0 ? "-" : "", std::abs(value));
+    }
+
+    // Offset from the next line to `target`.
+    auto rel(uint32_t target) const -> std::string {
+        return imm(int64_t{target} - at());
+    }
+
+    auto text() const -> std::string {
+        std::string src;
+        for (const auto& line : lines) {
+            src += line + "\n";
+        }
+        return src;
+    }
+};
+
+struct Workload {
+    std::string name;
+    std::vector<uint32_t> image;
+    std::function<void(CPU&)> prepare = [](CPU&) {};
+    std::optional<uint32_t> expect_r0; ///< R0 once the program halts
+};
+
+constexpr uint32_t VBLANK_VECTOR = Fanta::Info::Cpu::INTERRUPT_BASE;
+constexpr uint32_t RETURN_STUB = VBLANK_VECTOR + 4;
+constexpr uint32_t MICRO_START = 0x200;
+
+// `setup` once, then `copies` x `body` in an endless loop. CIP lands on the
+// RET at the VBLANK vector, and CALLs target the RET right after it.
+auto micro(const std::string& name, const std::vector<std::string>& setup,
+           const std::vector<std::string>& body, int copies = 64) -> Workload {
+    Source s;
+    s.add("JMP " + Source::imm(MICRO_START));
+    s.pad_to(VBLANK_VECTOR).add("RET").add("RET");
+    s.pad_to(MICRO_START);
+    s.add("MOV R5, $1");
+    for (const auto& line : setup) {
+        s.add(line);
+    }
+    auto loop = s.at();
+    for (int i = 0; i < copies; ++i) {
+        for (const auto& line : body) {
+            s.add(line == "CALL" ? "CALL " + s.rel(RETURN_STUB) : line);
+        }
+    }
+    s.add("JMP " + Source::imm(loop));
+    return {name, assemble_source(s.text())};
+}
+
+auto branch_micros() -> std::vector<Workload> {
+    // Flag states set up with CMP (R0 = 0, R5 = 1).
+    const std::string ZERO = "CMP R0, $0";     // Z
+    const std::string NEGATIVE = "CMP R0, $1"; // N
+    const std::string CARRY = "CMP R5, $0";    // C (signed 1 > 0)
+    struct Kind {
+        std::string op;
+        std::string taken;
+        std::string not_taken;
+    };
+    std::vector<Kind> kinds = {
+        {"BEQ", ZERO, NEGATIVE}, {"BNE", NEGATIVE, ZERO}, {"BEC", CARRY, ZERO},
+        {"BNC", ZERO, CARRY},    {"BMI", NEGATIVE, ZERO}, {"BPL", ZERO, NEGATIVE},
+    };
+    std::vector<Workload> out;
+    for (const auto& k : kinds) {
+        // Both outcomes land on the next instruction.
+        auto lower = k.op;
+        std::ranges::transform(lower, lower.begin(), ::tolower);
+        out.push_back(micro(lower + "_taken", {k.taken}, {k.op + " $4"}));
+        out.push_back(micro(lower + "_not_taken", {k.not_taken}, {k.op + " $4"}));
+    }
+    return out;
+}
+
+auto compile_fanta(const std::string& code) -> std::vector<uint32_t> {
+    Parser p{code};
+    p.fullWalk();
+    Fanta::Codegen cg{};
+    cg.extractGlobalNames(p);
+    Fanta::GlobalTable gt = cg.globalNameSpace;
+    Fanta::SimpleIRPass pass;
+    auto virtualIR = pass.outputIR(p, gt);
+    Fanta::Allocator alloc{};
+    Fanta::RegAllocIR rir;
+    for (const auto& func : virtualIR.functions) {
+        rir.functions.push_back(alloc.assignFunc(func));
+    }
+    Fanta::InstructionEmitter emitter{};
+    return emitter.outputInstructions(rir, gt);
+}
+
+auto workloads() -> std::vector<Workload> {
+    std::vector<Workload> all = {
+        micro("nop", {}, {"NOP"}),
+        micro("add_reg", {}, {"ADD R1, R1, R5"}),
+        micro("add_imm", {}, {"ADD R1, R1, $1"}),
+        micro("sub_reg", {}, {"SUB R1, R1, R5"}),
+        micro("sub_imm", {}, {"SUB R1, R1, $1"}),
+        // The data page is well clear of the code.
+        micro("load", {}, {"LOAD R1, $1000(R0)"}),
+        micro("store", {}, {"STORE R5, $1000(R0)"}),
+        micro("paddusb", {}, {"PADDUSB R1, R1, R5"}),
+        micro("pblend", {}, {"PBLEND R1, R1, R5"}),
+    };
+    for (auto& b : branch_micros()) {
+        all.push_back(std::move(b));
+    }
+    all.push_back(micro("call_ret", {}, {"CALL"}, 32));
+    all.push_back(micro("push_pop", {}, {"PUSH R5", "POP R1"}, 32));
+    all.push_back(micro("cip", {}, {"CIP 0"}));
+
+    // Bresenham line ROM with the console's default endpoints.
+    Workload line{"line_rom"};
+    auto rom = generate_line();
+    line.image.assign(rom.begin(), rom.end());
+    line.prepare = [](CPU& cpu) {
+        cpu.store(200, 10);
+        cpu.store(204, 20);
+        cpu.store(208, 15);
+        cpu.store(212, 15);
+        cpu.store(216, 0xFFFFFFFF);
+    };
+    all.push_back(std::move(line));
+
+    // Fills the whole framebuffer with one colour per pass, forever.
+    Source clear;
+    clear.add("MOV R1, $8000").add("LSH R1, R1, $8");
+    clear.add("MOV R3, $4B").add("LSH R3, R3, $C").add("ADD R3, R1, R3");
+    auto frame = clear.at();
+    clear.add("MOV R2, R1");
+    auto pixel = clear.at();
+    clear.add("STORE R4, 0(R2)").add("ADD R2, R2, $4").add("CMP R2, R3");
+    clear.add("BNE " + clear.rel(pixel));
+    clear.add("ADD R4, R4, $1").add("JMP " + Source::imm(frame));
+    all.push_back({"fb_clear", assemble_source(clear.text())});
+
+    // The same fill with MEMSET, 64 words per executed instruction.
+    Source memset;
+    memset.add("MOV R1, $8000").add("LSH R1, R1, $8");
+    memset.add("MOV R5, $12C0").add("LSH R5, R5, $4");
+    auto fill = memset.at();
+    memset.add("MOV R2, R1").add("MOV R3, R5").add("MEMSET R2, R4, R3");
+    memset.add("ADD R4, R4, $1").add("JMP " + Source::imm(fill));
+    all.push_back({"fb_memset", assemble_source(memset.text())});
+
+    all.push_back({"fib_recursive",
+                   compile_fanta("fn fib(n: int) -> int {"
+                                 "if (n < 2) { return n; }"
+                                 "let a: int = fib(n - 1);"
+                                 "let b: int = fib(n - 2);"
+                                 "return a + b;"
+                                 "}"
+                                 "fn main() -> int {"
+                                 "let sum: int = 0;"
+                                 "for (let i: int = 0; i < 200; i = i + 1) {"
+                                 "sum = sum + fib(12);"
+                                 "}"
+                                 "return sum;"
+                                 "}"),
+                   [](CPU&) {}, 28800});
+    all.push_back({"nested_loops",
+                   compile_fanta("fn main() -> int {"
+                                 "let sum: int = 0;"
+                                 "for (let i: int = 0; i < 400; i = i + 1) {"
+                                 "for (let j: int = 0; j < 400; j = j + 1) {"
+                                 "sum = sum + j;"
+                                 "}"
+                                 "}"
+                                 "return sum;"
+                                 "}"),
+                   [](CPU&) {}, 400 * (399 * 400 / 2)});
+    return all;
+}
+
+struct Result {
+    std::string name;
+    std::string engine;
+    uint64_t instructions = 0; ///< Per repetition
+    double mean_ns = 0;        ///< ns per instruction
+    double stddev_ns = 0;
+    double min_ns = 0;
+    bool ok = true;            ///< expect_r0 held on every repetition that halted
+};
+
+auto measure(const Workload& w, CPU::Engine engine, const std::string& engine_name,
+             uint64_t budget, int reps, int warmup) -> Result {
+    CPU cpu{};
+    cpu.engine = engine;
+    load_program(cpu, w.image);
+    w.prepare(cpu);
+    auto loaded = cpu.snapshot();
+
+    Result r{w.name, engine_name};
+    std::vector<double> samples;
+    for (int rep = 0; rep < warmup + reps; ++rep) {
+        cpu.restore(loaded);
+        auto start = std::chrono::steady_clock::now();
+        uint64_t retired = 0;
+        while (retired < budget && !cpu.halted) {
+            retired += cpu.run_for(budget - retired);
+        }
+        auto end = std::chrono::steady_clock::now();
+        // A budget too small to reach the HALT cannot say anything about
+        // the result.
+        if (w.expect_r0 && cpu.halted && cpu.registers[0] != *w.expect_r0) {
+            r.ok = false;
+        }
+        if (rep < warmup || retired == 0) {
+            continue;
+        }
+        r.instructions = retired;
+        samples.push_back(std::chrono::duration<double, std::nano>(end - start).count() / retired);
+    }
+    if (samples.empty()) {
+        return r;
+    }
+    double sum = 0;
+    for (auto s : samples) {
+        sum += s;
+    }
+    r.mean_ns = sum / samples.size();
+    double var = 0;
+    for (auto s : samples) {
+        var += (s - r.mean_ns) * (s - r.mean_ns);
+    }
+    r.stddev_ns = samples.size() > 1 ? std::sqrt(var / (samples.size() - 1)) : 0.0;
+    r.min_ns = *std::ranges::min_element(samples);
+    return r;
+}
+
+// Reads the results back out of an earlier --json file. Every result sits
+// on its own line, which is all this relies on.
+auto read_baseline(const std::string& filename)
+    -> std::optional<std::map<std::pair<std::string, std::string>, double>> {
+    std::ifstream in(filename);
+    if (!in) {
+        return std::nullopt;
+    }
+    auto field = [](const std::string& line, const std::string& key) -> std::string {
+        auto at = line.find("\"" + key + "\": ");
+        if (at == std::string::npos) {
+            return "";
+        }
+        at += key.size() + 4;
+        if (line[at] == '"') {
+            return line.substr(at + 1, line.find('"', at + 1) - at - 1);
+        }
+        return line.substr(at, line.find_first_of(",}", at) - at);
+    };
+    std::map<std::pair<std::string, std::string>, double> base;
+    std::string line;
+    while (std::getline(in, line)) {
+        auto name = field(line, "name");
+        auto ns = field(line, "ns_per_inst");
+        if (!name.empty() && !ns.empty()) {
+            base[{name, field(line, "engine")}] = std::stod(ns);
+        }
+    }
+    return base;
+}
+
+void usage() {
+    std::println(std::cerr,
+        "Usage: fanta-bench [--engine NAME]... [--filter TEXT] [--reps N] [--warmup N]\n"
+        "                   [--budget N] [--json out.json] [--baseline base.json]\n"
+        "                   [--threshold PCT]\n"
+        "\n"
+        "  --engine NAME   switch|threaded|predecoded|block|jit (repeatable; default all)\n"
+        "  --filter TEXT   Only workloads whose name contains TEXT\n"
+        "  --reps N        Timed repetitions per workload (default 5)\n"
+        "  --warmup N      Untimed repetitions first (default 1)\n"
+        "  --budget N      Instructions per repetition (default 10000000)\n"
+        "  --json FILE     Write the results as JSON\n"
+        "  --baseline FILE Compare against an earlier --json file; exits 2 if any\n"
+        "                  result is more than --threshold percent (default 5) slower");
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> engine_names;
+    std::string filter;
+    int reps = 5;
+    int warmup = 1;
+    uint64_t budget = 10'000'000;
+    std::optional<std::string> json_file;
+    std::optional<std::string> baseline_file;
+    double threshold = 5.0;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+            if (arg == "--engine" && has_value) {
+                engine_names.push_back(argv[++i]);
+            } else if (arg == "--filter" && has_value) {
+                filter = argv[++i];
+            } else if (arg == "--reps" && has_value) {
+                reps = std::max(1, std::stoi(argv[++i]));
+            } else if (arg == "--warmup" && has_value) {
+                warmup = std::max(0, std::stoi(argv[++i]));
+            } else if (arg == "--budget" && has_value) {
+                budget = std::stoull(argv[++i]);
+            } else if (arg == "--json" && has_value) {
+                json_file = argv[++i];
+            } else if (arg == "--baseline" && has_value) {
+                baseline_file = argv[++i];
+            } else if (arg == "--threshold" && has_value) {
+                threshold = std::stod(argv[++i]);
+            } else {
+                usage();
+                return 1;
+            }
+        }
+    } catch (const std::exception&) {
+        usage();
+        return 1;
+    }
+    if (engine_names.empty()) {
+        engine_names = {"switch", "threaded", "predecoded", "block", "jit"};
+    }
+    std::vector<std::pair<std::string, CPU::Engine>> engines;
+    for (const auto& name : engine_names) {
+        auto e = engine_from_name(name);
+        if (!e) {
+            std::println(std::cerr, "Error: Unknown engine {}", name);
+            return 1;
+        }
+        engines.push_back({name, *e});
+    }
+
+    std::optional<std::map<std::pair<std::string, std::string>, double>> baseline;
+    if (baseline_file) {
+        baseline = read_baseline(*baseline_file);
+        if (!baseline) {
+            std::println(std::cerr, "Error: Could not open baseline {}", *baseline_file);
+            return 1;
+        }
+    }
+
+    std::println("{:<18} {:<10} {:>10} {:>9} {:>8} {:>9} {:>8}{}",
+        "workload", "engine", "insts", "ns/inst", "+-sd", "min", "MIPS",
+        baseline ? "   baseline    delta" : "");
+    std::vector<Result> results;
+    bool failed = false;
+    bool regressed = false;
+    for (const auto& w : workloads()) {
+        if (!w.name.contains(filter)) {
+            continue;
+        }
+        for (const auto& [name, engine] : engines) {
+            auto r = measure(w, engine, name, budget, reps, warmup);
+            std::print("{:<18} {:<10} {:>10} {:>9.3f} {:>8.3f} {:>9.3f} {:>8.1f}",
+                r.name, r.engine, r.instructions, r.mean_ns, r.stddev_ns, r.min_ns,
+                r.min_ns > 0 ? 1e3 / r.min_ns : 0.0);
+            if (baseline) {
+                auto it = baseline->find({r.name, r.engine});
+                if (it != baseline->end() && it->second > 0) {
+                    double delta = (r.mean_ns - it->second) / it->second * 100.0;
+                    bool slower = delta > threshold;
+                    regressed |= slower;
+                    std::print(" {:>10.3f} {:>+7.1f}%{}", it->second, delta, slower ? " REGRESSED" : "");
+                } else {
+                    std::print(" {:>10} {:>8}", "-", "new");
+                }
+            }
+            if (!r.ok) {
+                failed = true;
+                std::print("  WRONG RESULT");
+            }
+            std::println("");
+            results.push_back(std::move(r));
+        }
+    }
+
+    if (json_file) {
+        std::ofstream out(*json_file);
+        if (!out) {
+            std::println(std::cerr, "Error: Could not write {}", *json_file);
+            return 1;
+        }
+        std::println(out, "{{");
+        std::println(out, "  \"reps\": {},", reps);
+        std::println(out, "  \"budget\": {},", budget);
+        std::println(out, "  \"results\": [");
+        for (size_t i = 0; i < results.size(); ++i) {
+            const auto& r = results[i];
+            std::println(out,
+                "    {{\"name\": \"{}\", \"engine\": \"{}\", \"instructions\": {}, "
+                "\"ns_per_inst\": {:.4f}, \"stddev\": {:.4f}, \"min\": {:.4f}, \"ok\": {}}}{}",
+                r.name, r.engine, r.instructions, r.mean_ns, r.stddev_ns, r.min_ns,
+                r.ok, i + 1 < results.size() ? "," : "");
+        }
+        std::println(out, "  ]");
+        std::println(out, "}}");
+    }
+
+    if (failed) {
+        return 1;
+    }
+    return regressed ? 2 : 0;
+}
@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <print>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "cpu.hpp"
+#include "disasm.hpp"
+#include "profiler.hpp"
+#include "program.hpp"
+#include "string_assembler.hpp"
+
+// Runs one program through the profiling interpreter and reports where its
+// instructions went: the hottest words (disassembled, with their label and
+// branch outcomes), every opcode, and every CALL target. --folded writes
+// the call stacks for flamegraph.pl or speedscope.
+
+namespace {
+
+void usage() {
+    std::println(std::cerr,
+        "Usage: fanta-prof [--limit N] [--top N] [--folded out.folded]\n"
+        "                  <program.bin|program.asm>\n"
+        "\n"
+        "  --limit N      Stop after N instructions (default 100000000)\n"
+        "  --top N        Hot spots to list (default 20)\n"
+        "  --folded FILE  Write folded call stacks, one per line\n"
+        "\n"
+        "Labels from .asm sources name addresses and call frames.");
+}
+
+// Address -> label, for annotating addresses that fall inside a labelled
+// block as LABEL+offset.
+class Symbols {
+public:
+    explicit Symbols(const std::unordered_map<std::string, int>& labels) {
+        for (const auto& [name, addr] : labels) {
+            sorted.push_back({static_cast<uint32_t>(addr), name});
+        }
+        std::ranges::sort(sorted);
+    }
+
+    // "LOOP+0x8", or empty before the first label.
+    auto locate(uint32_t addr) const -> std::string {
+        auto it = std::ranges::upper_bound(sorted, addr, {}, &std::pair<uint32_t, std::string>::first);
+        if (it == sorted.begin()) {
+            return "";
+        }
+        --it;
+        if (it->first == addr) {
+            return it->second;
+        }
+        return std::format("{}+0x{:X}", it->second, addr - it->first);
+    }
+
+    // A call frame: the label at its entry, or the bare address.
+    auto frame(uint32_t addr) const -> std::string {
+        auto it = std::ranges::lower_bound(sorted, addr, {}, &std::pair<uint32_t, std::string>::first);
+        if (it != sorted.end() && it->first == addr) {
+            return it->second;
+        }
+        return std::format("0x{:X}", addr);
+    }
+
+private:
+    std::vector<std::pair<uint32_t, std::string>> sorted;
+};
+
+// The mnemonic each opcode was registered under; immediate forms are
+// marked so ADD R, R, R and ADD R, R, #imm stay apart.
+auto opcode_names() -> std::unordered_map<uint32_t, std::string> {
+    std::unordered_map<uint32_t, std::string> names;
+    for (const auto& [mnemonic, meta] : Instructions::Registry::get()) {
+        names[meta.reg] = mnemonic;
+        if (meta.imm != 0) {
+            names[meta.imm] = mnemonic + " #imm";
+        }
+    }
+    return names;
+}
+
+auto is_branch(uint32_t op) -> bool {
+    using namespace Fanta::Info::Instructions;
+    return op == BEQ || op == BNE || op == BEC || op == BNC || op == BMI || op == BPL;
+}
+
+auto percent(uint64_t part, uint64_t whole) -> double {
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    uint64_t limit = 100'000'000;
+    std::size_t top = 20;
+    std::optional<std::string> folded_file;
+    std::string filename;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+            if (arg == "--limit" && has_value) {
+                limit = std::stoull(argv[++i]);
+            } else if (arg == "--top" && has_value) {
+                top = std::stoul(argv[++i]);
+            } else if (arg == "--folded" && has_value) {
+                folded_file = argv[++i];
+            } else if (arg.starts_with("--") || !filename.empty()) {
+                usage();
+                return 1;
+            } else {
+                filename = arg;
+            }
+        }
+    } catch (const std::exception&) {
+        usage();
+        return 1;
+    }
+    if (filename.empty()) {
+        usage();
+        return 1;
+    }
+
+    auto image = read_program(filename);
+    if (!image) {
+        std::println(std::cerr, "Error: Could not open file {}", filename);
+        return 1;
+    }
+    Assembler assem;
+    if (!filename.ends_with(".bin")) {
+        std::ifstream in(filename);
+        assem.scan_for_labels(assem.read_source(in));
+    }
+    Symbols symbols{assem.labels()};
+
+    CPU cpu{};
+    load_program(cpu, *image);
+    Profiler profile{cpu.get_pc()};
+    auto retired = cpu.run_observed(limit, profile);
+
+    std::println("{} | {} | {} instructions", filename, cpu.halted ? "halt" : "limit", retired);
+
+    auto spots = profile.hot_spots(top);
+    std::println("\nHot spots:");
+    std::println("  {:<10} {:<18} {:>12} {:>7}  {:>21}  {}",
+        "address", "label", "count", "%", "taken / not taken", "instruction");
+    for (const auto& [pc, site] : spots) {
+        auto raw = cpu.load(pc);
+        std::string outcome;
+        if (is_branch(raw >> 26)) {
+            outcome = std::format("{} / {}", site.taken, site.count - site.taken);
+        }
+        std::println("  0x{:08X} {:<18} {:>12} {:>6.2f}%  {:>21}  {}",
+            pc, symbols.locate(pc), site.count, percent(site.count, retired), outcome,
+            Fanta::disassemble(raw, pc));
+    }
+
+    auto names = opcode_names();
+    std::vector<std::pair<uint64_t, uint32_t>> ops;
+    for (uint32_t op = 0; op < profile.opcode_counts().size(); ++op) {
+        if (auto n = profile.opcode_counts()[op]) {
+            ops.push_back({n, op});
+        }
+    }
+    std::ranges::sort(ops, std::greater{});
+    std::println("\nOpcodes:");
+    for (const auto& [n, op] : ops) {
+        auto name = names.contains(op) ? names[op] : std::format("0x{:02X}", op);
+        std::println("  {:<10} {:>12} {:>6.2f}%", name, n, percent(n, retired));
+    }
+
+    if (!profile.call_counts().empty()) {
+        std::vector<std::pair<uint64_t, uint32_t>> calls;
+        for (const auto& [target, n] : profile.call_counts()) {
+            calls.push_back({n, target});
+        }
+        std::ranges::sort(calls, std::greater{});
+        std::println("\nCalls:");
+        for (const auto& [n, target] : calls) {
+            std::println("  0x{:08X} {:<18} {:>12}", target, symbols.frame(target), n);
+        }
+    }
+
+    if (folded_file) {
+        std::ofstream out(*folded_file);
+        if (!out) {
+            std::println(std::cerr, "Error: Could not write {}", *folded_file);
+            return 1;
+        }
+        out << profile.folded([&](uint32_t entry) { return symbols.frame(entry); });
+    }
+    return 0;
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include "cpu.hpp"
+#include "string_assembler.hpp"
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Helpers shared by the headless tools (fanta-batch and friends).
+
+/**
+ * @brief Assembles a whole source text the way .asm files are loaded.
+ *
+ * @details One line per 4-byte word from address 0, once LI pseudo-ops are
+ *          expanded. Lines that fail to assemble become NOP so addresses stay
+ *          aligned with the source.
+ */
+inline auto assemble_source(const std::string &source)
+    -> std::vector<uint32_t> {
+  Assembler assem;
+  std::istringstream in(source);
+  auto lines = assem.read_source(in);
+  assem.scan_for_labels(lines);
+  std::vector<uint32_t> words;
+  for (size_t i = 0; i < lines.size(); ++i) {
+    uint32_t instr = assem.assemble(lines[i], i * 4);
+    words.push_back(instr != (uint32_t)-1 ? instr : (0x14 << 26));
+  }
+  return words;
+}
+
+/**
+ * @brief Reads a program image the same way the console, fanta-trace and
+ *        fanta-diff do.
+ *
+ * @details `.bin` files are raw little-endian instruction words. Anything
+ *          else is assembled with assemble_source().
+ *
+ * @return The words to load from address 0, or nullopt if the file could not
+ *         be opened.
+ */
+inline auto read_program(const std::string &filename)
+    -> std::optional<std::vector<uint32_t>> {
+  if (filename.ends_with(".bin")) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in)
+      return std::nullopt;
+    std::vector<uint32_t> words;
+    uint32_t word;
+    while (in.read(reinterpret_cast<char *>(&word), sizeof(uint32_t)))
+      words.push_back(word);
+    return words;
+  }
+
+  std::ifstream in(filename);
+  if (!in)
+    return std::nullopt;
+  std::string source((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+  return assemble_source(source);
+}
+
+inline auto load_program(CPU &cpu, const std::vector<uint32_t> &words) {
+  for (size_t i = 0; i < words.size(); ++i)
+    cpu.store(i * 4, words[i]);
+}
+
+// Accepts the lower-case CPU::Engine names, e.g. "jit".
+inline auto engine_from_name(std::string_view name)
+    -> std::optional<CPU::Engine> {
+  if (name == "switch")
+    return CPU::Engine::SWITCH;
+  if (name == "threaded")
+    return CPU::Engine::THREADED;
+  if (name == "predecoded")
+    return CPU::Engine::PREDECODED;
+  if (name == "block")
+    return CPU::Engine::BLOCK;
+  if (name == "jit")
+    return CPU::Engine::JIT;
+  return std::nullopt;
+}
@@ -0,0 +1,215 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <print>
+#include <string>
+#include <vector>
+#include "cpu.hpp"
+#include "program.hpp"
+
+// Runs one program without a window and writes out what it left behind:
+// the framebuffer as a PPM, registers and chosen memory ranges as JSON, and
+// a wall-time/MIPS summary. Links only vm_lib, so it builds anywhere the VM
+// does; CI performance runs use it.
+
+namespace {
+
+struct MemRange {
+    uint32_t addr;
+    uint32_t words;
+};
+
+void usage() {
+    std::println(std::cerr,
+        "Usage: fanta-run [--limit N] [--frames N]\n"
+        "                 [--engine switch|threaded|predecoded|block|jit]\n"
+        "                 [--ppm out.ppm] [--json out.json] [--mem ADDR:WORDS]...\n"
+        "                 <program.bin|program.asm>\n"
+        "\n"
+        "  --limit N         Stop after N instructions\n"
+        "  --frames N        Stop after N VBLANK frames\n"
+        "  --ppm FILE        Write the 320x240 framebuffer as a binary PPM\n"
+        "  --json FILE       Write registers, flags, summary and --mem ranges\n"
+        "  --mem ADDR:WORDS  Include WORDS words from ADDR in the JSON (repeatable)\n"
+        "\n"
+        "Runs until HALT unless --limit or --frames is given. Exit status is 0\n"
+        "when the run stopped for one of those reasons, 1 on errors.");
+}
+
+auto parse_range(const std::string& arg) -> std::optional<MemRange> {
+    auto colon = arg.find(':');
+    if (colon == std::string::npos) {
+        return std::nullopt;
+    }
+    MemRange range{static_cast<uint32_t>(std::stoul(arg.substr(0, colon), nullptr, 0)),
+                   static_cast<uint32_t>(std::stoul(arg.substr(colon + 1), nullptr, 0))};
+    if (uint64_t{range.addr} + uint64_t{range.words} * 4 > CPU::MEMORY_SIZE) {
+        return std::nullopt;
+    }
+    return range;
+}
+
+// Quotes `s` as a JSON string.
+auto json_string(const std::string& s) -> std::string {
+    std::string quoted = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+auto write_ppm(CPU& cpu, const std::string& filename) -> bool {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        return false;
+    }
+    std::print(out, "P6\n{} {}\n255\n", CPU::VRAM_WIDTH, CPU::VRAM_HEIGHT);
+    // VRAM is ARGB8888 words; PPM wants R, G, B bytes.
+    std::vector<char> rgb;
+    rgb.reserve(CPU::VRAM_WIDTH * CPU::VRAM_HEIGHT * 3);
+    for (uint32_t i = 0; i < CPU::VRAM_BYTES; i += 4) {
+        auto pixel = cpu.load(CPU::VRAM_BASE + i);
+        rgb.push_back(static_cast<char>(pixel >> 16));
+        rgb.push_back(static_cast<char>(pixel >> 8));
+        rgb.push_back(static_cast<char>(pixel));
+    }
+    out.write(rgb.data(), rgb.size());
+    return static_cast<bool>(out);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::optional<uint64_t> limit;
+    std::optional<uint64_t> frame_limit;
+    std::optional<CPU::Engine> engine;
+    std::string engine_name = "threaded";
+    std::optional<std::string> ppm_file;
+    std::optional<std::string> json_file;
+    std::vector<MemRange> ranges;
+    std::string filename;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+            if (arg == "--limit" && has_value) {
+                limit = std::stoull(argv[++i]);
+            } else if (arg == "--frames" && has_value) {
+                frame_limit = std::stoull(argv[++i]);
+            } else if (arg == "--engine" && has_value) {
+                engine_name = argv[++i];
+                engine = engine_from_name(engine_name);
+                if (!engine) {
+                    std::println(std::cerr, "Error: Unknown engine {}", engine_name);
+                    return 1;
+                }
+            } else if (arg == "--ppm" && has_value) {
+                ppm_file = argv[++i];
+            } else if (arg == "--json" && has_value) {
+                json_file = argv[++i];
+            } else if (arg == "--mem" && has_value) {
+                auto range = parse_range(argv[++i]);
+                if (!range) {
+                    std::println(std::cerr, "Error: Bad memory range {}", argv[i]);
+                    return 1;
+                }
+                ranges.push_back(*range);
+            } else if (arg.starts_with("--") || !filename.empty()) {
+                usage();
+                return 1;
+            } else {
+                filename = arg;
+            }
+        }
+    } catch (const std::exception&) {
+        usage();
+        return 1;
+    }
+    if (filename.empty()) {
+        usage();
+        return 1;
+    }
+
+    auto image = read_program(filename);
+    if (!image) {
+        std::println(std::cerr, "Error: Could not open file {}", filename);
+        return 1;
+    }
+    CPU cpu{};
+    if (engine) {
+        cpu.engine = *engine;
+    }
+    load_program(cpu, *image);
+
+    uint64_t cycles = 0;
+    uint64_t frames = 0;
+    std::string stop = "halt";
+    auto start = std::chrono::steady_clock::now();
+    while (!cpu.halted) {
+        if (limit && cycles >= *limit) {
+            stop = "limit";
+            break;
+        }
+        if (frame_limit && frames >= *frame_limit) {
+            stop = "frames";
+            break;
+        }
+        // run() stops at every VBLANK, which is what frames are counted by.
+        auto result = cpu.run(limit ? *limit - cycles : UINT64_MAX);
+        cycles += result.cycles;
+        frames += result.reason == CPU::StopReason::INTERRUPT;
+    }
+    auto end = std::chrono::steady_clock::now();
+    double wall_ms = std::chrono::duration<double, std::milli>(end - start).count();
+    double mips = wall_ms > 0 ? cycles / wall_ms / 1e3 : 0.0;
+
+    std::println("{} | {} | cycles: {} | frames: {} | wall: {:.3f} ms | {:.1f} MIPS",
+        filename, stop, cycles, frames, wall_ms, mips);
+
+    if (ppm_file && !write_ppm(cpu, *ppm_file)) {
+        std::println(std::cerr, "Error: Could not write {}", *ppm_file);
+        return 1;
+    }
+
+    if (json_file) {
+        std::ofstream out(*json_file);
+        if (!out) {
+            std::println(std::cerr, "Error: Could not write {}", *json_file);
+            return 1;
+        }
+        auto status = cpu.status_reg();
+        std::println(out, "{{");
+        std::println(out, "  \"program\": {},", json_string(filename));
+        std::println(out, "  \"engine\": {},", json_string(engine_name));
+        std::println(out, "  \"stop\": \"{}\",", stop);
+        std::println(out, "  \"cycles\": {},", cycles);
+        std::println(out, "  \"frames\": {},", frames);
+        std::println(out, "  \"wall_ms\": {:.3f},", wall_ms);
+        std::println(out, "  \"mips\": {:.3f},", mips);
+        std::println(out, "  \"pc\": {},", cpu.get_pc());
+        std::print(out, "  \"registers\": [");
+        for (size_t r = 0; r < cpu.registers.size(); ++r) {
+            std::print(out, "{}{}", r ? ", " : "", cpu.registers[r]);
+        }
+        std::println(out, "],");
+        std::println(out, "  \"flags\": {{\"z\": {}, \"n\": {}, \"v\": {}, \"c\": {}}},",
+            status[CPU::ZERO], status[CPU::NEGATIVE], status[CPU::OVFL], status[CPU::CARRY]);
+        std::print(out, "  \"memory\": [");
+        for (size_t m = 0; m < ranges.size(); ++m) {
+            std::print(out, "{}\n    {{\"address\": {}, \"words\": [", m ? "," : "", ranges[m].addr);
+            for (uint32_t w = 0; w < ranges[m].words; ++w) {
+                std::print(out, "{}{}", w ? ", " : "", cpu.load(ranges[m].addr + w * 4));
+            }
+            std::print(out, "]}}");
+        }
+        std::println(out, "{}]", ranges.empty() ? "" : "\n  ");
+        std::println(out, "}}");
+    }
+    return 0;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Runs a fixed set of independent jobs on a fixed number of threads.
+ *
+ * @details Jobs are dealt round-robin onto one deque per worker. A worker
+ *          takes from the back of its own deque and, once that runs dry,
+ *          steals from the front of the others, so a handful of long jobs
+ *          cannot leave the rest of the pool idle. Nothing is queued after
+ *          run() starts, which means a worker that finds every deque empty
+ *          can simply exit.
+ */
+class WorkStealingPool {
+public:
+  explicit WorkStealingPool(unsigned workers)
+      : queues(std::max(1u, workers)) {}
+
+  auto workers() const -> std::size_t { return queues.size(); }
+
+  // Calls job(i) once for every i in [0, count) and returns when all of them
+  // have finished. `job` must be safe to call concurrently.
+  template <typename Job> auto run(std::size_t count, Job &&job) -> void {
+    for (std::size_t i = 0; i < count; i++)
+      queues[i % queues.size()].jobs.push_back(i);
+    std::vector<std::jthread> threads;
+    for (std::size_t w = 0; w < queues.size(); w++)
+      threads.emplace_back([this, &job, w] {
+        std::size_t i;
+        while (take(w, i))
+          job(i);
+      });
+  }
+
+private:
+  struct Queue {
+    std::mutex lock;
+    std::deque<std::size_t> jobs;
+  };
+
+  auto take(std::size_t self, std::size_t &job) -> bool {
+    {
+      std::lock_guard guard(queues[self].lock);
+      if (!queues[self].jobs.empty()) {
+        job = queues[self].jobs.back();
+        queues[self].jobs.pop_back();
+        return true;
+      }
+    }
+    for (std::size_t k = 1; k < queues.size(); k++) {
+      auto &victim = queues[(self + k) % queues.size()];
+      std::lock_guard guard(victim.lock);
+      if (!victim.jobs.empty()) {
+        job = victim.jobs.front();
+        victim.jobs.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::vector<Queue> queues;
+};
@@ -2,9 +2,12 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <format>
 #include <print>
 #include <array>
 #include "cpu.hpp"
+#include "debug_spec.hpp"
+#include "interpreter.hpp"
 #include "string_assembler.hpp"
 
 /**
@@ -16,26 +19,90 @@
  *   Reg RX: 0xOLD -> 0xNEW
  *   Flag [F]: 0 -> 1
  *   Mem [Addr]: 0xOLD -> 0xNEW
+ *
+ * The interpreter reports each write just before it lands, so the old
+ * value is read straight out of the CPU instead of from a shadow copy.
+ * Stores come from the StoreLog it derives from.
  */
 
+namespace {
+
+struct Differ : StoreLog {
+    uint64_t cycle = 0;
+    std::vector<std::string> changes;
+    uint8_t flag_mask = 0;
+    std::array<uint8_t, 4> old_flags{};
+
+    auto write_reg(CPU& cpu, uint32_t r, uint32_t value) -> void {
+        if (cpu.registers[r] == value) {
+            return;
+        }
+        std::string label = (r == 16) ? "SP " : "R" + std::to_string(r);
+        changes.push_back(std::format("  {:<2}: 0x{:08X} -> 0x{:08X}", label, cpu.registers[r], value));
+    }
+
+    auto write_flags(CPU& cpu, uint8_t mask) -> void {
+        flag_mask = mask;
+        old_flags = cpu.status_reg();
+    }
+
+    auto retire(CPU& cpu, uint32_t pc, uint32_t) -> void {
+        static const char* flag_names[] = {"Z", "N", "V", "C"};
+        for (const auto& store : stores) {
+            if (store.old_value != store.new_value) {
+                changes.push_back(std::format("  Mem [0x{:08X}]: 0x{:08X} -> 0x{:08X}",
+                    store.addr, store.old_value, store.new_value));
+            }
+        }
+        auto flags = cpu.status_reg();
+        for (int i = 0; i < 4; ++i) {
+            if ((flag_mask & (1 << i)) && flags[i] != old_flags[i]) {
+                changes.push_back(std::format("  Flag {}: {} -> {}", flag_names[i], (int)old_flags[i], (int)flags[i]));
+            }
+        }
+        if (!changes.empty()) {
+            std::println("Cycle {:<5} | PC: 0x{:04X} -> 0x{:04X}", cycle, pc, cpu.get_pc());
+            for (const auto& change : changes) {
+                std::println("{}", change);
+            }
+            std::println("---------------------------------------");
+        }
+        changes.clear();
+        stores.clear();
+        flag_mask = 0;
+        cycle++;
+    }
+};
+
+} // namespace
+
 int main(int argc, char* argv[]) {
     if (argc < 2) {
-        std::println(std::cerr, "Usage: fanta-diff <filename.asm> [--limit N]");
+        std::println(std::cerr, "Usage: fanta-diff <filename.asm> [--limit N] [--break SPEC]... [--watch SPEC]...");
         return 1;
     }
 
     std::string filename = argv[1];
     uint64_t limit = 5000;
+    CPU cpu;
 
+    // Breakpoint and watchpoint SPECs are as in fanta-trace (vm/debug_spec.hpp).
     for (int i = 2; i < argc; ++i) {
-        if (std::string(argv[i]) == "--limit" && i + 1 < argc) {
+        std::string arg = argv[i];
+        if (arg == "--limit" && i + 1 < argc) {
             limit = std::stoull(argv[i + 1]);
             i++;
+        } else if ((arg == "--break" || arg == "--watch") && i + 1 < argc) {
+            auto added = arg == "--break" ? DebugSpec::add_breakpoint(cpu, argv[i + 1])
+                                          : DebugSpec::add_watchpoint(cpu, argv[i + 1]);
+            if (!added) {
+                std::println(std::cerr, "Error: bad {} spec '{}'", arg, argv[i + 1]);
+                return 1;
+            }
+            i++;
         }
     }
 
-    CPU cpu;
-
     if (filename.ends_with(".bin")) {
         std::ifstream in(filename, std::ios::binary);
         if (!in) {
@@ -55,16 +122,9 @@ int main(int argc, char* argv[]) {
             return 1;
         }
 
-        std::vector<std::string> lines;
-        std::string line;
-        std::string full_code;
-        while (std::getline(in, line)) {
-            lines.push_back(line);
-            full_code += line + "\n";
-        }
-
         Assembler assem;
-        assem.scan_for_labels(full_code);
+        auto lines = assem.read_source(in);
+        assem.scan_for_labels(lines);
 
         for (size_t i = 0; i < lines.size(); ++i) {
             uint32_t instr = assem.assemble(lines[i], i * 4);
@@ -72,56 +132,15 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    // Shadow state for diffing
-    std::array<uint32_t, 17> prev_regs = cpu.registers;
-    std::array<uint8_t, 4> prev_flags = cpu.status_reg;
-    uint32_t prev_pc = cpu.get_pc();
-    uint32_t prev_sp = cpu.get_sp();
-
     std::println("--- START DIFF TRACE: {} ---", filename);
-    
-    uint64_t cycle = 0;
-    while (!cpu.halted && cycle < limit) {
-        uint32_t current_pc = cpu.get_pc();
-        uint32_t current_sp = cpu.get_sp();
-        
-        // Execute one cycle
-        cpu.run_cycle();
-        cycle++;
 
-        bool header_printed = false;
-        auto print_header = [&]() {
-            if (!header_printed) {
-                std::println("Cycle {:<5} | PC: 0x{:04X} -> 0x{:04X}", cycle-1, current_pc, cpu.get_pc());
-                header_printed = true;
-            }
-        };
-
-        // Diff Registers
-        for (int i = 0; i < 17; ++i) {
-            if (cpu.registers[i] != prev_regs[i]) {
-                print_header();
-                std::string label = (i == 16) ? "SP " : "R" + std::to_string(i);
-                std::println("  {:<2}: 0x{:08X} -> 0x{:08X}", label, prev_regs[i], cpu.registers[i]);
-                prev_regs[i] = cpu.registers[i];
-            }
-        }
-
-        // Diff Flags
-        static const char* flag_names[] = {"Z", "N", "V", "C"};
-        for (int i = 0; i < 4; ++i) {
-            if (cpu.status_reg[i] != prev_flags[i]) {
-                print_header();
-                std::println("  Flag {}: {} -> {}", flag_names[i], (int)prev_flags[i], (int)cpu.status_reg[i]);
-                prev_flags[i] = cpu.status_reg[i];
-            }
-        }
+    Differ differ;
+    auto result = cpu.run_debug(limit, differ);
 
-        if (header_printed) {
-            std::println("---------------------------------------");
-        }
+    if (auto stop = DebugSpec::describe_stop(cpu, result.reason); !stop.empty()) {
+        std::println("{} after {} instructions", stop, result.cycles);
+    } else if (cpu.halted) {
+        std::println("CPU HALTED at cycle {}", result.cycles);
     }
-
-    if (cpu.halted) std::println("CPU HALTED at cycle {}", cycle);
     return 0;
 }
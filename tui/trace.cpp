@@ -1,29 +1,227 @@
 #include <iostream>
 #include <fstream>
+#include <optional>
 #include <string>
+#include <utility>
 #include <vector>
+#include <format>
 #include <print>
 #include "cpu.hpp"
+#include "debug_spec.hpp"
+#include "disasm.hpp"
+#include "interpreter.hpp"
 #include "string_assembler.hpp"
+#include "trace_file.hpp"
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::println(std::cerr, "Usage: fanta-trace <filename.asm> [--limit N]");
-        return 1;
+namespace {
+
+void usage() {
+    std::println(std::cerr,
+        "Usage: fanta-trace <filename.asm|filename.bin> [--limit N] [--out trace.ftr]\n"
+        "                   [--break SPEC]... [--watch SPEC]...\n"
+        "       fanta-trace --decode trace.ftr [--from C] [--to C] [--pc LO:HI]\n"
+        "                   [--state C] [--mem ADDR:WORDS]...\n"
+        "\n"
+        "  --limit N         Stop after N instructions (default 1000)\n"
+        "  --out FILE        Write a binary trace instead of text\n"
+        "  --break SPEC      Stop before ADDR [if REG|FLAG OP VALUE] runs\n"
+        "  --watch SPEC      Stop after an access to ADDR[:BYTES][/r|/w|/rw]\n"
+        "  --decode FILE     Print a binary trace\n"
+        "  --from C, --to C  Only cycles C and up / below C\n"
+        "  --pc LO:HI        Only instructions at LO..HI inclusive\n"
+        "  --state C         Print the machine state before cycle C instead\n"
+        "  --mem ADDR:WORDS  With --state, also print WORDS words from ADDR");
+}
+
+const char* const flag_names[] = {"Z", "N", "V", "C"};
+
+void print_line(uint64_t cycle, uint32_t pc, uint32_t raw, const std::string& writes) {
+    std::println("Cycle: {:<5} | PC: 0x{:04X} | Inst: 0x{:08X} | {:<28} |{}",
+        cycle, pc, raw, Fanta::disassemble(raw, pc), writes);
+}
+
+// "A:B" as two numbers in any base stoul accepts.
+auto parse_pair(const std::string& arg) -> std::optional<std::pair<uint32_t, uint32_t>> {
+    auto colon = arg.find(':');
+    if (colon == std::string::npos) {
+        return std::nullopt;
     }
+    return std::pair{static_cast<uint32_t>(std::stoul(arg.substr(0, colon), nullptr, 0)),
+                     static_cast<uint32_t>(std::stoul(arg.substr(colon + 1), nullptr, 0))};
+}
 
-    std::string filename = argv[1];
-    uint64_t limit = 1000;
+// One line per instruction: where it ran, what it was, and exactly what it
+// wrote, as reported by the interpreter.
+struct Tracer : NullObserver {
+    uint64_t cycle = 0;
+    std::string writes;
+    uint8_t flags = 0;
+
+    auto write_reg(CPU&, uint32_t r, uint32_t value) -> void {
+        writes += std::format(" {}=0x{:08X}", Fanta::getRegisterName(r), value);
+    }
+
+    auto write_flags(CPU&, uint8_t mask) -> void { flags = mask; }
+
+    auto write_mem(CPU&, uint32_t addr, uint32_t value) -> void {
+        writes += std::format(" [0x{:08X}]=0x{:08X}", addr, value);
+    }
 
-    for (int i = 2; i < argc; ++i) {
-        if (std::string(argv[i]) == "--limit" && i + 1 < argc) {
-            limit = std::stoull(argv[i + 1]);
-            i++;
+    auto write_pc(CPU&, uint32_t target) -> void {
+        writes += std::format(" PC=0x{:04X}", target);
+    }
+
+    auto retire(CPU& cpu, uint32_t pc, uint32_t) -> void {
+        // Flags are written lazily, so read back the ones it defined now.
+        auto status = cpu.status_reg();
+        for (int f = 0; f < 4; ++f) {
+            if (flags & (1 << f)) {
+                writes += std::format(" {}={}", flag_names[f], status[f]);
+            }
+        }
+        print_line(cycle++, pc, cpu.load(pc), writes);
+        writes.clear();
+        flags = 0;
+    }
+};
+
+struct DecodeOptions {
+    std::string filename;
+    uint64_t from = 0;
+    uint64_t to = UINT64_MAX;
+    uint32_t pc_lo = 0;
+    uint32_t pc_hi = UINT32_MAX;
+    std::optional<uint64_t> state;
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+};
+
+// Replays a binary trace. Every cycle before the ones printed is still
+// decoded, since each record is a delta on the one before it.
+int decode(const DecodeOptions& opts) {
+    TraceReader trace(opts.filename);
+
+    if (opts.state) {
+        if (!trace.seek(*opts.state)) {
+            std::println(std::cerr, "Error: Trace ends at cycle {}", trace.cycle());
+            return 1;
+        }
+        std::println("--- STATE BEFORE CYCLE {}: {} ---", trace.cycle(), opts.filename);
+        std::println("PC: 0x{:04X}", trace.pc());
+        const auto& regs = trace.registers();
+        for (uint32_t r = 0; r < regs.size(); ++r) {
+            std::print("{:>3}=0x{:08X}{}", Fanta::getRegisterName(r), regs[r],
+                r % 4 == 3 || r + 1 == regs.size() ? "\n" : "  ");
+        }
+        auto status = trace.flags();
+        std::println("Z={} N={} V={} C={}", status[0], status[1], status[2], status[3]);
+        for (const auto& [addr, words] : opts.ranges) {
+            for (uint32_t w = 0; w < words; ++w) {
+                std::println("[0x{:08X}]=0x{:08X}", addr + w * 4, trace.load(addr + w * 4));
+            }
         }
+        return 0;
     }
 
+    std::println("--- DECODE TRACE: {} ({} records) ---", opts.filename, trace.records());
+    trace.seek(opts.from);
+    TraceReader::Record record;
+    while (trace.cycle() < opts.to && trace.next(record)) {
+        if (record.pc < opts.pc_lo || record.pc > opts.pc_hi) {
+            continue;
+        }
+        std::string writes;
+        for (uint32_t i = 0; i < record.nregs; ++i) {
+            writes += std::format(" {}=0x{:08X}", Fanta::getRegisterName(record.regs[i].first),
+                record.regs[i].second);
+        }
+        for (uint32_t i = 0; i < record.nmems; ++i) {
+            writes += std::format(" [0x{:08X}]=0x{:08X}", record.mems[i].first, record.mems[i].second);
+        }
+        if (trace.pc() != record.pc + 4) {
+            writes += std::format(" PC=0x{:04X}", trace.pc());
+        }
+        auto status = trace.flags();
+        for (int f = 0; f < 4; ++f) {
+            if (record.flags_changed & (1 << f)) {
+                writes += std::format(" {}={}", flag_names[f], status[f]);
+            }
+        }
+        print_line(record.cycle, record.pc, record.raw, writes);
+    }
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string filename;
+    uint64_t limit = 1000;
+    std::optional<std::string> out_file;
+    bool decoding = false;
+    DecodeOptions opts;
     CPU cpu;
 
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+            if (arg == "--limit" && has_value) {
+                limit = std::stoull(argv[++i]);
+            } else if ((arg == "--break" || arg == "--watch") && has_value) {
+                auto added = arg == "--break" ? DebugSpec::add_breakpoint(cpu, argv[++i])
+                                              : DebugSpec::add_watchpoint(cpu, argv[++i]);
+                if (!added) {
+                    usage();
+                    return 1;
+                }
+            } else if (arg == "--out" && has_value) {
+                out_file = argv[++i];
+            } else if (arg == "--decode" && has_value && filename.empty()) {
+                decoding = true;
+                filename = argv[++i];
+            } else if (arg == "--from" && has_value) {
+                opts.from = std::stoull(argv[++i], nullptr, 0);
+            } else if (arg == "--to" && has_value) {
+                opts.to = std::stoull(argv[++i], nullptr, 0);
+            } else if (arg == "--state" && has_value) {
+                opts.state = std::stoull(argv[++i], nullptr, 0);
+            } else if ((arg == "--pc" || arg == "--mem") && has_value) {
+                auto pair = parse_pair(argv[++i]);
+                if (!pair) {
+                    usage();
+                    return 1;
+                }
+                if (arg == "--pc") {
+                    std::tie(opts.pc_lo, opts.pc_hi) = *pair;
+                } else {
+                    opts.ranges.push_back(*pair);
+                }
+            } else if (arg.starts_with("--") || !filename.empty()) {
+                usage();
+                return 1;
+            } else {
+                filename = arg;
+            }
+        }
+    } catch (const std::exception&) {
+        usage();
+        return 1;
+    }
+    if (filename.empty()) {
+        usage();
+        return 1;
+    }
+
+    if (decoding) {
+        opts.filename = filename;
+        try {
+            return decode(opts);
+        } catch (const std::runtime_error& e) {
+            std::println(std::cerr, "Error: {}", e.what());
+            return 1;
+        }
+    }
+
     if (filename.ends_with(".bin")) {
         std::ifstream in(filename, std::ios::binary);
         if (!in) {
@@ -43,16 +241,9 @@ int main(int argc, char* argv[]) {
             return 1;
         }
 
-        std::vector<std::string> lines;
-        std::string line;
-        std::string full_code;
-        while (std::getline(in, line)) {
-            lines.push_back(line);
-            full_code += line + "\n";
-        }
-
         Assembler assem;
-        assem.scan_for_labels(full_code);
+        auto lines = assem.read_source(in);
+        assem.scan_for_labels(lines);
 
         for (size_t i = 0; i < lines.size(); ++i) {
             uint32_t instr = assem.assemble(lines[i], i * 4);
@@ -64,38 +255,32 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    std::println("--- START TRACE: {} ---", filename);
-    
-    uint64_t cycle = 0;
-    while (!cpu.halted && cycle < limit) {
-        uint32_t pc = cpu.get_pc();
-        uint32_t sp = cpu.get_sp();
-        uint32_t raw = cpu.ram.read32(pc);
-
-        std::println("Cycle: {:<5} | PC: 0x{:04X} | SP: 0x{:04X} | Inst: 0x{:08X}", cycle, pc, sp, raw);
-        
-        // Print registers in 2 rows of 8
-        std::print("  ");
-        for (int i = 0; i < 8; ++i) {
-            std::print("R{}: 0x{:08X} ", i, cpu.registers[i]);
-        }
-        std::println("");
-        std::print("  ");
-        for (int i = 8; i < 16; ++i) {
-            std::print("R{:<2}: 0x{:08X} ", i, cpu.registers[i]);
-        }
-        std::println("");
-
-        // Flags
-        std::println("  Flags: Z:{} N:{} V:{} C:{}", 
-            cpu.status_reg[0], cpu.status_reg[1], cpu.status_reg[2], cpu.status_reg[3]);
-        std::println("------------------------------------------------------------------");
-
-        cpu.run_cycle();
-        cycle++;
+    if (out_file) {
+        try {
+            TraceWriter writer(cpu, *out_file);
+            auto result = cpu.run_debug(limit, writer);
+            writer.finish();
+            std::println("{}: {} instructions traced to {}{}", filename, result.cycles,
+                *out_file, cpu.halted ? " (halted)" : "");
+            if (auto stop = DebugSpec::describe_stop(cpu, result.reason); !stop.empty()) {
+                std::println("{}", stop);
+            }
+        } catch (const std::runtime_error& e) {
+            std::println(std::cerr, "Error: {}", e.what());
+            return 1;
+        }
+        return 0;
     }
 
-    if (cpu.halted) {
+    std::println("--- START TRACE: {} ---", filename);
+
+    Tracer tracer;
+    auto result = cpu.run_debug(limit, tracer);
+    auto cycle = result.cycles;
+
+    if (auto stop = DebugSpec::describe_stop(cpu, result.reason); !stop.empty()) {
+        std::println("{} after {} instructions", stop, cycle);
+    } else if (cpu.halted) {
         std::println("CPU HALTED at cycle {}", cycle);
     } else if (cycle >= limit) {
         std::println("Trace reached instruction limit ({})", limit);
@@ -1,4 +1,5 @@
 #include "tui.hpp"
+#include "debug_spec.hpp"
 #include "instructions.hpp"
 #include "string_assembler.hpp"
 #include <algorithm>
@@ -62,16 +63,22 @@ void TUI::run() {
     auto now = std::chrono::steady_clock::now();
 
     if (is_running_continuously) {
-      // Increased batch size for smoother feel
-      for (int i = 0; i < 150000; ++i) {
-        if (!cpu.halted) {
-          prev_registers = cpu.registers;
-          cpu.run_cycle();
-          total_cycles++;
-        } else {
+      // Increased batch size for smoother feel. VBLANK stops are just frame
+      // boundaries here, so keep going until the batch is spent.
+      uint64_t batch = 150000;
+      while (batch > 0) {
+        auto result = history.run(cpu, batch);
+        batch -= result.cycles;
+        total_cycles += result.cycles;
+        if (result.reason == CPU::StopReason::HALT ||
+            result.reason == CPU::StopReason::BREAKPOINT ||
+            result.reason == CPU::StopReason::WATCHPOINT) {
           is_running_continuously = false;
+          command_buffer = DebugSpec::describe_stop(cpu, result.reason);
           break;
         }
+        if (result.reason == CPU::StopReason::BUDGET)
+          break;
       }
     }
 
@@ -168,6 +175,42 @@ void TUI::update() {
   refresh();
 }
 
+// Single-steps through the history's observed interpreter, which reports
+// exactly which registers and words the instruction wrote.
+void TUI::step() {
+  if (cpu.halted)
+    return;
+  history.step(cpu);
+  auto regs = history.last_regs();
+  // The destination, or SP for a bare PUSH/CALL.
+  last_changed_reg = regs.empty() ? -1 : static_cast<int>(regs.back().reg);
+  auto stores = history.last_stores();
+  last_stores.assign(stores.begin(), stores.end());
+}
+
+// Reverse-step and reverse-continue restore earlier state, which no single
+// instruction wrote, so nothing is highlighted afterwards.
+void TUI::step_back(uint64_t n) {
+  is_running_continuously = false;
+  history.step_back(cpu, n);
+  last_changed_reg = -1;
+  last_stores.clear();
+}
+
+void TUI::reverse_continue() {
+  is_running_continuously = false;
+  history.reverse_continue(cpu);
+  last_changed_reg = -1;
+  last_stores.clear();
+}
+
+// Whether the last step wrote the byte at `addr`.
+bool TUI::stored(uint32_t addr) const {
+  return std::ranges::any_of(last_stores, [&](const StoreLog::Store &s) {
+    return addr - s.addr < 4;
+  });
+}
+
 void TUI::draw_registers() {
   attron(COLOR_PAIR(1));
   mvprintw(1, 2, "--- REGISTERS ---");
@@ -212,10 +255,12 @@ void TUI::draw_status() {
     col = 20;
   mvprintw(1, col, "--- STATUS ---");
   mvprintw(2, col, "PC: 0x%04X | SP: 0x%04X", cpu.get_pc(), cpu.get_sp());
-  mvprintw(3, col, "FLAGS: Z:%d N:%d V:%d C:%d", cpu.status_reg[0],
-           cpu.status_reg[1], (cpu.status_reg[2] ? 1 : 0),
-           (cpu.status_reg[3] ? 1 : 0));
-  mvprintw(4, col, "IPS: %.0f", current_ips);
+  auto flags = cpu.status_reg();
+  mvprintw(3, col, "FLAGS: Z:%d N:%d V:%d C:%d", flags[0], flags[1], flags[2],
+           flags[3]);
+  mvprintw(4, col, "IPS: %.0f | CYCLE: %llu (back to %llu)", current_ips,
+           (unsigned long long)history.cycle(),
+           (unsigned long long)history.oldest());
   mvprintw(5, col, "MODE: %s %s",
            (mode == Mode::NORMAL
                 ? "NORMAL"
@@ -224,7 +269,7 @@ void TUI::draw_status() {
                        : (mode == Mode::ZOOM ? "ZOOM" : "COMMAND"))),
            (is_running_continuously ? "(CONT)" : ""));
   mvprintw(6, col, "KEYS: %s",
-           (mode == Mode::NORMAL ? "s:step c:cont r:reset i:edit q:quit"
+           (mode == Mode::NORMAL ? "s:step S:back c:cont C:rev-cont r:reset i:edit q:quit"
                                  : "ESC:exit"));
 
   if (!command_buffer.empty()) {
@@ -267,6 +312,8 @@ void TUI::draw_disassembly() {
       attron(A_BOLD | A_REVERSE);
       mvprintw(2 + i, col, "> 0x%04X: %s", (uint32_t)addr, line.c_str());
       attroff(A_BOLD | A_REVERSE);
+    } else if (cpu.breakpoints.contains((uint32_t)addr)) {
+      mvprintw(2 + i, col, "* 0x%04X: %s", (uint32_t)addr, line.c_str());
     } else {
       mvprintw(2 + i, col, "0x%04X: %s", (uint32_t)addr, line.c_str());
     }
@@ -285,14 +332,25 @@ void TUI::draw_memory() {
     uint32_t row_addr = mem_offset + (i * 8);
     if (row_addr >= 16 * 1024 * 1024 || start_y + 1 + i >= term_h * 0.6)
       break;
-    std::stringstream ss;
-    ss << "0x" << std::hex << std::setw(4) << std::setfill('0') << row_addr
-       << ": ";
+    mvprintw(start_y + 1 + i, 2, "0x%04X: ", row_addr);
     uint8_t *ptr = cpu.ram.from(row_addr);
     for (int j = 0; j < 8; ++j) {
-      ss << std::hex << std::setw(2) << std::setfill('0') << (int)ptr[j] << " ";
+      // Bytes the last step stored to stand out.
+      bool hit = stored(row_addr + j);
+      if (hit)
+        attron(A_REVERSE);
+      printw("%02x", ptr[j]);
+      if (hit)
+        attroff(A_REVERSE);
+      printw(" ");
     }
-    mvprintw(start_y + 1 + i, 2, "%s", ss.str().c_str());
+  }
+  int row = start_y + 5;
+  for (const auto &s : last_stores) {
+    if (row >= term_h * 0.6)
+      break;
+    mvprintw(row++, 2, "[0x%06X] 0x%08X -> 0x%08X", s.addr, s.old_value,
+             s.new_value);
   }
   attroff(COLOR_PAIR(5));
 }
@@ -416,42 +474,59 @@ void TUI::draw_vram_preview() {
   if (zoom_start_y + visible_h > 240.0)
     zoom_start_y = 240.0 - visible_h;
 
+  // Cells are cached between frames; only preview rows sampling a VRAM row
+  // the guest wrote since are resampled, unless the view itself changed.
+  // A zero cell marks where the row ran off the right edge of VRAM.
+  VramView view{preview_w, preview_h, zoom_start_x, zoom_start_y, zoom_scale,
+                use_color};
+  auto dirty = cpu.take_vram_dirty();
+  bool resample_all = view != vram_view;
+  if (resample_all) {
+    vram_view = view;
+    vram_cells.assign(preview_w * preview_h, 0);
+  }
+
   for (int y = 0; y < preview_h; ++y) {
     int vy = (int)(zoom_start_y + (y * visible_h) / preview_h);
     if (vy < 0)
       vy = 0;
     if (vy >= 240)
       break;
-    uint32_t *row = vram + (vy * 320);
+    chtype *cells = &vram_cells[y * preview_w];
+
+    if (resample_all || ((uint32_t)vy >= dirty.first && (uint32_t)vy < dirty.end)) {
+      uint32_t *row = vram + (vy * 320);
+      for (int x = 0; x < preview_w; ++x) {
+        int vx = (int)(zoom_start_x + (x * visible_w) / preview_w);
+        if (vx < 0)
+          vx = 0;
+        if (vx >= 320) {
+          cells[x] = 0;
+          break;
+        }
 
-    move(start_y + y, start_col);
-    for (int x = 0; x < preview_w; ++x) {
-      int vx = (int)(zoom_start_x + (x * visible_w) / preview_w);
-      if (vx < 0)
-        vx = 0;
-      if (vx >= 320)
-        break;
-
-      uint32_t pixel = row[vx];
-      uint8_t r = (pixel >> 16) & 0xFF;
-      uint8_t g = (pixel >> 8) & 0xFF;
-      uint8_t b = pixel & 0xFF;
-
-      if (use_color) {
-        int r5 = (r * 5) / 255;
-        int g5 = (g * 5) / 255;
-        int b5 = (b * 5) / 255;
-        int pair_idx = 10 + (r5 * 36) + (g5 * 6) + b5;
-
-        attron(COLOR_PAIR(pair_idx));
-        addch(' ');
-        attroff(COLOR_PAIR(pair_idx));
-      } else {
-        const char *ramp = " .:-=+*#%@";
-        uint8_t lum = (r + g + b) / 3;
-        addch(ramp[(lum * 9) / 255]);
+        uint32_t pixel = row[vx];
+        uint8_t r = (pixel >> 16) & 0xFF;
+        uint8_t g = (pixel >> 8) & 0xFF;
+        uint8_t b = pixel & 0xFF;
+
+        if (use_color) {
+          int r5 = (r * 5) / 255;
+          int g5 = (g * 5) / 255;
+          int b5 = (b * 5) / 255;
+          int pair_idx = 10 + (r5 * 36) + (g5 * 6) + b5;
+          cells[x] = ' ' | COLOR_PAIR(pair_idx);
+        } else {
+          const char *ramp = " .:-=+*#%@";
+          uint8_t lum = (r + g + b) / 3;
+          cells[x] = ramp[(lum * 9) / 255];
+        }
       }
     }
+
+    move(start_y + y, start_col);
+    for (int x = 0; x < preview_w && cells[x]; ++x)
+      addch(cells[x]);
   }
 
   // Draw vivid '+' crosshair cursor at the zoom center coordinate in ZOOM mode
@@ -492,13 +567,18 @@ void TUI::handle_input() {
     // In ZOOM mode, we still want to step, reset, and continue
     switch (ch) {
     case 's':
-      if (!cpu.halted)
-        cpu.run_cycle();
+      step();
+      break;
+    case 'S':
+      step_back();
       break;
     case 'c':
       if (!cpu.halted)
         is_running_continuously = !is_running_continuously;
       break;
+    case 'C':
+      reverse_continue();
+      break;
     case 'r':
       handle_normal_mode('r');
       break; // Reuse reset logic
@@ -577,8 +657,9 @@ void TUI::handle_normal_mode(int ch) {
     cpu.halted = false;
     cpu.registers.fill(0);
     cpu.registers[16] = 0x7FFFFF; // Restore Sacred SP
-    prev_registers.fill(0);
     last_changed_reg = -1;
+    last_stores.clear();
+    history.clear();
     is_running_continuously = false;
     // Optionally clear first 1MB of RAM if you want a "clean" run
     for (uint32_t i = 0; i < 1024 * 1024; i += 4) {
@@ -610,22 +691,18 @@ void TUI::handle_normal_mode(int ch) {
     is_running_continuously = false;
     break;
   case 's':
-    if (!cpu.halted) {
-      prev_registers = cpu.registers;
-      cpu.run_cycle();
-      last_changed_reg = -1;
-      for (int i = 0; i < 17; ++i) {
-        if (cpu.registers[i] != prev_registers[i]) {
-          last_changed_reg = i;
-          break;
-        }
-      }
-    }
+    step();
+    break;
+  case 'S':
+    step_back();
     break;
   case 'c':
     if (!cpu.halted)
       is_running_continuously = !is_running_continuously;
     break;
+  case 'C':
+    reverse_continue();
+    break;
   case KEY_UP:
     if (cursor_y > 0)
       cursor_y--;
@@ -657,13 +734,14 @@ void TUI::handle_insert_mode(int ch) {
 
     // Apply changes to the whole buffer when exiting insert mode
     try {
-      std::string full_code;
       for (auto &line : editor_buffer) {
         // Trim trailing spaces
         line.erase(line.find_last_not_of(" \n\r\t") + 1, std::string::npos);
-        full_code += line + "\n";
       }
-      assem.scan_for_labels(full_code);
+      // LI lines become the instructions they stand for, so the editor keeps
+      // showing one line per word.
+      editor_buffer = assem.expand_pseudo_ops(editor_buffer);
+      assem.scan_for_labels(editor_buffer);
 
       for (size_t i = 0; i < editor_buffer.size(); ++i) {
         uint32_t instr = assem.assemble(editor_buffer[i], i * 4);
@@ -676,6 +754,8 @@ void TUI::handle_insert_mode(int ch) {
       }
     } catch (...) {
     }
+    // The program changed under the recorded history.
+    history.clear();
     return;
   }
 
@@ -772,6 +852,40 @@ void TUI::handle_command_mode(int ch) {
       } else {
         command_buffer = "Error loading " + filename;
       }
+    } else if (cmd.starts_with("back ")) {
+      try {
+        step_back(std::stoull(cmd.substr(5)));
+        command_buffer = "At cycle " + std::to_string(history.cycle());
+      } catch (const std::exception &) {
+        command_buffer = "Usage: back N";
+      }
+    } else if (cmd.starts_with("break ")) {
+      // :break ADDR [if R1 == 5], see vm/debug_spec.hpp
+      if (DebugSpec::add_breakpoint(cpu, cmd.substr(6)))
+        command_buffer = "Breakpoints: " + std::to_string(cpu.breakpoints.size());
+      else
+        command_buffer = "Usage: break ADDR [if REG|FLAG OP VALUE]";
+    } else if (cmd.starts_with("watch ")) {
+      if (DebugSpec::add_watchpoint(cpu, cmd.substr(6)))
+        command_buffer = "Watchpoints: " + std::to_string(cpu.watchpoints.size());
+      else
+        command_buffer = "Usage: watch ADDR[:BYTES][/r|/w|/rw]";
+    } else if (cmd == "clear") {
+      DebugSpec::clear(cpu);
+      command_buffer = "Breakpoints and watchpoints cleared";
+    } else if (cmd.starts_with("history ")) {
+      // :history RING [INTERVAL] starts a new, empty history.
+      std::istringstream args(cmd.substr(8));
+      std::size_t ring = 0;
+      uint64_t interval = 1 << 20;
+      if (args >> ring && ring > 0) {
+        args >> interval;
+        history = History(interval, ring);
+        command_buffer = "History: " + std::to_string(ring) +
+                         " checkpoints every " + std::to_string(interval);
+      } else {
+        command_buffer = "Usage: history RING [INTERVAL]";
+      }
     } else if (cmd == "q") {
       running = false;
     } else {
@@ -904,6 +1018,7 @@ bool TUI::load_file(const std::string &filename) {
       editor_buffer.push_back("");
     cursor_y = 0;
     cursor_x = 0;
+    history.clear();
     return true;
   } else {
     std::ifstream in(filename);
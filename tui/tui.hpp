@@ -1,5 +1,7 @@
 #pragma once
 #include "cpu.hpp"
+#include "history.hpp"
+#include "observer.hpp"
 #include "trie.hpp"
 #include "string_assembler.hpp"
 #include <ncurses.h>
@@ -35,6 +37,10 @@ private:
     void draw_editor();
     void draw_vram_preview();
     void handle_input();
+    void step();
+    void step_back(uint64_t n = 1);
+    void reverse_continue();
+    bool stored(uint32_t addr) const;
     
     void handle_normal_mode(int ch);
     void handle_insert_mode(int ch);
@@ -60,8 +66,11 @@ private:
     Trie trie;
     void init_trie();
 
-    std::array<std::uint32_t, 17> prev_registers{0};
-    int last_changed_reg = -1;
+    int last_changed_reg = -1; ///< Written by the last step, -1 if none
+    std::vector<StoreLog::Store> last_stores; ///< Stored by the last step
+
+    // Checkpoints and undo log behind S (step back) and C (reverse continue)
+    History history;
 
     // IPS Monitoring
     uint64_t total_cycles = 0;
@@ -72,4 +81,17 @@ private:
     double zoom_scale = 1.0;
     double zoom_cx = 160.0;
     double zoom_cy = 120.0;
+
+    // What the cached VRAM preview cells were sampled for
+    struct VramView {
+        int w = 0;
+        int h = 0;
+        double start_x = 0;
+        double start_y = 0;
+        double scale = 0;
+        bool color = false;
+        bool operator==(const VramView&) const = default;
+    };
+    VramView vram_view;
+    std::vector<chtype> vram_cells;
 };
@@ -1,64 +1,594 @@
 #include "cpu.hpp"
-#include "instructions_impl.hpp"
+#include "interpreter.hpp"
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
 
-static constexpr uint32_t CYCLES_PER_FRAME = 50000;
-uint32_t inst_count = 0;
+static constexpr uint32_t CYCLES_PER_FRAME = CPU::CYCLES_PER_FRAME;
 
-#define EXEC_INST(OpCode, Name)                                                \
+template auto CPU::run_observed(uint64_t, StoreLog &) -> uint64_t;
+
+auto CPU::run_cycle() -> void {
+  NullObserver none;
+  step(none);
+}
+
+auto CPU::run_switch(uint64_t cycles) -> uint64_t {
+  uint64_t retired = 0;
+  while (!halted && retired < cycles) {
+    run_cycle();
+    retired++;
+  }
+  return retired;
+}
+
+// Unknown opcodes keep their raw value so they land on the same "retire and
+// do nothing" path as in the switch engine.
+static auto decode(uint32_t raw) -> DecodedInst {
+  DecodedInst inst{};
+  inst.op = static_cast<uint8_t>(decodeOpt(raw));
+  inst.dest = field_dest(raw);
+  inst.s1 = field_s1(raw);
+  inst.s2 = field_s2(raw);
+  inst.imm = static_cast<uint16_t>(field_imm(raw));
+  inst.payload = field_payload(raw);
+  inst.offset = field_offset(raw);
+  return inst;
+}
+
+// Decodes forward from word `idx` up to the first block terminator or the end
+// of the page, and records the block length on its first word.
+static auto form_block(CPU &cpu, DecodedInst *page, uint32_t page_base,
+                       uint32_t idx) -> uint32_t {
+  uint32_t len = 0;
+  for (auto i = idx; i < DecodeCache::WORDS_PER_PAGE; i++) {
+    auto &slot = page[i];
+    if (slot.op == DecodedInst::UNDECODED)
+      slot = decode(cpu.load(page_base + i * 4));
+    len++;
+    if (ends_block(slot.op))
+      break;
+  }
+  page[idx].block_len = static_cast<uint16_t>(len);
+  return len;
+}
+
+#if defined(FANTA_THREADED_DISPATCH) && defined(__GNUC__)
+// Charges `n` instructions of frame budget in one go. This is exactly n rounds
+// of latch_vblank() + inst_count++ provided nothing reads the latch before the
+// last of them, which holds for a basic block because CIP always ends one.
+static inline auto charge_vblank(CPU &cpu, uint32_t n) -> void {
+  static_assert(DecodeCache::WORDS_PER_PAGE <= CYCLES_PER_FRAME,
+                "a block must not be able to latch VBLANK twice");
+  if (cpu.inst_count + n > CYCLES_PER_FRAME) {
+    auto latched_at = cpu.inst_count >= CYCLES_PER_FRAME
+                          ? 0
+                          : CYCLES_PER_FRAME - cpu.inst_count;
+    cpu.cip_interrupts[0] = 1;
+    cpu.inst_count = n - latched_at;
+  } else {
+    cpu.inst_count += n;
+  }
+}
+
+// Direct-threaded engine: every handler ends with its own indirect jump to
+// the next handler instead of funnelling through the single switch branch,
+// which gives the host branch predictor one history slot per opcode.
+//
+// PREDECODED and BLOCK read operands from the decode cache instead of
+// re-extracting them from the raw word. The current decoded page is kept in a
+// local so the common case is a single indexed load. The cache is indexed by
+// word, so a misaligned PC (only reachable through a computed JMP) takes the
+// reference path.
+//
+// BLOCK additionally charges VBLANK and the cycle budget once per basic block
+// on entry, so the handlers only have to count down to the block's end.
+template <CPU::Engine E>
+auto CPU::run_threaded_impl(uint64_t cycles) -> uint64_t {
+  constexpr bool Decoded = E != Engine::THREADED;
+  constexpr bool Blocks = E == Engine::BLOCK;
+  uint64_t retired = 0;
+  uint32_t instr = 0;
+  const DecodedInst *inst = nullptr;
+  DecodedInst *page = nullptr;
+  uint32_t page_base = 0;
+  // Current block's length, how much of it is left to run, and the VBLANK
+  // state to rewind to if it gets cut short.
+  uint32_t block_len = 0;
+  uint32_t left = 0;
+  uint32_t entry_count = 0;
+  uint8_t entry_latch = 0;
+  NullObserver none;
+  if (halted || cycles == 0)
+    return 0;
+
+  // Unknown opcodes behave like the switch engine: nothing executes but the
+  // instruction still retires.
+  void *dispatch[DecodedInst::UNDECODED + 1];
+  std::fill(std::begin(dispatch), std::end(dispatch), &&op_unknown);
+#define THREADED_LABEL(OpCode, Name) dispatch[OpCode] = &&op_##Name;
+  FANTA_OPCODE_TABLE(THREADED_LABEL)
+#undef THREADED_LABEL
+  dispatch[DecodedInst::UNDECODED] = &&op_decode;
+
+  if constexpr (Decoded) {
+    page_base = PC & ~(DecodeCache::PAGE_SIZE - 1);
+    page = &icache.lookup(page_base);
+  }
+
+#define THREADED_NEXT()                                                        \
+  do {                                                                         \
+    if constexpr (Blocks) {                                                    \
+      if (--left == 0)                                                         \
+        goto block_entry;                                                      \
+      inst++;                                                                  \
+      PC += 4;                                                                 \
+      goto *dispatch[inst->op];                                                \
+    } else if constexpr (Decoded) {                                            \
+      if (PC - page_base >= DecodeCache::PAGE_SIZE || (PC & 3)) [[unlikely]]   \
+        goto repage;                                                           \
+      inst = &page[(PC - page_base) >> 2];                                     \
+      PC += 4;                                                                 \
+      latch_vblank(*this);                                                     \
+      goto *dispatch[inst->op];                                                \
+    } else {                                                                   \
+      instr = fetch();                                                         \
+      latch_vblank(*this);                                                     \
+      goto *dispatch[decodeOpt(instr)];                                        \
+    }                                                                          \
+  } while (0)
+
+#define THREADED_INST(OpCode, Name)                                            \
+  op_##Name : if constexpr (Decoded) Name::exec(*this, *inst, none);           \
+  else Name::exec(*this, instr, none);                                         \
+  if constexpr (Blocks) {                                                      \
+    if constexpr (std::is_same_v<Name, ::Halt>)                                \
+      return retired;                                                          \
+  } else {                                                                     \
+    inst_count++;                                                              \
+    if constexpr (std::is_same_v<Name, ::Halt>)                                \
+      return ++retired;                                                        \
+    if (++retired == cycles)                                                   \
+      return retired;                                                          \
+  }                                                                            \
+  THREADED_NEXT();
+
+  if constexpr (Blocks)
+    goto block_entry;
+  THREADED_NEXT();
+  FANTA_OPCODE_TABLE(THREADED_INST)
+op_unknown:
+  if constexpr (!Blocks) {
+    inst_count++;
+    if (++retired == cycles)
+      return retired;
+  }
+  THREADED_NEXT();
+
+// First execution of a cached word (or after a store invalidated it). VBLANK
+// has already been latched for this instruction, so only decode and go.
+//
+// Inside a block this means a store earlier in the block overwrote a word
+// further on. Retire only what has run so far and re-form a block from here.
+op_decode : {
+  if constexpr (Blocks) {
+    PC -= 4;
+    retired -= left;
+    inst_count = entry_count;
+    cip_interrupts[0] = entry_latch;
+    charge_vblank(*this, block_len - left);
+    goto block_entry;
+  }
+  auto &slot = icache.lookup(get_prev_pc());
+  slot = decode(load(get_prev_pc()));
+  goto *dispatch[slot.op];
+}
+
+// Control flow left the current decoded page. Re-anchor on the new one, or
+// single-step through the reference path while PC is misaligned. Only the
+// PREDECODED engine comes here.
+repage:
+  __attribute__((unused));
+  if (PC & 3) [[unlikely]] {
+    run_cycle();
+    if (++retired == cycles || halted)
+      return retired;
+    THREADED_NEXT();
+  }
+  page_base = PC & ~(DecodeCache::PAGE_SIZE - 1);
+  page = &icache.lookup(page_base);
+  THREADED_NEXT();
+
+// A terminator (or the page end) was reached. HALT never gets here: it
+// returns straight from its handler. Blocks never span pages, so PC can only
+// have left the current one through a jump.
+block_entry : {
+  if (PC - page_base >= DecodeCache::PAGE_SIZE || (PC & 3)) [[unlikely]] {
+    if (PC & 3) {
+      if (retired == cycles)
+        return retired;
+      run_cycle();
+      retired++;
+      if (halted)
+        return retired;
+      goto block_entry;
+    }
+    page_base = PC & ~(DecodeCache::PAGE_SIZE - 1);
+    page = &icache.lookup(page_base);
+  }
+  auto idx = (PC - page_base) >> 2;
+  block_len = page[idx].block_len;
+  if (block_len == 0) [[unlikely]]
+    block_len = form_block(*this, page, page_base, idx);
+  // Not enough budget left for the whole block: finish one at a time.
+  if (retired + block_len > cycles) [[unlikely]] {
+    while (retired < cycles && !halted) {
+      run_cycle();
+      retired++;
+    }
+    return retired;
+  }
+  entry_count = inst_count;
+  entry_latch = cip_interrupts[0];
+  charge_vblank(*this, block_len);
+  retired += block_len;
+  left = block_len;
+  inst = &page[idx];
+  PC += 4;
+  goto *dispatch[inst->op];
+}
+
+#undef THREADED_INST
+#undef THREADED_NEXT
+}
+
+auto CPU::run_threaded(uint64_t cycles) -> uint64_t {
+  return run_threaded_impl<Engine::THREADED>(cycles);
+}
+
+auto CPU::run_predecoded(uint64_t cycles) -> uint64_t {
+  return run_threaded_impl<Engine::PREDECODED>(cycles);
+}
+
+auto CPU::run_blocks(uint64_t cycles) -> uint64_t {
+  return run_threaded_impl<Engine::BLOCK>(cycles);
+}
+#else
+auto CPU::run_threaded(uint64_t cycles) -> uint64_t {
+  return run_switch(cycles);
+}
+
+#define DECODED_INST(OpCode, Name)                                             \
   case OpCode: {                                                               \
-    Name::exec(*this, instr);                                                  \
+    Name::exec(*this, inst, none);                                             \
     break;                                                                     \
   }
 
-auto decodeOpt(uint32_t inst) { return (inst >> 26) & 0x3F; }
+auto CPU::run_predecoded(uint64_t cycles) -> uint64_t {
+  uint64_t retired = 0;
+  NullObserver none;
+  while (!halted && retired < cycles) {
+    if (PC & 3) [[unlikely]] {
+      run_cycle();
+      retired++;
+      continue;
+    }
+    auto &inst = icache.lookup(PC);
+    if (inst.op == DecodedInst::UNDECODED) [[unlikely]]
+      inst = decode(load(PC));
+    PC += 4;
+    latch_vblank(*this);
+    switch (inst.op) { FANTA_OPCODE_TABLE(DECODED_INST) }
+    inst_count++;
+    retired++;
+  }
+  return retired;
+}
 
-auto CPU::run_cycle() -> void {
-  auto instr = fetch();
-  auto byte = decodeOpt(instr);
-  if (inst_count >= CYCLES_PER_FRAME) {
-    cip_interrupts[0] = 1;
-    inst_count = 0;
-  }
-  switch (byte) {
-    EXEC_INST(0, Halt)
-    EXEC_INST(0x1, AddReg)
-    EXEC_INST(0x2, AddImm)
-    EXEC_INST(0x3, MovReg)
-    EXEC_INST(0x4, MovImm)
-    EXEC_INST(0x5, SubReg)
-    EXEC_INST(0x6, SubImm)
-    EXEC_INST(0x7, Jmp)
-    EXEC_INST(0x8, StoreReg)
-    EXEC_INST(0x9, LoadReg)
-    EXEC_INST(0xa, Beq)
-    EXEC_INST(0xb, Bne)
-    EXEC_INST(0xc, LshReg)
-    EXEC_INST(0xd, LshImm)
-    EXEC_INST(0xe, CmpReg)
-    EXEC_INST(0xf, CmpImm)
-    EXEC_INST(0x10, Bec)
-    EXEC_INST(0x11, Bmi)
-    EXEC_INST(0x12, Bpl)
-    EXEC_INST(0x13, Jrel)
-    EXEC_INST(0x14, Nop)
-    EXEC_INST(0x15, Call)
-    EXEC_INST(0x16, Ret)
-    EXEC_INST(0x17, AndReg)
-    EXEC_INST(0x18, AndImm)
-    EXEC_INST(0x19, OrReg)
-    EXEC_INST(0x1A, OrImm)
-    EXEC_INST(0x1B, XorReg)
-    EXEC_INST(0x1C, XorImm)
-    EXEC_INST(0x1D, Push)
-    EXEC_INST(0x1E, Pop)
-    EXEC_INST(0x1F, Cip)
-    EXEC_INST(0x20, Bnc)
-  }
-  inst_count++;
+#undef DECODED_INST
+
+// Without computed goto there is no cheap way to count down a block inside
+// the dispatch loop, so BLOCK runs the per-instruction decoded loop.
+auto CPU::run_blocks(uint64_t cycles) -> uint64_t {
+  return run_predecoded(cycles);
+}
+#endif
+
+#if defined(FANTA_JIT)
+#define JIT_INST(OpCode, Name)                                                 \
+  case OpCode: {                                                               \
+    Name::exec(*cpu, *inst, none);                                             \
+    break;                                                                     \
+  }
+
+// Jit::Interpret: the JIT's way out for instructions it does not translate.
+static auto jit_interpret(CPU *cpu, const DecodedInst *inst, uint32_t pc)
+    -> uint64_t {
+  auto before = cpu->icache.generation();
+  NullObserver none;
+  cpu->set_pc(pc + 4);
+  switch (inst->op) { FANTA_OPCODE_TABLE(JIT_INST) }
+  cpu->flags.settle();
+  auto wrote_code = cpu->icache.generation() != before;
+  return cpu->get_pc() | static_cast<uint64_t>(wrote_code) << 32;
+}
+
+#undef JIT_INST
+
+// Translates the block at PC, flushing the code buffer if it is full. Returns
+// null if that flush happened, since any pending chain site is now gone.
+static auto translate(CPU &cpu, uint32_t pc) -> const Jit::Block * {
+  auto page_base = pc & ~(DecodeCache::PAGE_SIZE - 1);
+  auto *page = &cpu.icache.lookup(page_base);
+  auto idx = (pc - page_base) >> 2;
+  auto len = page[idx].block_len;
+  if (len == 0)
+    len = form_block(cpu, page, page_base, idx);
+  if (auto *block = cpu.jit->compile(cpu, &page[idx], pc, len))
+    return block;
+  cpu.jit->flush(cpu.icache.generation());
+  return nullptr;
+}
+
+auto CPU::run_jit(uint64_t cycles) -> uint64_t {
+  if (!jit)
+    jit = std::make_unique<Jit>(&jit_interpret);
+  JitState state{};
+  state.memory = ram.from(0);
+  state.code_pages = icache.code_pages();
+  state.dirty_pages = ram.dirty_pages();
+  state.vram_spans = vram_dirty_spans();
+
+  uint64_t retired = 0;
+  while (!halted && retired < cycles) {
+    // Something overwrote decoded code since the last translation.
+    if (jit->generation != icache.generation())
+      jit->flush(icache.generation());
+    if (PC & 3) [[unlikely]] {
+      run_cycle();
+      retired++;
+      continue;
+    }
+    auto *block = jit->find(PC);
+    if (!block && !(block = translate(*this, PC)))
+      block = translate(*this, PC);
+
+    // Blocks the budget cannot cover, or that would latch VBLANK part-way,
+    // take the reference path so the latch lands on the right instruction.
+    if (retired + block->len > cycles ||
+        inst_count + block->len > CYCLES_PER_FRAME) {
+      for (uint32_t i = 0; i < block->len && retired < cycles && !halted;
+           i++) {
+        run_cycle();
+        retired++;
+      }
+      continue;
+    }
+
+    inst_count += block->len;
+    state.count = inst_count;
+    state.budget = cycles - retired - block->len;
+    state.step = 0;
+    state.chain_site = nullptr;
+    flags.settle();
+    jit->enter(*this, state, block->body);
+    inst_count = state.count;
+    retired = cycles - state.budget;
+    PC = state.pc;
+
+    if (state.step) {
+      run_cycle();
+      retired++;
+    } else if (state.chain_site && !(PC & 3) && !halted &&
+               jit->generation == icache.generation()) {
+      // First time this direct jump was taken: point it straight at its
+      // target so the next time it never leaves native code.
+      auto *target = jit->find(PC);
+      if (!target)
+        target = translate(*this, PC);
+      if (target)
+        jit->link(state.chain_site, *target);
+    }
+  }
+  return retired;
+}
+#else
+auto CPU::run_jit(uint64_t cycles) -> uint64_t { return run_blocks(cycles); }
+#endif
+
+auto CPU::run_for(uint64_t cycles) -> uint64_t {
+  switch (engine) {
+  case Engine::SWITCH:
+    return run_switch(cycles);
+  case Engine::THREADED:
+    return run_threaded(cycles);
+  case Engine::PREDECODED:
+    return run_predecoded(cycles);
+  case Engine::BLOCK:
+    return run_blocks(cycles);
+  case Engine::JIT:
+    return run_jit(cycles);
+  }
+  return 0;
+}
+
+auto CPU::run(uint64_t budget) -> RunResult {
+  if (halted)
+    return {StopReason::HALT, 0};
+  // A VBLANK that fell due at the end of the previous run is latched before
+  // anything else executes, exactly as the engines would have done.
+  latch_vblank(*this);
+  uint64_t retired = 0;
+  while (retired < budget) {
+    // Never hand an engine more than the rest of the frame, so none of them
+    // has to look for the VBLANK boundary themselves.
+    auto chunk = std::min<uint64_t>(budget - retired,
+                                    CYCLES_PER_FRAME - inst_count);
+    if (breakpoints.empty() && watchpoints.empty()) {
+      break_resume.reset();
+      retired += run_for(chunk);
+    } else {
+      NullObserver none;
+      auto result = run_debug(chunk, none);
+      retired += result.cycles;
+      if (result.reason == StopReason::BREAKPOINT ||
+          result.reason == StopReason::WATCHPOINT)
+        return {result.reason, retired};
+    }
+    if (halted)
+      return {StopReason::HALT, retired};
+    if (inst_count >= CYCLES_PER_FRAME) {
+      latch_vblank(*this);
+      return {StopReason::INTERRUPT, retired};
+    }
+  }
+  return {StopReason::BUDGET, retired};
+}
+
+auto CPU::Condition::holds(const CPU &cpu) const -> bool {
+  uint32_t actual = source == Source::REG ? cpu.registers[index]
+                                          : cpu.status_reg()[index];
+  auto lhs = static_cast<int32_t>(actual);
+  auto rhs = static_cast<int32_t>(value);
+  switch (cmp) {
+  case Cmp::EQ:
+    return lhs == rhs;
+  case Cmp::NE:
+    return lhs != rhs;
+  case Cmp::LT:
+    return lhs < rhs;
+  case Cmp::LE:
+    return lhs <= rhs;
+  case Cmp::GT:
+    return lhs > rhs;
+  case Cmp::GE:
+    return lhs >= rhs;
+  }
+  return false;
+}
+
+auto CPU::at_breakpoint() const -> bool {
+  if (!breakpoints.contains(PC))
+    return false;
+  auto condition = conditions.find(PC);
+  return condition == conditions.end() || condition->second.holds(*this);
+}
+
+auto CPU::sync_debug_pages() -> void {
+  debug_pages.assign(MEMORY_SIZE >> Memory::PAGE_SHIFT, 0);
+  for (auto pc : breakpoints) {
+    if (pc < MEMORY_SIZE)
+      debug_pages[pc >> Memory::PAGE_SHIFT] |= BREAK_PAGE;
+  }
+  // Accesses are checked by the page of the word's first byte, so a range
+  // also claims the three bytes before it.
+  for (const auto &w : watchpoints) {
+    auto first = w.addr < 3 ? 0 : w.addr - 3;
+    auto last = std::min<uint64_t>(uint64_t{w.addr} + std::max(w.bytes, 1u) - 1,
+                                   MEMORY_SIZE - 1);
+    for (auto page = first >> Memory::PAGE_SHIFT;
+         page <= last >> Memory::PAGE_SHIFT; page++)
+      debug_pages[page] |= WATCH_PAGE;
+  }
+}
+
+auto CPU::watch_match(uint32_t addr, bool write, uint32_t value) -> bool {
+  for (const auto &w : watchpoints) {
+    if (!(write ? w.write : w.read))
+      continue;
+    // Overlap of [addr, addr + 4) with [w.addr, w.addr + bytes).
+    if (uint64_t{addr} + 4 > w.addr &&
+        addr < uint64_t{w.addr} + std::max(w.bytes, 1u)) {
+      watch_hit = {PC, addr, write, value};
+      return true;
+    }
+  }
+  return false;
+}
+
+auto CPU::snapshot() -> Snapshot {
+  return {registers, flags,      cip_interrupts, PC,
+          inst_count, halted,    ram.capture()};
+}
+
+auto CPU::restore(const Snapshot &snap) -> void {
+  static_assert(Memory::PAGE_SIZE == DecodeCache::PAGE_SIZE,
+                "restored pages map one-to-one onto decode cache pages");
+  for (auto page : ram.restore(snap.memory)) {
+    icache.invalidate_page(page);
+    for (uint32_t a = page << Memory::PAGE_SHIFT;
+         a < (page + 1) << Memory::PAGE_SHIFT; a += VRAM_SPAN)
+      mark_vram(a);
+  }
+  registers = snap.registers;
+  flags = snap.flags;
+  cip_interrupts = snap.cip_interrupts;
+  PC = snap.pc;
+  inst_count = snap.inst_count;
+  halted = snap.halted;
+}
+
+// Whether [addr, addr + bytes) is inside guest memory, without wrapping.
+static auto in_memory(uint32_t addr, uint64_t bytes) -> bool {
+  return addr + bytes <= CPU::MEMORY_SIZE;
+}
+
+auto CPU::fill_words(uint32_t addr, uint32_t val, uint32_t words) -> void {
+  auto bytes = uint64_t{words} * 4;
+  if (!in_memory(addr, bytes)) [[unlikely]] {
+    for (uint32_t i = 0; i < words; i++) {
+      auto to = addr + 4 * i;
+      if (to <= MEMORY_SIZE - 4)
+        store(to, val);
+    }
+    return;
+  }
+  ram.fill32(addr, val, words);
+  icache.invalidate_range(addr, static_cast<uint32_t>(bytes));
+  mark_vram_range(addr, static_cast<uint32_t>(bytes));
+}
+
+auto CPU::copy_words(uint32_t addr, uint32_t src, uint32_t words) -> void {
+  auto bytes = uint64_t{words} * 4;
+  // A destination just above the source reads back words this same copy
+  // wrote (repeating the pattern between them), which memmove does not.
+  auto repeats = addr > src && addr - src < bytes;
+  if (repeats || !in_memory(addr, bytes) || !in_memory(src, bytes))
+      [[unlikely]] {
+    for (uint32_t i = 0; i < words; i++) {
+      auto from = src + 4 * i;
+      auto to = addr + 4 * i;
+      auto val = from <= MEMORY_SIZE - 4 ? load(from) : 0;
+      if (to <= MEMORY_SIZE - 4)
+        store(to, val);
+    }
+    return;
+  }
+  ram.move(addr, src, bytes);
+  icache.invalidate_range(addr, static_cast<uint32_t>(bytes));
+  mark_vram_range(addr, static_cast<uint32_t>(bytes));
+}
+
+auto CPU::take_vram_dirty() -> VramRows {
+  constexpr uint32_t SPANS_PER_ROW = VRAM_ROW_BYTES / VRAM_SPAN;
+  VramRows rows;
+  for (uint32_t row = 0; row < VRAM_HEIGHT; row++) {
+    auto *span = &vram_spans[1 + row * SPANS_PER_ROW];
+    uint8_t written = 0;
+    for (uint32_t s = 0; s < SPANS_PER_ROW; s++)
+      written |= span[s];
+    if (!written)
+      continue;
+    if (rows.empty())
+      rows.first = row;
+    rows.end = row + 1;
+  }
+  vram_spans.fill(0);
+  return rows;
 }
 
 auto CPU::run_until_halt() -> void {
   while (!halted) {
-    run_cycle();
+    run_for(UINT64_MAX);
   }
 }
@@ -1,11 +1,73 @@
 #pragma once
+#include <algorithm>
+#include <array>
 #include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "decode_cache.hpp"
+#include "flags.hpp"
+#include "jit.hpp"
+
+/**
+ * @brief Guest RAM, committed a host page at a time on first touch.
+ *
+ * @details Backed by an anonymous private mapping (calloc where mmap is not
+ *          available), so construction is O(1) regardless of size and the
+ *          kernel only commits (and zeroes) the pages a program actually
+ *          touches. Accesses are still a plain offset from one base pointer.
+ *
+ *          Every write marks its 4KB page dirty. capture() copies out just the
+ *          pages that have ever been written, and restore() copies back just
+ *          the ones dirtied since the last capture() or restore() of that
+ *          image, which is what makes CPU::restore() cheap.
+ *
+ * @warning Writes through from() are not tracked.
+ */
 struct Memory {
-  Memory(std::size_t size) : memory(size) {}
+  static constexpr uint32_t PAGE_SHIFT = 12;
+  static constexpr uint32_t PAGE_SIZE = 1u << PAGE_SHIFT;
+
+  // Copy of the written pages of a Memory at one point in time.
+  struct Image {
+    static constexpr uint32_t NONE = UINT32_MAX;
+    uint64_t id = 0;
+    std::vector<uint32_t> slot; ///< Per page: index into `data`, or NONE
+    std::vector<uint8_t> data;  ///< Captured pages, PAGE_SIZE bytes each
+  };
+
+  Memory(std::size_t size);
+  ~Memory();
+  Memory(Memory &&other) noexcept;
+  auto operator=(Memory &&other) noexcept -> Memory &;
+  Memory(const Memory &) = delete;
+  auto operator=(const Memory &) -> Memory & = delete;
+
   auto write32(std::size_t base_addr, uint32_t data) {
     std::memcpy(&memory[base_addr], &data, sizeof(uint32_t));
+    // A misaligned word can straddle two pages.
+    dirty[base_addr >> PAGE_SHIFT] = 1;
+    dirty[(base_addr + 3) >> PAGE_SHIFT] = 1;
+  }
+
+  // `words` write32()s of `data` from base_addr upward.
+  auto fill32(std::size_t base_addr, uint32_t data, std::size_t words) {
+    auto *p = &memory[base_addr];
+    // Word-sized copies of one value; compilers turn the loop into wide
+    // vector stores.
+    for (std::size_t i = 0; i < words; i++)
+      std::memcpy(p + 4 * i, &data, sizeof(uint32_t));
+    mark(base_addr, words * 4);
+  }
+
+  // std::memmove() of `bytes` bytes from src to dst.
+  auto move(std::size_t dst, std::size_t src, std::size_t bytes) {
+    std::memmove(&memory[dst], &memory[src], bytes);
+    mark(dst, bytes);
   }
 
   auto read32(std::size_t base_addr) -> uint32_t {
@@ -16,14 +78,129 @@ struct Memory {
 
   auto from(std::size_t base_addr) -> uint8_t * { return &memory[base_addr]; }
 
+  // One byte per page, set by every write. Native code that stores to guest
+  // memory directly has to set it too.
+  auto dirty_pages() -> uint8_t * { return dirty.data(); }
+
+  auto page_count() const -> uint32_t {
+    return static_cast<uint32_t>(size >> PAGE_SHIFT);
+  }
+
+  // Whether page `page` has ever been written (through write32 or a native
+  // store that marked it).
+  auto written(uint32_t page) const -> bool {
+    return dirty[page] || touched[page];
+  }
+
+  auto capture() -> Image;
+
+  // Puts back the contents `image` was captured with. Returns the pages that
+  // were rewritten, since anything cached from them is now stale.
+  auto restore(const Image &image) -> std::vector<uint32_t>;
+
+  // Host memory currently backing the guest, or the full size if that cannot
+  // be queried.
+  auto committed_bytes() const -> std::size_t;
+
 private:
-  std::vector<std::uint8_t> memory; // 16MB
+  auto release() -> void;
+
+  auto mark(std::size_t base_addr, std::size_t bytes) -> void {
+    if (bytes != 0)
+      std::fill(dirty.begin() + (base_addr >> PAGE_SHIFT),
+                dirty.begin() + ((base_addr + bytes - 1) >> PAGE_SHIFT) + 1, 1);
+  }
+
+  // Folds `dirty` into `touched` and starts tracking from scratch.
+  auto sync() -> void;
+
+  std::uint8_t *memory = nullptr;
+  std::size_t size = 0;
+  std::vector<uint8_t> dirty;   ///< Written since the last capture/restore
+  std::vector<uint8_t> touched; ///< Written before that
+  uint64_t base_id = 0;         ///< Image `dirty` is relative to, 0 if none
 };
 
 struct CPU {
   enum FLAG : uint8_t { ZERO, NEGATIVE, OVFL, CARRY };
 
-  CPU() : ram(32 * 1024 * 1024) {
+  // Batch execution engines. SWITCH is the reference interpreter that
+  // run_cycle() also uses; the others must stay observably identical to it.
+  // JIT needs vm_lib built with FANTA_JIT and falls back to BLOCK otherwise.
+  enum class Engine : uint8_t { SWITCH, THREADED, PREDECODED, BLOCK, JIT };
+
+  // Why CPU::run() returned.
+  enum class StopReason : uint8_t {
+    BUDGET,     ///< Ran the whole budget
+    HALT,       ///< Executed HALT, or was already halted
+    BREAKPOINT, ///< PC reached an address in `breakpoints`
+    INTERRUPT,  ///< VBLANK was latched and is now pending
+    WATCHPOINT, ///< The last instruction touched a watched word; see watch_hit
+  };
+
+  struct RunResult {
+    StopReason reason;
+    uint64_t cycles; ///< Instructions retired by this call
+  };
+
+  // Framebuffer rows [first, end) that were written; empty if first == end.
+  struct VramRows {
+    uint32_t first = 0;
+    uint32_t end = 0;
+    auto empty() const -> bool { return first == end; }
+  };
+
+  // Register or flag test a conditional breakpoint needs to pass. Ordered
+  // comparisons are signed.
+  struct Condition {
+    enum class Source : uint8_t { REG, FLAG };
+    enum class Cmp : uint8_t { EQ, NE, LT, LE, GT, GE };
+    Source source = Source::REG;
+    uint8_t index = 0; ///< Register (16 is SP), or a CPU::FLAG
+    Cmp cmp = Cmp::EQ;
+    uint32_t value = 0;
+
+    auto holds(const CPU &cpu) const -> bool;
+  };
+
+  // Bytes [addr, addr + bytes) that stop a run when an instruction reads or
+  // writes any word overlapping them.
+  struct Watchpoint {
+    uint32_t addr = 0;
+    uint32_t bytes = 4;
+    bool read = false;
+    bool write = true;
+  };
+
+  // The access that stopped the last run with WATCHPOINT.
+  struct WatchHit {
+    uint32_t pc = 0;    ///< Instruction that made it
+    uint32_t addr = 0;  ///< Word address
+    bool write = false;
+    uint32_t value = 0; ///< Word read, or the value being written
+  };
+
+  static constexpr std::size_t MEMORY_SIZE = 32 * 1024 * 1024;
+  // Instructions between VBLANK interrupts.
+  static constexpr uint32_t CYCLES_PER_FRAME = 50000;
+  // Most words one execution of MEMSET/MEMCPY moves, so a block transfer
+  // costs one cycle per 256 bytes.
+  static constexpr uint32_t BLOCK_WORDS = 64;
+
+  // 320x240 ARGB8888 framebuffer.
+  static constexpr uint32_t VRAM_BASE = 0x800000;
+  static constexpr uint32_t VRAM_WIDTH = 320;
+  static constexpr uint32_t VRAM_HEIGHT = 240;
+  static constexpr uint32_t VRAM_ROW_BYTES = VRAM_WIDTH * 4;
+  static constexpr uint32_t VRAM_BYTES = VRAM_ROW_BYTES * VRAM_HEIGHT;
+  // VRAM writes are tracked per 256-byte span, five to a row. Span i of the
+  // framebuffer is vram_spans[i + 1]; the first and last entries soak up the
+  // bytes of a misaligned word that fall outside it.
+  static constexpr uint32_t VRAM_SPAN_SHIFT = 8;
+  static constexpr uint32_t VRAM_SPAN = 1u << VRAM_SPAN_SHIFT;
+  static_assert(VRAM_ROW_BYTES % VRAM_SPAN == 0, "spans must not cross rows");
+
+  CPU() : ram(MEMORY_SIZE), icache(MEMORY_SIZE) {
     registers.fill(0);
     registers[16] = 0x7FFFFF;
   }
@@ -35,37 +212,77 @@ struct CPU {
 
   constexpr auto store(uint32_t addr, uint32_t val) -> void {
     ram.write32(addr, val);
+    icache.invalidate(addr);
+    mark_vram(addr);
   }
 
   constexpr auto load(uint32_t addr) -> std::uint32_t {
     return ram.read32(addr);
   }
 
+  // `words` store()s of `val`, or of the words from `src`, from `addr`
+  // upward in address order, with the same effect on memory, decoded code
+  // and VRAM tracking. Words that do not fit in guest memory are skipped and
+  // read as 0. Transfers that fit are done in bulk (a vectorized fill,
+  // memmove) rather than a word at a time.
+  auto fill_words(uint32_t addr, uint32_t val, uint32_t words) -> void;
+  auto copy_words(uint32_t addr, uint32_t src, uint32_t words) -> void;
+
   template <std::size_t S>
   constexpr auto load_rom(const std::array<uint32_t, S> &data) {
     for (std::size_t i = 0; i < S; i++) {
-      ram.write32(i * 4, data[i]);
+      store(i * 4, data[i]);
     }
   }
 
   auto run_cycle() -> void;
   auto run_until_halt() -> void;
 
-  auto get_vram() { return ram.from(0x800000); }
+  // Front-end entry point: runs up to `budget` instructions with the selected
+  // engine, stopping early on HALT, on reaching a breakpoint, right after an
+  // instruction touches a watchpoint, or right after the instruction that
+  // makes VBLANK fall due (the interrupt is latched before returning).
+  // Breakpoints stop before the instruction at that address executes, except
+  // for one the previous run stopped at (see break_resume). With no
+  // breakpoints or watchpoints set, this is the engine at full speed;
+  // otherwise it is run_debug().
+  auto run(uint64_t budget) -> RunResult;
+
+  // Runs at most `cycles` instructions with the selected engine, stopping
+  // early on HALT. Returns the number of instructions retired.
+  auto run_for(uint64_t cycles) -> uint64_t;
+
+  // run_for() through the reference interpreter, reporting every write and
+  // every retired instruction to `observer` (see vm/observer.hpp). Defined
+  // in vm/interpreter.hpp; the engines themselves never see an observer.
+  template <typename Observer>
+  auto run_observed(uint64_t cycles, Observer &observer) -> uint64_t;
+
+  // run_observed() that also stops like run() does on breakpoints and
+  // watchpoints (but not at frame boundaries). Also in vm/interpreter.hpp.
+  // Only instructions on a page holding a breakpoint, and accesses to a page
+  // holding a watchpoint, look any further than one byte of page map.
+  template <typename Observer>
+  auto run_debug(uint64_t cycles, Observer &observer) -> RunResult;
+
+  // Whether PC is at one of `breakpoints` and its condition, if any, holds.
+  auto at_breakpoint() const -> bool;
+
+  auto get_vram() { return ram.from(VRAM_BASE); }
+
+  // Rows written since the last call (every row, the first time), so a
+  // front-end only has to upload or resample those. Stores made through
+  // ram directly are not seen.
+  auto take_vram_dirty() -> VramRows;
+
+  // One byte per VRAM span plus the two guard entries; see VRAM_SPAN_SHIFT.
+  // Native code that stores to guest memory directly has to set it too.
+  auto vram_dirty_spans() -> uint8_t * { return vram_spans.data(); }
 
   auto get_prev_pc() -> std::uint32_t { return PC - 4; }
 
   auto check_arith(uint32_t s1, uint32_t s2, uint32_t res, bool isSub) -> void {
-    set_zero(res);
-    set_neg(res);
-
-    if (isSub) {
-      set_carry(s1 >= s2);
-      set_overflow(((s1 ^ s2) & (s1 ^ res)) & 0x80000000);
-    } else {
-      set_carry(res < s1);
-      set_overflow(((s1 ^ res) & (s2 ^ res)) & 0x80000000);
-    }
+    flags.arith(isSub ? Flags::SUB : Flags::ADD, s1, s2, res);
   }
 
   auto get_pc() const -> uint32_t { return PC; }
@@ -93,31 +310,33 @@ struct CPU {
     return isNeg ? !result : result;
   }
 
-  auto is_zero_set() -> bool { return status_reg[0] == 1; }
+  auto is_zero_set() const -> bool { return flags.zero(); }
 
-  auto is_neg_set() -> bool { return status_reg[1] == 1; }
+  auto is_neg_set() const -> bool { return flags.negative(); }
 
-  auto is_overflow_set() -> bool { return status_reg[2] == 1; }
+  auto is_overflow_set() const -> bool { return flags.overflow_set(); }
 
-  auto is_carry_set() -> bool { return status_reg[3] == 1; }
+  auto is_carry_set() const -> bool { return flags.carry_set(); }
 
-  auto set_zero(uint32_t val) -> void { status_reg[0] = val == 0 ? 1 : 0; }
+  // Sets N and Z from `val`, leaving C and V alone.
+  auto set_nz(uint32_t val) -> void { flags.value(val); }
 
-  auto set_neg(uint32_t val) -> void {
-    status_reg[1] = static_cast<int32_t>(val) < 0 ? 1 : 0;
+  // Status regs are:
+  // 0: Zero
+  // 1: Negative
+  // 2: Overflow (probably)
+  // 3: Carry
+  auto status_reg() const -> std::array<std::uint8_t, 4> {
+    return flags.materialize();
   }
 
-  auto set_overflow(uint32_t val) -> void { status_reg[2] = val ? 1 : 0; }
-
-  auto set_carry(uint32_t val) -> void { status_reg[3] = val ? 1 : 0; }
-
   auto push_stack(uint32_t val) {
-    ram.write32(registers[16], val);
+    store(registers[16], val);
     registers[16] -= 4;
   }
 
   auto push_stack() {
-    ram.write32(registers[16], PC);
+    store(registers[16], PC);
     registers[16] -= 4;
   }
 
@@ -128,12 +347,8 @@ struct CPU {
 
   std::array<std::uint32_t, 17> registers{0, 0, 0, 0, 0, 0, 0, 0,       0,
                                           0, 0, 0, 0, 0, 0, 0, 0x7FFFFF};
-  // Status regs are:
-  // 0: Zero
-  // 1: Negative
-  // 2: Overflow (probably)
-  // 3: Carry
-  std::array<std::uint8_t, 4> status_reg{0, 0, 0, 0};
+  // Evaluated lazily; see status_reg() for the Z, N, V, C view.
+  Flags flags;
 
   static constexpr size_t NUM_OF_CIP_INTERRUPTS = 1;
 
@@ -141,9 +356,105 @@ struct CPU {
   // 0: VBLANK
   std::array<std::uint8_t, NUM_OF_CIP_INTERRUPTS> cip_interrupts{0};
 
+  // Instructions retired since VBLANK was last latched. Per CPU, so separate
+  // instances can run on separate threads.
+  uint32_t inst_count = 0;
+
+  // Everything restore() needs to put the machine back where it was.
+  struct Snapshot {
+    std::array<std::uint32_t, 17> registers;
+    Flags flags;
+    std::array<std::uint8_t, NUM_OF_CIP_INTERRUPTS> cip_interrupts;
+    std::uint32_t pc;
+    std::uint32_t inst_count;
+    bool halted;
+    Memory::Image memory;
+  };
+
+  // Snapshots cost a copy of every page written so far (usually just the
+  // program and its data). Restoring the snapshot taken or restored most
+  // recently only copies back the pages written since, so re-running one
+  // loaded image is a matter of microseconds.
+  auto snapshot() -> Snapshot;
+  auto restore(const Snapshot &snap) -> void;
+
   bool halted = false;
 
+  // Addresses CPU::run() stops at. Any breakpoint or watchpoint at all drops
+  // run() to the reference interpreter.
+  std::unordered_set<uint32_t> breakpoints;
+  // Conditions for some of `breakpoints`; those only stop when it holds.
+  std::unordered_map<uint32_t, Condition> conditions;
+  std::vector<Watchpoint> watchpoints;
+  WatchHit watch_hit;
+  // PC of the last BREAKPOINT stop. The next run() or run_debug() does not
+  // stop there again before executing it, so resuming makes progress.
+  std::optional<uint32_t> break_resume;
+
+  Engine engine = Engine::THREADED;
+
   Memory ram; // 32MB
+  DecodeCache icache;
+#if defined(FANTA_JIT)
+  std::unique_ptr<Jit> jit; // Created on first use of Engine::JIT
+#endif
+
 private:
+  // Marks the spans a word stored at `addr` covers, if any are VRAM. The
+  // offset is biased by one span so a word straddling either end of VRAM
+  // lands on a guard entry rather than needing a clamp.
+  constexpr auto mark_vram(uint32_t addr) -> void {
+    auto last = addr + 3 - (VRAM_BASE - VRAM_SPAN);
+    if (last - VRAM_SPAN < VRAM_BYTES + 3) [[unlikely]] {
+      vram_spans[last >> VRAM_SPAN_SHIFT] = 1;
+      vram_spans[(last - 3) >> VRAM_SPAN_SHIFT] = 1;
+    }
+  }
+
+  // mark_vram() for every byte of [addr, addr + bytes).
+  auto mark_vram_range(uint32_t addr, uint32_t bytes) -> void {
+    auto first = std::max<uint64_t>(addr, VRAM_BASE);
+    auto end =
+        std::min<uint64_t>(uint64_t{addr} + bytes, VRAM_BASE + VRAM_BYTES);
+    if (first >= end)
+      return;
+    // Same indexing as mark_vram(): span i covers [i - 1, i) past VRAM_BASE.
+    auto from = ((first - VRAM_BASE) >> VRAM_SPAN_SHIFT) + 1;
+    auto to = ((end - 1 - VRAM_BASE) >> VRAM_SPAN_SHIFT) + 2;
+    std::fill(vram_spans.begin() + from, vram_spans.begin() + to, 1);
+  }
+
+  // Executes one instruction, reporting it to `observer`. run_cycle() is
+  // step() with a NullObserver.
+  template <typename Observer> auto step(Observer &observer) -> void;
+
+  // debug_pages bits.
+  static constexpr uint8_t BREAK_PAGE = 1;
+  static constexpr uint8_t WATCH_PAGE = 2;
+
+  // Observer run_debug() wraps around the caller's to check memory accesses.
+  template <typename Observer> struct Watched;
+
+  // Rebuilds debug_pages from `breakpoints` and `watchpoints`.
+  auto sync_debug_pages() -> void;
+  // Slow path behind a WATCH_PAGE hit: records watch_hit and returns true if
+  // a watchpoint really covers the word.
+  auto watch_match(uint32_t addr, bool write, uint32_t value) -> bool;
+
+  auto run_switch(uint64_t cycles) -> uint64_t;
+  auto run_threaded(uint64_t cycles) -> uint64_t;
+  auto run_predecoded(uint64_t cycles) -> uint64_t;
+  auto run_blocks(uint64_t cycles) -> uint64_t;
+  auto run_jit(uint64_t cycles) -> uint64_t;
+  template <Engine E> auto run_threaded_impl(uint64_t cycles) -> uint64_t;
+
   std::uint32_t PC = 0;
+  // One byte per guest page, allocated by the first debug run.
+  std::vector<uint8_t> debug_pages;
+  // Starts all set: nothing has been presented yet.
+  std::array<uint8_t, (VRAM_BYTES >> VRAM_SPAN_SHIFT) + 2> vram_spans = [] {
+    std::array<uint8_t, (VRAM_BYTES >> VRAM_SPAN_SHIFT) + 2> spans;
+    spans.fill(1);
+    return spans;
+  }();
 };
@@ -0,0 +1,182 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "cpu.hpp"
+
+/**
+ * @brief Text forms of breakpoints and watchpoints, shared by the TUI's
+ *        :break/:watch and the tracers' --break/--watch.
+ *
+ * @details
+ *          - Breakpoint: `ADDR [if OPERAND OP VALUE]`, e.g. `0x40` or
+ *            `0x40 if R1 >= 5`. OPERAND is R0-R15, FP, SP or one of the flags
+ *            Z, N, V, C; OP is one of == != < <= > >=, compared signed.
+ *          - Watchpoint: `ADDR[:BYTES][/r|/w|/rw]`, e.g. `0x1000:64/rw`.
+ *            Four bytes and writes only unless stated.
+ *
+ *          Numbers are decimal, 0x hex or 0 octal, and may be negative.
+ *          Everything is case-insensitive.
+ */
+namespace DebugSpec {
+
+inline auto trim(std::string_view text) -> std::string_view {
+  while (!text.empty() && std::isspace(static_cast<unsigned char>(text[0])))
+    text.remove_prefix(1);
+  while (!text.empty() && std::isspace(static_cast<unsigned char>(text.back())))
+    text.remove_suffix(1);
+  return text;
+}
+
+inline auto upper(std::string_view text) -> std::string {
+  std::string out{trim(text)};
+  for (auto &c : out)
+    c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+  return out;
+}
+
+inline auto parse_number(std::string_view text) -> std::optional<uint32_t> {
+  auto digits = std::string{trim(text)};
+  if (digits.empty())
+    return std::nullopt;
+  try {
+    std::size_t used = 0;
+    auto value = std::stoll(digits, &used, 0);
+    if (used != digits.size())
+      return std::nullopt;
+    return static_cast<uint32_t>(value);
+  } catch (const std::exception &) {
+    return std::nullopt;
+  }
+}
+
+// `OPERAND OP VALUE`, e.g. "R3 != 0" or "C == 1".
+inline auto parse_condition(std::string_view text)
+    -> std::optional<CPU::Condition> {
+  using Cmp = CPU::Condition::Cmp;
+  auto spec = upper(text);
+  auto at = spec.find_first_of("=!<>");
+  if (at == std::string::npos)
+    return std::nullopt;
+  auto two = spec.size() > at + 1 && spec[at + 1] == '=';
+  auto op = spec.substr(at, two ? 2 : 1);
+
+  CPU::Condition condition;
+  if (op == "==")
+    condition.cmp = Cmp::EQ;
+  else if (op == "!=")
+    condition.cmp = Cmp::NE;
+  else if (op == "<")
+    condition.cmp = Cmp::LT;
+  else if (op == "<=")
+    condition.cmp = Cmp::LE;
+  else if (op == ">")
+    condition.cmp = Cmp::GT;
+  else if (op == ">=")
+    condition.cmp = Cmp::GE;
+  else
+    return std::nullopt;
+
+  auto operand = std::string{trim(std::string_view{spec}.substr(0, at))};
+  if (operand == "SP") {
+    condition.index = 16;
+  } else if (operand == "FP") {
+    condition.index = 15;
+  } else if (auto flag = std::string_view{"ZNVC"}.find(operand);
+             operand.size() == 1 && flag != std::string_view::npos) {
+    // Same order as CPU::FLAG.
+    condition.source = CPU::Condition::Source::FLAG;
+    condition.index = static_cast<uint8_t>(flag);
+  } else if (operand.size() > 1 && operand.size() < 4 && operand[0] == 'R' &&
+             std::all_of(operand.begin() + 1, operand.end(), ::isdigit) &&
+             std::stoi(operand.substr(1)) < 16) {
+    condition.index = static_cast<uint8_t>(std::stoi(operand.substr(1)));
+  } else {
+    return std::nullopt;
+  }
+
+  auto value = parse_number(std::string_view{spec}.substr(at + op.size()));
+  if (!value)
+    return std::nullopt;
+  condition.value = *value;
+  return condition;
+}
+
+// Adds the breakpoint `spec` describes to `cpu`, replacing any condition an
+// earlier one at the same address had. False if it does not parse.
+inline auto add_breakpoint(CPU &cpu, std::string_view spec) -> bool {
+  auto text = upper(spec);
+  auto cut = text.find(" IF ");
+  auto addr = parse_number(std::string_view{text}.substr(0, cut));
+  if (!addr)
+    return false;
+  if (cut == std::string::npos) {
+    cpu.conditions.erase(*addr);
+  } else {
+    auto condition = parse_condition(std::string_view{text}.substr(cut + 4));
+    if (!condition)
+      return false;
+    cpu.conditions[*addr] = *condition;
+  }
+  cpu.breakpoints.insert(*addr);
+  return true;
+}
+
+// Adds the watchpoint `spec` describes to `cpu`. False if it does not parse.
+inline auto add_watchpoint(CPU &cpu, std::string_view spec) -> bool {
+  auto text = upper(spec);
+  CPU::Watchpoint watch;
+  if (auto slash = text.find('/'); slash != std::string::npos) {
+    auto access = trim(std::string_view{text}.substr(slash + 1));
+    watch.read = access == "R" || access == "RW";
+    watch.write = access == "W" || access == "RW";
+    if (!watch.read && !watch.write)
+      return false;
+    text.resize(slash);
+  }
+  if (auto colon = text.find(':'); colon != std::string::npos) {
+    auto bytes = parse_number(std::string_view{text}.substr(colon + 1));
+    if (!bytes || *bytes == 0)
+      return false;
+    watch.bytes = *bytes;
+    text.resize(colon);
+  }
+  auto addr = parse_number(text);
+  if (!addr)
+    return false;
+  watch.addr = *addr;
+  cpu.watchpoints.push_back(watch);
+  return true;
+}
+
+// Removes every breakpoint and watchpoint.
+inline auto clear(CPU &cpu) -> void {
+  cpu.breakpoints.clear();
+  cpu.conditions.clear();
+  cpu.watchpoints.clear();
+}
+
+// What stopped a run, for BREAKPOINT and WATCHPOINT; empty otherwise.
+inline auto describe_stop(const CPU &cpu, CPU::StopReason reason)
+    -> std::string {
+  char text[96];
+  if (reason == CPU::StopReason::BREAKPOINT) {
+    std::snprintf(text, sizeof(text), "Breakpoint at 0x%04X", cpu.get_pc());
+  } else if (reason == CPU::StopReason::WATCHPOINT) {
+    auto &hit = cpu.watch_hit;
+    std::snprintf(text, sizeof(text),
+                  "Watchpoint: 0x%04X %s [0x%06X] = 0x%08X", hit.pc,
+                  hit.write ? "wrote" : "read", hit.addr, hit.value);
+  } else {
+    return {};
+  }
+  return text;
+}
+
+} // namespace DebugSpec
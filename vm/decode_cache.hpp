@@ -0,0 +1,160 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "cpu_info.hpp"
+
+/**
+ * @brief A code word with every operand field extracted ahead of time.
+ *
+ * @details `op` doubles as the handler reference: it indexes the engine's
+ *          computed-goto table, so a record stays 16 bytes and the handlers
+ *          are still inlined into the dispatch loop. Slots start out as
+ *          UNDECODED, which routes to a handler that decodes the word in
+ *          place on first execution; the hot loop never has to ask whether a
+ *          slot is valid.
+ *
+ * @note `imm` keeps the ISA's zero-extended 16-bit immediate/offset semantics;
+ *       only the 26-bit branch payload is pre-sign-extended into `offset`.
+ */
+struct DecodedInst {
+  static constexpr uint8_t UNDECODED = 64; ///< One past the last 6-bit opcode
+
+  uint8_t op = UNDECODED; ///< Opcode, or UNDECODED until first execution
+  uint8_t dest = 0;       ///< Bits 21-25
+  uint8_t s1 = 0;         ///< Bits 16-20
+  uint8_t s2 = 0;         ///< Bits 11-15
+  uint16_t imm = 0;       ///< Zero-extended 16-bit immediate
+  uint16_t block_len = 0; ///< Basic block starting here, 0 until formed
+  uint32_t payload = 0;   ///< Unsigned 26-bit payload (JMP, CIP, PUSH/POP)
+  int32_t offset = 0;     ///< Sign-extended 26-bit branch offset
+};
+static_assert(sizeof(DecodedInst) == 16, "four records per cache line");
+
+/**
+ * @brief Whether an opcode ends a basic block.
+ *
+ * @details These are exactly the instructions that can move PC somewhere
+ *          other than the next word (MEMSET/MEMCPY repeat themselves until
+ *          done), stop the CPU, or consume the VBLANK latch (CIP), which is
+ *          what lets the BLOCK engine charge a whole block's frame budget up
+ *          front.
+ */
+constexpr auto ends_block(uint8_t op) -> bool {
+  using namespace Fanta::Info::Instructions;
+  switch (op) {
+  case HALT:
+  case JUMP:
+  case BEQ:
+  case BNE:
+  case BEC:
+  case BMI:
+  case BPL:
+  case BNC:
+  case JREL:
+  case CALL:
+  case RET:
+  case CIP:
+  case MEMSET:
+  case MEMCPY:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/**
+ * @brief Per-CPU cache of decoded instructions, allocated one 4KB guest page
+ *        at a time.
+ *
+ * @details Only pages that have actually been executed get a decoded copy, so
+ *          data pages and VRAM cost nothing. Writes through CPU::store() call
+ *          invalidate(), which resets the touched slots back to UNDECODED
+ *          so live-patched code (TUI editor, self-modifying programs) is
+ *          re-decoded on its next execution. Overwriting a word that had
+ *          been decoded also forgets every basic block formed on its page,
+ *          since any of them may have run through it.
+ *
+ * @warning Writes that go straight to CPU::ram bypass invalidation.
+ */
+struct DecodeCache {
+  static constexpr uint32_t PAGE_SHIFT = 12;
+  static constexpr uint32_t PAGE_SIZE = 1u << PAGE_SHIFT;
+  static constexpr uint32_t WORDS_PER_PAGE = PAGE_SIZE / 4;
+  using Page = std::array<DecodedInst, WORDS_PER_PAGE>;
+
+  DecodeCache(std::size_t mem_size)
+      : pages(mem_size >> PAGE_SHIFT), present(mem_size >> PAGE_SHIFT) {}
+
+  auto lookup(uint32_t addr) -> DecodedInst & {
+    auto &page = pages[addr >> PAGE_SHIFT];
+    if (!page) [[unlikely]] {
+      page = std::make_unique<Page>();
+      present[addr >> PAGE_SHIFT] = 1;
+    }
+    return (*page)[(addr >> 2) & (WORDS_PER_PAGE - 1)];
+  }
+
+  // Bumped every time a decoded word is overwritten, so translations built
+  // from the cache can tell they have gone stale.
+  auto generation() const -> uint64_t { return code_writes; }
+
+  // One byte per guest page, non-zero once the page has ever been decoded.
+  // Stores to any other page cannot touch code.
+  auto code_pages() const -> const uint8_t * { return present.data(); }
+
+  // A 32-bit store can straddle two instruction words.
+  auto invalidate(uint32_t addr) -> void {
+    invalidate_word(addr & ~3u);
+    if (addr & 3) [[unlikely]]
+      invalidate_word((addr & ~3u) + 4);
+  }
+
+  // invalidate() for every word overlapping [addr, addr + bytes). Pages that
+  // were never decoded are skipped whole.
+  auto invalidate_range(uint32_t addr, uint32_t bytes) -> void {
+    auto end = uint64_t{addr} + bytes;
+    for (uint64_t word = addr & ~3u; word < end;) {
+      auto idx = word >> PAGE_SHIFT;
+      auto page_end = std::min((idx + 1) << PAGE_SHIFT, end);
+      if (idx >= pages.size())
+        return;
+      if (pages[idx]) {
+        for (; word < page_end; word += 4)
+          invalidate_word(static_cast<uint32_t>(word));
+      }
+      word = (idx + 1) << PAGE_SHIFT;
+    }
+  }
+
+  // Forgets everything decoded from one page, e.g. after its memory was
+  // replaced wholesale.
+  auto invalidate_page(uint32_t idx) -> void {
+    if (idx >= pages.size() || !pages[idx])
+      return;
+    pages[idx]->fill(DecodedInst{});
+    code_writes++;
+  }
+
+private:
+  auto invalidate_word(uint32_t addr) -> void {
+    auto idx = addr >> PAGE_SHIFT;
+    if (idx >= pages.size() || !pages[idx])
+      return;
+    auto &page = *pages[idx];
+    auto &slot = page[(addr >> 2) & (WORDS_PER_PAGE - 1)];
+    if (slot.op == DecodedInst::UNDECODED)
+      return;
+    slot = DecodedInst{};
+    for (auto &inst : page)
+      inst.block_len = 0;
+    code_writes++;
+  }
+
+  std::vector<std::unique_ptr<Page>> pages;
+  std::vector<uint8_t> present;
+  uint64_t code_writes = 0;
+};
@@ -0,0 +1,113 @@
+#pragma once
+#include <array>
+#include <cstdint>
+
+/**
+ * @brief Condition flags, worked out on demand from the last instruction that
+ *        set them.
+ *
+ * @details Every flag-setting instruction derives N and Z from a single
+ *          32-bit value (the result, the moved/loaded/stored word, or a-b for
+ *          CMP), so that word is all that gets recorded for them. ADD, SUB and
+ *          CMP record their operands instead of computing C and V; a branch
+ *          only evaluates the one flag it tests. The shifts' carry, and
+ *          everything the JIT writes, goes into the explicit `carry`/`overflow`
+ *          bytes.
+ *
+ *          CMP and the shifts leave V alone, so before replacing a pending ADD/SUB
+ *          they fold its overflow into `overflow` first.
+ *
+ * @note Use CPU::status_reg() for the materialized Z, N, V, C bytes.
+ */
+struct Flags {
+  enum Op : uint8_t {
+    EXPLICIT, ///< C and V are `carry` and `overflow`
+    ADD,      ///< C and V come from lhs + rhs
+    SUB,      ///< C and V come from lhs - rhs
+    CMP,      ///< C is signed lhs > rhs, V is `overflow`
+  };
+
+  uint32_t result = 1;  ///< N and Z source; reset state is Z = N = 0
+  uint32_t lhs = 0;     ///< First operand of `op`
+  uint32_t rhs = 0;     ///< Second operand of `op`
+  Op op = EXPLICIT;     ///< What C and V are derived from
+  uint8_t carry = 0;    ///< C while `op` is EXPLICIT
+  uint8_t overflow = 0; ///< V while `op` is EXPLICIT or CMP
+
+  auto arith(Op o, uint32_t a, uint32_t b, uint32_t res) -> void {
+    result = res;
+    lhs = a;
+    rhs = b;
+    op = o;
+  }
+
+  auto value(uint32_t v) -> void { result = v; }
+
+  auto compare(uint32_t a, uint32_t b) -> void {
+    settle_overflow();
+    result = a - b;
+    lhs = a;
+    rhs = b;
+    op = CMP;
+  }
+
+  auto shift(uint32_t res, bool c) -> void {
+    settle_overflow();
+    result = res;
+    carry = c;
+    op = EXPLICIT;
+  }
+
+  auto zero() const -> bool { return result == 0; }
+
+  auto negative() const -> bool { return static_cast<int32_t>(result) < 0; }
+
+  auto carry_set() const -> bool {
+    switch (op) {
+    case ADD:
+      return lhs + rhs < lhs;
+    case SUB:
+      return lhs >= rhs;
+    case CMP:
+      return static_cast<int32_t>(lhs) > static_cast<int32_t>(rhs);
+    default:
+      return carry;
+    }
+  }
+
+  auto overflow_set() const -> bool {
+    switch (op) {
+    case ADD: {
+      auto res = lhs + rhs;
+      return ((lhs ^ res) & (rhs ^ res)) >> 31;
+    }
+    case SUB: {
+      auto res = lhs - rhs;
+      return ((lhs ^ rhs) & (lhs ^ res)) >> 31;
+    }
+    default:
+      return overflow;
+    }
+  }
+
+  // Turns any pending C/V into the explicit bytes, which is the form the JIT
+  // reads and writes.
+  auto settle() -> void {
+    carry = carry_set();
+    overflow = overflow_set();
+    op = EXPLICIT;
+  }
+
+  // Z, N, V, C, one byte each.
+  auto materialize() const -> std::array<uint8_t, 4> {
+    return {static_cast<uint8_t>(zero()), static_cast<uint8_t>(negative()),
+            static_cast<uint8_t>(overflow_set()),
+            static_cast<uint8_t>(carry_set())};
+  }
+
+private:
+  auto settle_overflow() -> void {
+    if (op == ADD || op == SUB)
+      overflow = overflow_set();
+  }
+};
@@ -0,0 +1,99 @@
+#include "frame_scheduler.hpp"
+#include <algorithm>
+#include <thread>
+
+FrameScheduler::FrameScheduler(CPU &cpu) : FrameScheduler(cpu, Config{}) {}
+
+FrameScheduler::FrameScheduler(CPU &cpu, Config config)
+    : cpu(cpu), cfg(config),
+      period(std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(1.0 / config.fps))) {
+  frame_ms.reserve(FRAME_WINDOW);
+  next_due = stats_start = Clock::now();
+}
+
+auto FrameScheduler::run_frame() -> uint64_t {
+  auto start = Clock::now();
+  // run() never crosses a VBLANK, so this budget always reaches the end of
+  // the current frame unless the program halts first.
+  uint64_t retired = 0;
+  while (!cpu.halted) {
+    auto result = cpu.run(CPU::CYCLES_PER_FRAME);
+    retired += result.cycles;
+    if (result.reason == CPU::StopReason::INTERRUPT)
+      break;
+  }
+  if (!retired)
+    return 0;
+
+  float ms = std::chrono::duration<float, std::milli>(Clock::now() - start)
+                 .count();
+  if (frame_ms.size() < FRAME_WINDOW)
+    frame_ms.push_back(ms);
+  else
+    frame_ms[frame_pos] = ms;
+  frame_pos = (frame_pos + 1) % FRAME_WINDOW;
+  frames++;
+  cycles += retired;
+  return retired;
+}
+
+auto FrameScheduler::advance() -> Frame {
+  Frame frame;
+  for (;;) {
+    auto retired = run_frame();
+    frame.cycles += retired;
+    frame.frames += retired != 0;
+    frame.halted = cpu.halted;
+    if (cfg.pacing == Pacing::UNTHROTTLED)
+      return frame;
+
+    auto due = next_due;
+    next_due += period;
+    auto now = Clock::now();
+    // On time, or at most a frame late: present this one. A halted CPU
+    // has nothing to catch up on, it just keeps the display ticking.
+    if (now < due + period || frame.halted) {
+      std::this_thread::sleep_until(due);
+      return frame;
+    }
+    if (frame.skipped == cfg.max_skip) {
+      next_due = now + period;
+      return frame;
+    }
+    frame.skipped++;
+    skipped++;
+  }
+}
+
+auto FrameScheduler::stats() const -> Stats {
+  Stats s;
+  s.frames = frames;
+  s.skipped = skipped;
+  s.cycles = cycles;
+  s.seconds = std::chrono::duration<double>(Clock::now() - stats_start).count();
+  if (s.seconds > 0) {
+    s.guest_mhz = cycles / s.seconds / 1e6;
+    s.fps = frames / s.seconds;
+  }
+  if (frame_ms.empty())
+    return s;
+
+  auto sorted = frame_ms;
+  std::sort(sorted.begin(), sorted.end());
+  auto percentile = [&](double p) {
+    return sorted[static_cast<std::size_t>(p * (sorted.size() - 1))];
+  };
+  s.p50_ms = percentile(0.50);
+  s.p95_ms = percentile(0.95);
+  s.p99_ms = percentile(0.99);
+  s.max_ms = sorted.back();
+  return s;
+}
+
+auto FrameScheduler::reset_stats() -> void {
+  frames = skipped = cycles = 0;
+  frame_ms.clear();
+  frame_pos = 0;
+  stats_start = Clock::now();
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "cpu.hpp"
+
+/**
+ * @brief Runs a CPU one guest frame at a time and paces those frames
+ *        against the wall clock.
+ *
+ * @details A guest frame is the CPU::CYCLES_PER_FRAME instructions between
+ *          two VBLANK interrupts, so the CPU's VBLANK latch and the
+ *          presentation rate can never disagree about where a frame ends.
+ *
+ *          REALTIME makes frames due every 1/fps seconds. advance() sleeps
+ *          until the frame it ran is due, so front-ends must not also wait
+ *          for vsync. If the host has fallen more than a frame behind, the
+ *          frame is counted as skipped and the next one runs straight away,
+ *          up to `max_skip` in a row. After that the schedule restarts from
+ *          now instead of trying to catch up on the rest.
+ *
+ *          UNTHROTTLED never sleeps or skips. It is meant for headless runs
+ *          that want maximum speed.
+ */
+class FrameScheduler {
+public:
+  enum class Pacing : uint8_t { REALTIME, UNTHROTTLED };
+
+  struct Config {
+    Pacing pacing = Pacing::REALTIME;
+    double fps = 60.0;     ///< Guest frames due per wall-clock second
+    uint32_t max_skip = 4; ///< Frames run unpresented before resyncing
+  };
+
+  // What one advance() did. The front-end presents once per call.
+  struct Frame {
+    uint32_t frames = 0;  ///< Guest frames run, skipped ones included
+    uint32_t skipped = 0; ///< Frames that ran but were not presented
+    uint64_t cycles = 0;  ///< Instructions retired
+    bool halted = false;  ///< The CPU is halted; frames keep being paced
+  };
+
+  struct Stats {
+    uint64_t frames = 0;
+    uint64_t skipped = 0;
+    uint64_t cycles = 0;
+    double seconds = 0;   ///< Wall time since construction or reset_stats()
+    double guest_mhz = 0; ///< Instructions retired per wall-clock µs
+    double fps = 0;       ///< Guest frames per wall-clock second
+    // Host time spent emulating one guest frame, over the last
+    // FRAME_WINDOW frames.
+    double p50_ms = 0;
+    double p95_ms = 0;
+    double p99_ms = 0;
+    double max_ms = 0;
+  };
+
+  static constexpr std::size_t FRAME_WINDOW = 1024;
+
+  // REALTIME at 60 fps.
+  explicit FrameScheduler(CPU &cpu);
+  FrameScheduler(CPU &cpu, Config config);
+
+  // Runs the next guest frame (plus any skipped ones) and, when REALTIME,
+  // returns once it is due.
+  auto advance() -> Frame;
+
+  auto stats() const -> Stats;
+  auto reset_stats() -> void;
+
+  // Guest clock the schedule aims for, in MHz.
+  auto nominal_mhz() const -> double {
+    return CPU::CYCLES_PER_FRAME * cfg.fps / 1e6;
+  }
+
+  auto config() const -> const Config & { return cfg; }
+
+  // Switches pacing mid-run. The realtime schedule restarts from now.
+  auto set_pacing(Pacing pacing) -> void {
+    cfg.pacing = pacing;
+    next_due = Clock::now();
+  }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  // Runs up to the next VBLANK (or HALT). Returns instructions retired.
+  auto run_frame() -> uint64_t;
+
+  CPU &cpu;
+  Config cfg;
+  Clock::duration period;
+  Clock::time_point next_due;
+  Clock::time_point stats_start;
+
+  uint64_t frames = 0;
+  uint64_t skipped = 0;
+  uint64_t cycles = 0;
+  std::vector<float> frame_ms; ///< Ring of the last FRAME_WINDOW frame times
+  std::size_t frame_pos = 0;
+};
@@ -0,0 +1,195 @@
+#include "history.hpp"
+#include "interpreter.hpp"
+#include <algorithm>
+
+template auto CPU::run_observed(uint64_t, History::Recorder &) -> uint64_t;
+
+auto History::clear() -> void {
+  now = 0;
+  ring.clear();
+  forget_undo();
+}
+
+auto History::forget_undo() -> void {
+  log.clear();
+  recorder.regs.clear();
+  recorder.stores.clear();
+}
+
+// The first checkpoint is taken lazily, so a History can be set up before
+// the program is loaded.
+auto History::start(CPU &cpu) -> void {
+  if (ring.empty())
+    checkpoint(cpu);
+}
+
+auto History::checkpoint(CPU &cpu) -> void {
+  ring.push_back({now, cpu.snapshot()});
+  if (ring.size() > ring_size)
+    ring.pop_front();
+}
+
+auto History::run(CPU &cpu, uint64_t budget) -> CPU::RunResult {
+  start(cpu);
+  // The engines do not log writes, so the undo log would no longer end at
+  // the current instruction.
+  forget_undo();
+  uint64_t retired = 0;
+  while (retired < budget) {
+    auto due = ring.back().cycle + interval - now;
+    auto result = cpu.run(std::min(budget - retired, due));
+    retired += result.cycles;
+    now += result.cycles;
+    if (now - ring.back().cycle >= interval)
+      checkpoint(cpu);
+    if (result.reason != CPU::StopReason::BUDGET)
+      return {result.reason, retired};
+  }
+  return {CPU::StopReason::BUDGET, retired};
+}
+
+auto History::step(CPU &cpu) -> void {
+  if (cpu.halted)
+    return;
+  start(cpu);
+  if (log.size() >= undo_steps)
+    trim();
+  log.push_back({cpu.get_pc(), cpu.inst_count, cpu.flags, cpu.cip_interrupts,
+                 cpu.halted, recorder.regs.size(), recorder.stores.size()});
+  cpu.run_observed(1, recorder);
+  now++;
+  if (now - ring.back().cycle >= interval)
+    checkpoint(cpu);
+}
+
+auto History::trim() -> void {
+  auto keep = undo_steps / 2;
+  if (keep == 0) {
+    forget_undo();
+    return;
+  }
+  auto drop = log.size() - keep;
+  auto regs = log[drop].first_reg;
+  auto stores = log[drop].first_store;
+  recorder.regs.erase(recorder.regs.begin(), recorder.regs.begin() + regs);
+  recorder.stores.erase(recorder.stores.begin(),
+                        recorder.stores.begin() + stores);
+  log.erase(log.begin(), log.begin() + drop);
+  for (auto &entry : log) {
+    entry.first_reg -= regs;
+    entry.first_store -= stores;
+  }
+}
+
+auto History::undo(CPU &cpu) -> void {
+  auto &entry = log.back();
+  auto &stores = recorder.stores;
+  auto &regs = recorder.regs;
+  for (auto i = stores.size(); i-- > entry.first_store;)
+    cpu.store(stores[i].addr, stores[i].old_value);
+  for (auto i = regs.size(); i-- > entry.first_reg;)
+    cpu.registers[regs[i].reg] = regs[i].old_value;
+  stores.resize(entry.first_store);
+  regs.resize(entry.first_reg);
+  cpu.set_pc(entry.pc);
+  cpu.inst_count = entry.inst_count;
+  cpu.flags = entry.flags;
+  cpu.cip_interrupts = entry.cip_interrupts;
+  cpu.halted = entry.halted;
+  log.pop_back();
+  now--;
+}
+
+auto History::restore(CPU &cpu, uint64_t target) -> uint64_t {
+  // Callers keep target >= oldest(), so there is always one at or before it.
+  auto it = std::upper_bound(
+      ring.begin(), ring.end(), target,
+      [](uint64_t t, const Checkpoint &c) { return t < c.cycle; });
+  --it;
+  cpu.restore(it->state);
+  now = it->cycle;
+  // Later checkpoints get taken again on the way forward.
+  ring.erase(it + 1, ring.end());
+  forget_undo();
+  return now;
+}
+
+auto History::forward(CPU &cpu, uint64_t target) -> void {
+  auto breakpoints = std::exchange(cpu.breakpoints, {});
+  auto watchpoints = std::exchange(cpu.watchpoints, {});
+  while (now < target && !cpu.halted)
+    run(cpu, target - now);
+  cpu.breakpoints = std::move(breakpoints);
+  cpu.watchpoints = std::move(watchpoints);
+}
+
+auto History::seek(CPU &cpu, uint64_t target) -> void {
+  start(cpu);
+  target = std::max(target, oldest());
+  if (target >= now) {
+    forward(cpu, target);
+    return;
+  }
+  if (now - target <= log.size()) {
+    while (now > target)
+      undo(cpu);
+    while (ring.back().cycle > now)
+      ring.pop_back();
+    return;
+  }
+  auto from = restore(cpu, target);
+  auto window = std::min({REPLAY_WINDOW, uint64_t{undo_steps}, target - from});
+  forward(cpu, target - window);
+  while (now < target && !cpu.halted)
+    step(cpu);
+}
+
+auto History::reverse_continue(CPU &cpu) -> bool {
+  start(cpu);
+  if (cpu.breakpoints.empty() && cpu.watchpoints.empty()) {
+    seek(cpu, oldest());
+    return false;
+  }
+  // Replay one checkpoint interval at a time, newest first, and go to the
+  // last breakpoint or watchpoint hit in the first interval that has one.
+  // A watchpoint hit is the state right after the access.
+  auto end = now;
+  while (end > oldest()) {
+    auto from = restore(cpu, end - 1);
+    auto hit = cpu.at_breakpoint() ? std::optional<uint64_t>{now}
+                                   : std::nullopt;
+    auto on_breakpoint = hit.has_value();
+    while (now < end) {
+      auto result = run(cpu, end - now);
+      if (result.reason == CPU::StopReason::HALT)
+        break;
+      if (now < end && (result.reason == CPU::StopReason::WATCHPOINT ||
+                        cpu.at_breakpoint())) {
+        hit = now;
+        on_breakpoint = result.reason != CPU::StopReason::WATCHPOINT;
+      }
+    }
+    if (hit) {
+      seek(cpu, *hit);
+      // Like a forward stop there: continuing executes the breakpoint.
+      cpu.break_resume = on_breakpoint ? std::optional{cpu.get_pc()}
+                                       : std::nullopt;
+      return true;
+    }
+    end = from;
+  }
+  seek(cpu, oldest());
+  return false;
+}
+
+auto History::last_regs() const -> std::span<const RegWrite> {
+  if (log.empty())
+    return {};
+  return std::span{recorder.regs}.subspan(log.back().first_reg);
+}
+
+auto History::last_stores() const -> std::span<const StoreLog::Store> {
+  if (log.empty())
+    return {};
+  return std::span{recorder.stores}.subspan(log.back().first_store);
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "cpu.hpp"
+#include "observer.hpp"
+
+/**
+ * @brief Execution history for stepping a CPU backwards.
+ *
+ * @details Two layers, both bounded:
+ *
+ *          - Checkpoints: a full CPU::snapshot() every `interval`
+ *            instructions, kept in a ring of `ring_size`. Each costs a copy
+ *            of the pages written so far, so the ring size bounds memory.
+ *          - Undo log: for the last `undo_steps` single-stepped instructions,
+ *            the PC, flags and interrupt state before them plus the old value
+ *            of every register and word they wrote.
+ *
+ *          Going back one instruction pops the undo log. Going back further
+ *          restores the nearest checkpoint at or before the target, runs the
+ *          selected engine up to a short window before it, then single-steps
+ *          the window so the undo log covers the next backward steps. Either
+ *          way no more than `interval` instructions are replayed, however
+ *          long the program has been running.
+ *
+ *          Everything that moves the CPU forward has to go through run() or
+ *          step() so the history stays in sync. Anything else that changes
+ *          the machine (reloading, patching memory) must call clear().
+ */
+class History {
+public:
+  // A register write, with the value it replaced.
+  struct RegWrite {
+    uint32_t reg;
+    uint32_t old_value;
+  };
+
+  // Records what single-stepped instructions overwrite.
+  struct Recorder : StoreLog {
+    std::vector<RegWrite> regs;
+
+    auto write_reg(CPU &cpu, uint32_t r, uint32_t) -> void {
+      regs.push_back({r, cpu.registers[r]});
+    }
+  };
+
+  explicit History(uint64_t interval = 1 << 20, std::size_t ring_size = 64,
+                   std::size_t undo_steps = 1 << 16)
+      : interval(interval ? interval : 1), ring_size(ring_size ? ring_size : 1),
+        undo_steps(undo_steps ? undo_steps : 1) {}
+
+  // Forgets everything; the CPU's current state becomes cycle 0.
+  auto clear() -> void;
+
+  // CPU::run() that keeps the checkpoints up to date. Same stop reasons.
+  auto run(CPU &cpu, uint64_t budget) -> CPU::RunResult;
+
+  // Executes one instruction through the observed interpreter and logs how
+  // to undo it. Does nothing once the CPU has halted.
+  auto step(CPU &cpu) -> void;
+
+  // Moves to the state before instruction `target` ran, clamped to the
+  // oldest state still reachable. Forward seeks run, backward ones replay.
+  auto seek(CPU &cpu, uint64_t target) -> void;
+
+  // Steps back `n` instructions (fewer if history runs out).
+  auto step_back(CPU &cpu, uint64_t n = 1) -> void {
+    seek(cpu, now - std::min(n, now - oldest()));
+  }
+
+  // Goes back to the latest earlier point where the CPU stopped at one of
+  // `cpu.breakpoints` or right after it touched one of `cpu.watchpoints`, or
+  // to the oldest reachable state if there is none. Returns whether one was
+  // hit.
+  auto reverse_continue(CPU &cpu) -> bool;
+
+  // Instructions executed since clear().
+  auto cycle() const -> uint64_t { return now; }
+
+  // Earliest cycle seek() can reach.
+  auto oldest() const -> uint64_t {
+    return ring.empty() ? now : ring.front().cycle;
+  }
+
+  auto checkpoints() const -> std::size_t { return ring.size(); }
+
+  // Registers and words written by the instruction step() just ran.
+  auto last_regs() const -> std::span<const RegWrite>;
+  auto last_stores() const -> std::span<const StoreLog::Store>;
+
+private:
+  struct Checkpoint {
+    uint64_t cycle;
+    CPU::Snapshot state;
+  };
+
+  // CPU state an instruction can change besides registers and memory.
+  struct Undo {
+    uint32_t pc;
+    uint32_t inst_count;
+    Flags flags;
+    std::array<uint8_t, CPU::NUM_OF_CIP_INTERRUPTS> cip_interrupts;
+    bool halted;
+    std::size_t first_reg;   ///< Into recorder.regs
+    std::size_t first_store; ///< Into recorder.stores
+  };
+
+  // Single-stepped instructions kept after a checkpoint restore, so that the
+  // steps back right after it come out of the undo log.
+  static constexpr uint64_t REPLAY_WINDOW = 16384;
+
+  auto start(CPU &cpu) -> void;
+  auto checkpoint(CPU &cpu) -> void;
+  auto undo(CPU &cpu) -> void;
+  // Drops the older half of the undo log.
+  auto trim() -> void;
+  auto forget_undo() -> void;
+  // Restores the newest checkpoint at or before `target`; returns its cycle.
+  auto restore(CPU &cpu, uint64_t target) -> uint64_t;
+  // Runs until `target` ignoring breakpoints, watchpoints and frame stops.
+  auto forward(CPU &cpu, uint64_t target) -> void;
+
+  uint64_t interval;
+  std::size_t ring_size;
+  std::size_t undo_steps;
+  uint64_t now = 0;
+  std::deque<Checkpoint> ring;
+  std::vector<Undo> log; ///< Ends at `now`, one entry per instruction
+  Recorder recorder;
+};
@@ -0,0 +1,168 @@
+#pragma once
+#include <cstdint>
+#include <optional>
+#include <utility>
+
+#include "cpu.hpp"
+#include "instructions_impl.hpp"
+#include "observer.hpp"
+
+// The reference interpreter, as templates over an execution observer (see
+// observer.hpp). Tools that want to watch execution include this and
+// instantiate CPU::run_observed() with their own observer; vm/cpu.cpp
+// builds every engine from the same table and handlers.
+
+// Single source of truth for opcode -> handler. Every dispatch engine expands
+// this list, so a new instruction only has to be added here once.
+#define FANTA_OPCODE_TABLE(X)                                                  \
+  X(0x0, Halt)                                                                 \
+  X(0x1, AddReg)                                                               \
+  X(0x2, AddImm)                                                               \
+  X(0x3, MovReg)                                                               \
+  X(0x4, MovImm)                                                               \
+  X(0x5, SubReg)                                                               \
+  X(0x6, SubImm)                                                               \
+  X(0x7, Jmp)                                                                  \
+  X(0x8, StoreReg)                                                             \
+  X(0x9, LoadReg)                                                              \
+  X(0xa, Beq)                                                                  \
+  X(0xb, Bne)                                                                  \
+  X(0xc, LshReg)                                                               \
+  X(0xd, LshImm)                                                               \
+  X(0xe, CmpReg)                                                               \
+  X(0xf, CmpImm)                                                               \
+  X(0x10, Bec)                                                                 \
+  X(0x11, Bmi)                                                                 \
+  X(0x12, Bpl)                                                                 \
+  X(0x13, Jrel)                                                                \
+  X(0x14, Nop)                                                                 \
+  X(0x15, Call)                                                                \
+  X(0x16, Ret)                                                                 \
+  X(0x17, AndReg)                                                              \
+  X(0x18, AndImm)                                                              \
+  X(0x19, OrReg)                                                               \
+  X(0x1A, OrImm)                                                               \
+  X(0x1B, XorReg)                                                              \
+  X(0x1C, XorImm)                                                              \
+  X(0x1D, Push)                                                                \
+  X(0x1E, Pop)                                                                 \
+  X(0x1F, Cip)                                                                 \
+  X(0x20, Bnc)                                                                 \
+  X(0x21, MulReg)                                                              \
+  X(0x22, MulImm)                                                              \
+  X(0x23, DivReg)                                                              \
+  X(0x24, DivImm)                                                              \
+  X(0x25, DivuReg)                                                             \
+  X(0x26, DivuImm)                                                             \
+  X(0x27, ModReg)                                                              \
+  X(0x28, ModImm)                                                              \
+  X(0x29, ModuReg)                                                             \
+  X(0x2A, ModuImm)                                                             \
+  X(0x2B, RshReg)                                                              \
+  X(0x2C, RshImm)                                                              \
+  X(0x2D, AsrReg)                                                              \
+  X(0x2E, AsrImm)                                                              \
+  X(0x2F, Memset)                                                              \
+  X(0x30, Memcpy)                                                              \
+  X(0x31, Paddusb)                                                             \
+  X(0x32, Psubusb)                                                             \
+  X(0x33, Pavgb)                                                               \
+  X(0x34, Pblend)                                                              \
+  X(0x35, LuiImm)
+
+inline auto decodeOpt(uint32_t inst) -> uint32_t {
+  return (inst >> 26) & 0x3F;
+}
+
+// The VBLANK interrupt is latched on the instruction boundary where the frame
+// budget runs out, before that instruction executes.
+inline auto latch_vblank(CPU &cpu) -> void {
+  if (cpu.inst_count >= CPU::CYCLES_PER_FRAME) {
+    cpu.cip_interrupts[0] = 1;
+    cpu.inst_count = 0;
+  }
+}
+
+#define EXEC_INST(OpCode, Name)                                                \
+  case OpCode: {                                                               \
+    Name::exec(*this, instr, observer);                                        \
+    break;                                                                     \
+  }
+
+template <typename Observer> auto CPU::step(Observer &observer) -> void {
+  auto pc = PC;
+  auto instr = fetch();
+  auto byte = decodeOpt(instr);
+  latch_vblank(*this);
+  switch (byte) { FANTA_OPCODE_TABLE(EXEC_INST) }
+  inst_count++;
+  observer.retire(*this, pc, byte);
+}
+
+#undef EXEC_INST
+
+template <typename Observer>
+auto CPU::run_observed(uint64_t cycles, Observer &observer) -> uint64_t {
+  uint64_t retired = 0;
+  while (!halted && retired < cycles) {
+    step(observer);
+    retired++;
+  }
+  return retired;
+}
+
+template <typename Observer> struct CPU::Watched {
+  Observer &inner;
+  bool hit = false;
+
+  auto write_reg(CPU &cpu, uint32_t r, uint32_t value) -> void {
+    inner.write_reg(cpu, r, value);
+  }
+  auto write_flags(CPU &cpu, uint8_t mask) -> void {
+    inner.write_flags(cpu, mask);
+  }
+  auto write_mem(CPU &cpu, uint32_t addr, uint32_t value) -> void {
+    if (cpu.debug_pages[addr >> Memory::PAGE_SHIFT] & WATCH_PAGE) [[unlikely]]
+      hit |= cpu.watch_match(addr, true, value);
+    inner.write_mem(cpu, addr, value);
+  }
+  auto read_mem(CPU &cpu, uint32_t addr) -> void {
+    if (cpu.debug_pages[addr >> Memory::PAGE_SHIFT] & WATCH_PAGE) [[unlikely]]
+      hit |= cpu.watch_match(addr, false, cpu.load(addr));
+    inner.read_mem(cpu, addr);
+  }
+  auto write_pc(CPU &cpu, uint32_t target) -> void {
+    inner.write_pc(cpu, target);
+  }
+  auto retire(CPU &cpu, uint32_t pc, uint32_t op) -> void {
+    if (hit)
+      cpu.watch_hit.pc = pc;
+    inner.retire(cpu, pc, op);
+  }
+};
+
+template <typename Observer>
+auto CPU::run_debug(uint64_t cycles, Observer &observer) -> RunResult {
+  if (halted)
+    return {StopReason::HALT, 0};
+  sync_debug_pages();
+  Watched<Observer> watched{observer};
+  // Resuming from a breakpoint steps over it, otherwise it could not make
+  // progress.
+  auto resume = std::exchange(break_resume, std::nullopt);
+  uint64_t retired = 0;
+  while (retired < cycles) {
+    if (debug_pages[PC >> Memory::PAGE_SHIFT] & BREAK_PAGE &&
+        !(retired == 0 && resume == PC) && at_breakpoint()) {
+      break_resume = PC;
+      return {StopReason::BREAKPOINT, retired};
+    }
+    step(watched);
+    retired++;
+    if (watched.hit)
+      return {StopReason::WATCHPOINT, retired};
+    if (halted)
+      return {StopReason::HALT, retired};
+  }
+  return {StopReason::BUDGET, retired};
+}
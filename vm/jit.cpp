@@ -0,0 +1,887 @@
+#include "jit.hpp"
+#include "cpu.hpp"
+#include <bit>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <utility>
+
+namespace {
+
+enum HostReg : uint8_t {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RBP = 5,
+  RSI = 6,
+  RDI = 7,
+  R12 = 12,
+  R13 = 13,
+  R14 = 14,
+  R15 = 15,
+};
+
+static_assert(Memory::PAGE_SHIFT == DecodeCache::PAGE_SHIFT,
+              "one page index serves both the code and dirty page maps");
+
+// Pinned for the whole time native code runs; see emit_trampoline().
+constexpr HostReg CPU_PTR = R14;
+constexpr HostReg STATE = R15;
+constexpr HostReg MEM = R13;
+constexpr HostReg PAGES = R12;
+constexpr HostReg LOOKUP = RBX;
+constexpr HostReg DIRTY = RBP;
+
+enum Cond : uint8_t {
+  O = 0,
+  B = 2,
+  AE = 3,
+  E = 4,
+  NE = 5,
+  A = 7,
+  S = 8,
+  NS = 9,
+  G = 0xF
+};
+
+// Group-1 ALU opcodes, as the /digit of 0x81 and the row of the r32, r/m32
+// forms.
+enum Alu : uint8_t { ADD = 0, OR = 1, AND = 4, SUB = 5, XOR = 6, CMP = 7 };
+
+// Just enough of an x86-64 encoder for what compile() emits. Memory operands
+// are always [base + disp32] so one ModRM helper covers them all.
+struct X64Writer {
+  uint8_t *p;
+
+  auto byte(uint8_t b) -> void { *p++ = b; }
+  auto u32(uint32_t v) -> void {
+    std::memcpy(p, &v, 4);
+    p += 4;
+  }
+  auto u64(uint64_t v) -> void {
+    std::memcpy(p, &v, 8);
+    p += 8;
+  }
+
+  auto rex(bool w, uint8_t reg, uint8_t base, uint8_t index = 0) -> void {
+    uint8_t r = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) |
+                ((base & 8) >> 3);
+    if (r != 0x40)
+      byte(r);
+  }
+  auto mem(uint8_t reg, uint8_t base, int32_t disp) -> void {
+    byte(0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == 4)
+      byte(0x24);
+    u32(static_cast<uint32_t>(disp));
+  }
+  // [base + index], with a zero disp8 since r13 cannot be a bare base.
+  auto mem_index(uint8_t reg, uint8_t base, uint8_t index) -> void {
+    byte(0x44 | ((reg & 7) << 3));
+    byte(((index & 7) << 3) | (base & 7));
+    byte(0);
+  }
+  auto op_mem(uint8_t opcode, bool w, uint8_t reg, uint8_t base,
+              int32_t disp) -> void {
+    rex(w, reg, base);
+    byte(opcode);
+    mem(reg, base, disp);
+  }
+  auto op_rr(uint8_t opcode, bool w, uint8_t dst, uint8_t src) -> void {
+    rex(w, src, dst);
+    byte(opcode);
+    byte(0xC0 | ((src & 7) << 3) | (dst & 7));
+  }
+
+  auto load32(uint8_t reg, uint8_t base, int32_t disp) -> void {
+    op_mem(0x8B, false, reg, base, disp);
+  }
+  auto store32(uint8_t base, int32_t disp, uint8_t reg) -> void {
+    op_mem(0x89, false, reg, base, disp);
+  }
+  auto load64(uint8_t reg, uint8_t base, int32_t disp) -> void {
+    op_mem(0x8B, true, reg, base, disp);
+  }
+  auto store64(uint8_t base, int32_t disp, uint8_t reg) -> void {
+    op_mem(0x89, true, reg, base, disp);
+  }
+  auto load32_index(uint8_t reg, uint8_t base, uint8_t index) -> void {
+    rex(false, reg, base, index);
+    byte(0x8B);
+    mem_index(reg, base, index);
+  }
+  auto store32_index(uint8_t base, uint8_t index, uint8_t reg) -> void {
+    rex(false, reg, base, index);
+    byte(0x89);
+    mem_index(reg, base, index);
+  }
+  auto mov32(uint8_t dst, uint8_t src) -> void { op_rr(0x89, false, dst, src); }
+  auto mov64(uint8_t dst, uint8_t src) -> void { op_rr(0x89, true, dst, src); }
+  auto mov_imm32(uint8_t reg, uint32_t imm) -> void {
+    rex(false, 0, reg);
+    byte(0xB8 | (reg & 7));
+    u32(imm);
+  }
+  auto mov_imm64(uint8_t reg, uint64_t imm) -> void {
+    rex(true, 0, reg);
+    byte(0xB8 | (reg & 7));
+    u64(imm);
+  }
+  auto store_imm32(uint8_t base, int32_t disp, uint32_t imm) -> void {
+    rex(false, 0, base);
+    byte(0xC7);
+    mem(0, base, disp);
+    u32(imm);
+  }
+
+  auto alu_mem(Alu op, uint8_t reg, uint8_t base, int32_t disp) -> void {
+    op_mem((op << 3) | 3, false, reg, base, disp);
+  }
+  auto alu_rr(Alu op, uint8_t dst, uint8_t src) -> void {
+    op_rr((op << 3) | 1, false, dst, src);
+  }
+  auto alu_imm(Alu op, uint8_t reg, uint32_t imm) -> void {
+    rex(false, 0, reg);
+    byte(0x81);
+    byte(0xC0 | (op << 3) | (reg & 7));
+    u32(imm);
+  }
+  auto alu_mem_imm(Alu op, bool w, uint8_t base, int32_t disp,
+                   uint32_t imm) -> void {
+    rex(w, 0, base);
+    byte(0x81);
+    mem(op, base, disp);
+    u32(imm);
+  }
+  // imul reg, [base + disp]
+  auto imul_mem(uint8_t reg, uint8_t base, int32_t disp) -> void {
+    rex(false, reg, base);
+    byte(0x0F);
+    byte(0xAF);
+    mem(reg, base, disp);
+  }
+  // imul reg, reg, imm32
+  auto imul_imm(uint8_t reg, uint32_t imm) -> void {
+    rex(false, reg, reg);
+    byte(0x69);
+    byte(0xC0 | ((reg & 7) << 3) | (reg & 7));
+    u32(imm);
+  }
+  auto shift_imm(uint8_t ext, bool w, uint8_t reg, uint8_t n) -> void {
+    rex(w, 0, reg);
+    byte(0xC1);
+    byte(0xC0 | (ext << 3) | (reg & 7));
+    byte(n);
+  }
+  auto shl32(uint8_t reg, uint8_t n) -> void { shift_imm(4, false, reg, n); }
+  auto shr32(uint8_t reg, uint8_t n) -> void { shift_imm(5, false, reg, n); }
+  auto shr64(uint8_t reg, uint8_t n) -> void { shift_imm(5, true, reg, n); }
+  auto sar32(uint8_t reg, uint8_t n) -> void { shift_imm(7, false, reg, n); }
+  auto test32(uint8_t a, uint8_t b) -> void { op_rr(0x85, false, a, b); }
+  auto test_imm32(uint8_t reg, uint32_t imm) -> void {
+    rex(false, 0, reg);
+    byte(0xF7);
+    byte(0xC0 | (reg & 7));
+    u32(imm);
+  }
+  // lea dst, [src + disp8]
+  auto lea8(uint8_t dst, uint8_t src, int8_t disp) -> void {
+    rex(false, dst, src);
+    byte(0x8D);
+    byte(0x40 | ((dst & 7) << 3) | (src & 7));
+    byte(static_cast<uint8_t>(disp));
+  }
+  // SSE2 66 0F xx with register operands: xmm, xmm unless stated.
+  auto sse_rr(uint8_t opcode, uint8_t dst, uint8_t src) -> void {
+    byte(0x66);
+    rex(false, dst, src);
+    byte(0x0F);
+    byte(opcode);
+    byte(0xC0 | ((dst & 7) << 3) | (src & 7));
+  }
+  // movd xmm, reg
+  auto movd_from(uint8_t xmm, uint8_t reg) -> void { sse_rr(0x6E, xmm, reg); }
+  // movd reg, xmm
+  auto movd_to(uint8_t reg, uint8_t xmm) -> void { sse_rr(0x7E, xmm, reg); }
+  auto setcc(Cond cc, uint8_t base, int32_t disp) -> void {
+    rex(false, 0, base);
+    byte(0x0F);
+    byte(0x90 | cc);
+    mem(0, base, disp);
+  }
+  auto cmp8_imm(uint8_t base, int32_t disp, uint8_t imm) -> void {
+    rex(false, 0, base);
+    byte(0x80);
+    mem(7, base, disp);
+    byte(imm);
+  }
+  // mov byte [base + index], imm
+  auto store8_index_imm(uint8_t base, uint8_t index, uint8_t imm) -> void {
+    rex(false, 0, base, index);
+    byte(0xC6);
+    mem_index(0, base, index);
+    byte(imm);
+  }
+  // cmp byte [base + index], 0
+  auto cmp8_index_zero(uint8_t base, uint8_t index) -> void {
+    rex(false, 0, base, index);
+    byte(0x80);
+    mem_index(7, base, index);
+    byte(0);
+  }
+
+  // Jumps return the address of their rel32 so it can be bound later.
+  auto jcc(Cond cc) -> uint8_t * {
+    byte(0x0F);
+    byte(0x80 | cc);
+    u32(0);
+    return p - 4;
+  }
+  auto jmp() -> uint8_t * {
+    byte(0xE9);
+    u32(0);
+    return p - 4;
+  }
+  auto jcc8(Cond cc, int8_t rel) -> void {
+    byte(0x70 | cc);
+    byte(static_cast<uint8_t>(rel));
+  }
+  auto call(const void *fn) -> void {
+    mov_imm64(RAX, reinterpret_cast<uint64_t>(fn));
+    byte(0xFF);
+    byte(0xD0);
+  }
+
+  static auto bind(uint8_t *site, const uint8_t *target) -> void {
+    auto rel = static_cast<int32_t>(target - (site + 4));
+    std::memcpy(site, &rel, 4);
+  }
+};
+
+// Stores go through here whenever they might land on a page with decoded
+// code, so the decode cache sees them. Returns non-zero if they did.
+auto jit_store(CPU *cpu, uint32_t addr, uint32_t val) -> uint32_t {
+  auto before = cpu->icache.generation();
+  cpu->store(addr, val);
+  return cpu->icache.generation() != before;
+}
+
+constexpr uint32_t Z = 1u << CPU::ZERO;
+constexpr uint32_t N = 1u << CPU::NEGATIVE;
+constexpr uint32_t V = 1u << CPU::OVFL;
+constexpr uint32_t C = 1u << CPU::CARRY;
+constexpr uint32_t ALL_FLAGS = Z | N | V | C;
+
+// How compile() handles one instruction, and which flags it reads/writes.
+// Anything it cannot translate is NATIVE = false and goes through
+// Jit::interpret; those, and memory accesses (which can bail out to the
+// dispatcher), need every earlier flag to be in CPU::flags.
+struct OpInfo {
+  bool native = false;
+  uint32_t writes = 0;
+  uint32_t reads = ALL_FLAGS;
+};
+
+auto reg_ok(uint32_t r) -> bool { return r < 17; }
+
+auto classify(const DecodedInst &inst) -> OpInfo {
+  using namespace Fanta::Info::Instructions;
+  auto three = reg_ok(inst.dest) && reg_ok(inst.s1) && reg_ok(inst.s2);
+  auto two = reg_ok(inst.dest) && reg_ok(inst.s1);
+  switch (inst.op) {
+  case ADD_REG:
+  case SUB_REG:
+    return {three, Z | N | V | C, 0};
+  case ADD_IMM:
+  case SUB_IMM:
+    return {two, Z | N | V | C, 0};
+  case AND_REG:
+  case OR_REG:
+  case XOR_REG:
+  case MUL_REG:
+    return {three, Z | N, 0};
+  case AND_IMM:
+  case OR_IMM:
+  case XOR_IMM:
+  case MUL_IMM:
+  case MOV_REG:
+    return {two, Z | N, 0};
+  case MOV_IMM:
+  case LUI:
+    return {reg_ok(inst.dest), Z | N, 0};
+  case CMP_REG:
+  case CMP_IMM:
+    return {two, Z | N | C, 0};
+  // A zero or out-of-range shift count has no x86 equivalent that also
+  // produces the interpreter's carry, so only 1..31 is translated.
+  case LSH_IMM:
+  case RSH_IMM:
+  case ASR_IMM:
+    return {two && inst.imm > 0 && inst.imm < 32, Z | N | C, 0};
+  // Division by a power of two is a shift on the host.
+  case DIV_IMM:
+  case DIVU_IMM:
+    return {two && std::has_single_bit(inst.imm), Z | N, 0};
+  // PBLEND's multiplies stay in the interpreter's Packed::blend().
+  case PADDUSB:
+  case PSUBUSB:
+  case PAVGB:
+    return {three, Z | N, 0};
+  case LOAD:
+  case STORE:
+    return {two, Z | N, ALL_FLAGS};
+  case PUSH:
+  case POP:
+    return {inst.payload < 17, 0, ALL_FLAGS};
+  case CALL:
+  case RET:
+    return {true, 0, ALL_FLAGS};
+  case NOP:
+  case JUMP:
+  case JREL:
+    return {true, 0, 0};
+  case BEQ:
+  case BNE:
+    return {true, 0, Z};
+  case BEC:
+  case BNC:
+    return {true, 0, C};
+  case BMI:
+  case BPL:
+    return {true, 0, N};
+  default:
+    return {};
+  }
+}
+
+auto flag_of(uint8_t op) -> std::pair<CPU::FLAG, bool> {
+  using namespace Fanta::Info::Instructions;
+  switch (op) {
+  case BEQ:
+    return {CPU::ZERO, false};
+  case BNE:
+    return {CPU::ZERO, true};
+  case BEC:
+    return {CPU::CARRY, false};
+  case BNC:
+    return {CPU::CARRY, true};
+  case BMI:
+    return {CPU::NEGATIVE, false};
+  default:
+    return {CPU::NEGATIVE, true};
+  }
+}
+
+// Worst-case bytes for one translated instruction plus its exit stubs.
+constexpr std::size_t MAX_INST_BYTES = 384;
+constexpr std::size_t MAX_BLOCK_OVERHEAD = 256;
+
+} // namespace
+
+Jit::Jit(Interpret interpret) : interpret(interpret), lookup(LOOKUP_SIZE) {
+  auto *mem = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    throw std::runtime_error("JIT: unable to map code buffer");
+  code = static_cast<uint8_t *>(mem);
+  is_writable = true;
+  emit_trampoline();
+}
+
+Jit::~Jit() { munmap(code, CODE_SIZE); }
+
+auto Jit::writable(bool on) -> void {
+  if (is_writable == on)
+    return;
+  mprotect(code, CODE_SIZE, on ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC);
+  is_writable = on;
+}
+
+// void trampoline(CPU *cpu, JitState *state, const uint8_t *entry,
+//                 LookupEntry *lookup)
+//
+// Saves the callee-saved registers native code pins its state in and jumps
+// to `entry`. Every block exit jumps back to `exit`, which returns to C++.
+auto Jit::emit_trampoline() -> void {
+  X64Writer w{code};
+  w.byte(0x53); // push rbx
+  w.byte(0x55); // push rbp
+  w.byte(0x41);
+  w.byte(0x54); // push r12
+  w.byte(0x41);
+  w.byte(0x55); // push r13
+  w.byte(0x41);
+  w.byte(0x56); // push r14
+  w.byte(0x41);
+  w.byte(0x57); // push r15
+  // Six pushes leave rsp 8 off the 16-byte alignment helper calls expect.
+  w.byte(0x48);
+  w.byte(0x83);
+  w.byte(0xEC);
+  w.byte(0x08); // sub rsp, 8
+  w.mov64(CPU_PTR, RDI);
+  w.mov64(STATE, RSI);
+  w.mov64(LOOKUP, RCX);
+  w.load64(MEM, STATE, offsetof(JitState, memory));
+  w.load64(PAGES, STATE, offsetof(JitState, code_pages));
+  w.load64(DIRTY, STATE, offsetof(JitState, dirty_pages));
+  w.byte(0xFF);
+  w.byte(0xE2); // jmp rdx
+  exit = w.p;
+  w.byte(0x48);
+  w.byte(0x83);
+  w.byte(0xC4);
+  w.byte(0x08); // add rsp, 8
+  w.byte(0x41);
+  w.byte(0x5F); // pop r15
+  w.byte(0x41);
+  w.byte(0x5E); // pop r14
+  w.byte(0x41);
+  w.byte(0x5D); // pop r13
+  w.byte(0x41);
+  w.byte(0x5C); // pop r12
+  w.byte(0x5D); // pop rbp
+  w.byte(0x5B); // pop rbx
+  w.byte(0xC3); // ret
+  // An empty lookup slot: the dynamic exit for the target in eax.
+  miss = w.p;
+  w.store32(STATE, offsetof(JitState, pc), RAX);
+  X64Writer::bind(w.jmp(), exit);
+  trampoline_size = w.p - code;
+  used = trampoline_size;
+  std::fill(lookup.begin(), lookup.end(), LookupEntry{0, miss});
+}
+
+auto Jit::flush(uint64_t gen) -> void {
+  blocks.clear();
+  std::fill(lookup.begin(), lookup.end(), LookupEntry{0, miss});
+  used = trampoline_size;
+  generation = gen;
+}
+
+auto Jit::enter(CPU &cpu, JitState &state, const uint8_t *entry) -> void {
+  writable(false);
+  using Trampoline =
+      void (*)(CPU *, JitState *, const uint8_t *, LookupEntry *);
+  reinterpret_cast<Trampoline>(code)(&cpu, &state, entry, lookup.data());
+}
+
+auto Jit::link(uint8_t *site, const Block &target) -> void {
+  writable(true);
+  X64Writer::bind(site, target.checked);
+}
+
+auto Jit::compile(const CPU &cpu, const DecodedInst *insts, uint32_t pc,
+                  uint32_t len) -> const Block * {
+  auto worst = MAX_BLOCK_OVERHEAD + len * (MAX_INST_BYTES + sizeof(DecodedInst));
+  if (CODE_SIZE - used < worst)
+    return nullptr;
+  writable(true);
+
+  // Instructions that go through `interpret` need a stable record to point
+  // at; the decode cache slot may be reset while this code is still live.
+  auto *records = reinterpret_cast<DecodedInst *>(
+      code + ((used + alignof(DecodedInst) - 1) & ~(alignof(DecodedInst) - 1)));
+  std::memcpy(records, insts, len * sizeof(DecodedInst));
+  X64Writer w{reinterpret_cast<uint8_t *>(records + len)};
+
+  auto *cpu_base = reinterpret_cast<const uint8_t *>(&cpu);
+  auto reg = [&](uint32_t r) {
+    return static_cast<int32_t>(
+        reinterpret_cast<const uint8_t *>(&cpu.registers[r]) - cpu_base);
+  };
+  auto field = [&](const auto &f) {
+    return static_cast<int32_t>(reinterpret_cast<const uint8_t *>(&f) -
+                                cpu_base);
+  };
+  // Native code keeps CPU::flags settled: N and Z come from the result word
+  // in `value`, V and C are written out from the host flags.
+  auto set_flags = [&](uint32_t mask, HostReg value, Cond v, Cond c) {
+    if (mask & (Z | N))
+      w.store32(CPU_PTR, field(cpu.flags.result), value);
+    if (mask & V)
+      w.setcc(v, CPU_PTR, field(cpu.flags.overflow));
+    if (mask & C)
+      w.setcc(c, CPU_PTR, field(cpu.flags.carry));
+  };
+
+  // Exits are emitted after the block body so the fall-through path stays
+  // straight-line.
+  struct Exit {
+    enum Kind { CONST, DYNAMIC, STEP, CHAIN } kind;
+    uint8_t *site;
+    uint32_t pc;
+    uint32_t unexecuted;
+  };
+  std::vector<Exit> exits;
+  auto chain = [&](uint8_t *site, uint32_t target) {
+    if (auto *known = find(target))
+      X64Writer::bind(site, known->checked);
+    else
+      exits.push_back({Exit::CHAIN, site, target, 0});
+  };
+
+  // eax = guest register `base` + `disp`, leaving for the interpreter before
+  // instruction `k` has done anything if the word is not fully in memory.
+  auto guest_addr = [&](uint32_t base, uint32_t disp, uint32_t at,
+                        uint32_t k) {
+    w.load32(RAX, CPU_PTR, reg(base));
+    if (disp)
+      w.alu_imm(ADD, RAX, disp);
+    w.alu_imm(CMP, RAX, CPU::MEMORY_SIZE - 4);
+    exits.push_back({Exit::STEP, w.jcc(A), at, len - k});
+  };
+
+  // Stores edx to the guest address in eax, then runs `finish(slow)` for the
+  // rest of the instruction. Only pages that have never been decoded take
+  // the inline path; anything else goes through CPU::store() so the decode
+  // cache sees it, and leaves for the dispatcher at `next` if it hit code.
+  auto guest_store = [&](uint32_t next, uint32_t unexecuted, auto finish) {
+    w.mov32(RCX, RAX);
+    w.shr32(RCX, DecodeCache::PAGE_SHIFT);
+    w.cmp8_index_zero(PAGES, RCX);
+    auto *slow_first = w.jcc(NE);
+    // A misaligned word can spill onto the next page.
+    w.lea8(RCX, RAX, 3);
+    w.shr32(RCX, DecodeCache::PAGE_SHIFT);
+    w.cmp8_index_zero(PAGES, RCX);
+    auto *slow_second = w.jcc(NE);
+    w.store32_index(MEM, RAX, RDX);
+    // Memory::write32() does this for everything else. rcx still holds the
+    // page of the last byte.
+    w.store8_index_imm(DIRTY, RCX, 1);
+    w.mov32(RCX, RAX);
+    w.shr32(RCX, DecodeCache::PAGE_SHIFT);
+    w.store8_index_imm(DIRTY, RCX, 1);
+    // So does CPU::mark_vram(): ecx = offset of the last byte from VRAM, and
+    // the spans of both ends get marked, biased by one span.
+    w.lea8(RCX, RAX, 3);
+    w.alu_imm(SUB, RCX, CPU::VRAM_BASE);
+    w.alu_imm(CMP, RCX, CPU::VRAM_BYTES + 3);
+    auto *not_vram = w.jcc(AE);
+    w.alu_imm(ADD, RCX, CPU::VRAM_SPAN);
+    w.load64(RSI, STATE, offsetof(JitState, vram_spans));
+    w.mov32(RDI, RCX);
+    w.shr32(RDI, CPU::VRAM_SPAN_SHIFT);
+    w.store8_index_imm(RSI, RDI, 1);
+    w.alu_imm(SUB, RCX, 3);
+    w.shr32(RCX, CPU::VRAM_SPAN_SHIFT);
+    w.store8_index_imm(RSI, RCX, 1);
+    X64Writer::bind(not_vram, w.p);
+    finish(false);
+    auto *done = w.jmp();
+    X64Writer::bind(slow_first, w.p);
+    X64Writer::bind(slow_second, w.p);
+    w.mov64(RDI, CPU_PTR);
+    w.mov32(RSI, RAX);
+    w.call(reinterpret_cast<const void *>(&jit_store));
+    finish(true);
+    w.test32(RAX, RAX);
+    exits.push_back({Exit::CONST, w.jcc(NE), next, unexecuted});
+    X64Writer::bind(done, w.p);
+  };
+
+  // Jumps to the guest address in eax through the lookup table, or leaves
+  // for the dispatcher to translate it.
+  auto lookup_jump = [&] {
+    w.mov32(RCX, RAX);
+    w.shr32(RCX, 2);
+    w.alu_imm(AND, RCX, LOOKUP_SIZE - 1);
+    w.shl32(RCX, 4);
+    w.byte(0x39);
+    w.byte(0x04);
+    w.byte(0x0B); // cmp [rbx + rcx], eax
+    exits.push_back({Exit::DYNAMIC, w.jcc(NE), 0, 0});
+    w.byte(0xFF);
+    w.byte(0x64);
+    w.byte(0x0B);
+    w.byte(offsetof(LookupEntry, entry)); // jmp [rbx + rcx + 8]
+  };
+
+  // Only the last writer of each flag before something that reads it needs
+  // to store it.
+  std::vector<OpInfo> info(len);
+  std::vector<uint32_t> needed(len);
+  uint32_t live = ALL_FLAGS;
+  for (auto i = len; i-- > 0;) {
+    info[i] = classify(insts[i]);
+    if (!info[i].native)
+      info[i] = OpInfo{};
+    needed[i] = info[i].writes & live;
+    live = (live & ~info[i].writes) | info[i].reads;
+  }
+
+  // Checked entry: stop before running a block the budget cannot cover or
+  // that would latch VBLANK part-way; the dispatcher single-steps those.
+  auto *checked = w.p;
+  w.alu_mem_imm(CMP, true, STATE, offsetof(JitState, budget), len);
+  exits.push_back({Exit::CONST, w.jcc(B), pc, 0});
+  w.load32(RAX, STATE, offsetof(JitState, count));
+  w.alu_imm(ADD, RAX, len);
+  w.alu_imm(CMP, RAX, CPU::CYCLES_PER_FRAME);
+  exits.push_back({Exit::CONST, w.jcc(A), pc, 0});
+  w.store32(STATE, offsetof(JitState, count), RAX);
+  w.alu_mem_imm(SUB, true, STATE, offsetof(JitState, budget), len);
+  auto *body = w.p;
+
+  using namespace Fanta::Info::Instructions;
+  auto terminated = false;
+  for (uint32_t k = 0; k < len; k++) {
+    const auto &inst = insts[k];
+    auto at = pc + 4 * k;
+    auto flags = needed[k];
+
+    if (!info[k].native) {
+      w.mov64(RDI, CPU_PTR);
+      w.mov_imm64(RSI, reinterpret_cast<uint64_t>(&records[k]));
+      w.mov_imm32(RDX, at);
+      w.call(reinterpret_cast<const void *>(interpret));
+      if (inst.op == HALT) {
+        exits.push_back({Exit::DYNAMIC, w.jmp(), 0, 0});
+        terminated = true;
+        break;
+      }
+      // New PC in eax, "overwrote code" in bit 32.
+      w.mov64(RDX, RAX);
+      w.shr64(RDX, 32);
+      exits.push_back({Exit::DYNAMIC, w.jcc(NE), 0, len - k - 1});
+      if (ends_block(inst.op)) {
+        lookup_jump();
+        terminated = true;
+        break;
+      }
+      continue;
+    }
+
+    switch (inst.op) {
+    case ADD_REG:
+    case SUB_REG:
+    case AND_REG:
+    case OR_REG:
+    case XOR_REG:
+    case ADD_IMM:
+    case SUB_IMM:
+    case AND_IMM:
+    case OR_IMM:
+    case XOR_IMM: {
+      Alu op = (inst.op == ADD_REG || inst.op == ADD_IMM)   ? ADD
+               : (inst.op == SUB_REG || inst.op == SUB_IMM) ? SUB
+               : (inst.op == AND_REG || inst.op == AND_IMM) ? AND
+               : (inst.op == OR_REG || inst.op == OR_IMM)   ? OR
+                                                            : XOR;
+      w.load32(RAX, CPU_PTR, reg(inst.s1));
+      if (inst.op == ADD_IMM || inst.op == SUB_IMM || inst.op == AND_IMM ||
+          inst.op == OR_IMM || inst.op == XOR_IMM)
+        w.alu_imm(op, RAX, inst.imm);
+      else
+        w.alu_mem(op, RAX, CPU_PTR, reg(inst.s2));
+      // Fanta's SUB carry is "no borrow".
+      set_flags(flags, RAX, O, op == SUB ? AE : B);
+      w.store32(CPU_PTR, reg(inst.dest), RAX);
+      break;
+    }
+    // The low half of a product is the same signed or unsigned. Division
+    // stays in the interpreter, which defines x / 0.
+    case MUL_REG:
+    case MUL_IMM:
+      w.load32(RAX, CPU_PTR, reg(inst.s1));
+      if (inst.op == MUL_IMM)
+        w.imul_imm(RAX, inst.imm);
+      else
+        w.imul_mem(RAX, CPU_PTR, reg(inst.s2));
+      set_flags(flags, RAX, O, B);
+      w.store32(CPU_PTR, reg(inst.dest), RAX);
+      break;
+    case MOV_REG:
+    case MOV_IMM:
+    case LUI:
+      if (inst.op == MOV_REG)
+        w.load32(RAX, CPU_PTR, reg(inst.s1));
+      else if (inst.op == LUI)
+        w.mov_imm32(RAX, uint32_t{inst.imm} << 16);
+      else
+        w.mov_imm32(RAX, inst.imm);
+      set_flags(flags, RAX, O, B);
+      w.store32(CPU_PTR, reg(inst.dest), RAX);
+      break;
+    case CMP_REG:
+    case CMP_IMM:
+      // SUB rather than CMP: the difference is the N/Z word.
+      w.load32(RAX, CPU_PTR, reg(inst.dest));
+      if (inst.op == CMP_REG)
+        w.alu_mem(SUB, RAX, CPU_PTR, reg(inst.s1));
+      else
+        w.alu_imm(SUB, RAX, inst.imm);
+      set_flags(flags, RAX, O, G);
+      break;
+    case LSH_IMM:
+    case RSH_IMM:
+    case ASR_IMM: {
+      // x86 leaves the last bit shifted out in CF, as the interpreter does.
+      auto n = static_cast<uint8_t>(inst.imm);
+      w.load32(RAX, CPU_PTR, reg(inst.s1));
+      if (inst.op == LSH_IMM)
+        w.shl32(RAX, n);
+      else if (inst.op == RSH_IMM)
+        w.shr32(RAX, n);
+      else
+        w.sar32(RAX, n);
+      set_flags(flags, RAX, O, B);
+      w.store32(CPU_PTR, reg(inst.dest), RAX);
+      break;
+    }
+    case DIV_IMM:
+    case DIVU_IMM: {
+      auto k = static_cast<uint8_t>(std::countr_zero(inst.imm));
+      w.load32(RAX, CPU_PTR, reg(inst.s1));
+      if (k > 0 && inst.op == DIVU_IMM) {
+        w.shr32(RAX, k);
+      } else if (k > 0) {
+        // Bias negative dividends by 2^k - 1 so the shift truncates towards
+        // zero: edx = (eax >> 31) >>> (32 - k).
+        w.mov32(RDX, RAX);
+        w.sar32(RDX, 31);
+        w.shr32(RDX, static_cast<uint8_t>(32 - k));
+        w.alu_rr(ADD, RAX, RDX);
+        w.sar32(RAX, k);
+      }
+      set_flags(flags, RAX, O, B);
+      w.store32(CPU_PTR, reg(inst.dest), RAX);
+      break;
+    }
+    case PADDUSB:
+    case PSUBUSB:
+    case PAVGB:
+      // paddusb / psubusb / pavgb on the low lanes of xmm0 and xmm1. The
+      // operands go through eax/edx: a guest register just stored forwards
+      // to a general register load much sooner than to movd xmm, [mem].
+      w.load32(RAX, CPU_PTR, reg(inst.s1));
+      w.load32(RDX, CPU_PTR, reg(inst.s2));
+      w.movd_from(0, RAX);
+      w.movd_from(1, RDX);
+      w.sse_rr(inst.op == PADDUSB   ? 0xDC
+               : inst.op == PSUBUSB ? 0xD8
+                                    : 0xE0,
+               0, 1);
+      w.movd_to(RAX, 0);
+      set_flags(flags, RAX, O, B);
+      w.store32(CPU_PTR, reg(inst.dest), RAX);
+      break;
+    case LOAD:
+      guest_addr(inst.s1, inst.imm, at, k);
+      w.load32_index(RAX, MEM, RAX);
+      w.store32(CPU_PTR, reg(inst.dest), RAX);
+      set_flags(flags, RAX, O, B);
+      break;
+    case STORE: {
+      guest_addr(inst.s1, inst.imm, at, k);
+      w.load32(RDX, CPU_PTR, reg(inst.dest));
+      // The N/Z update has to happen before any exit, so on the slow path it
+      // is done in full regardless of liveness.
+      guest_store(at + 4, len - k - 1, [&](bool slow) {
+        if (slow)
+          w.load32(RDX, CPU_PTR, reg(inst.dest));
+        set_flags(slow ? Z | N : flags, RDX, O, B);
+      });
+      break;
+    }
+    case PUSH:
+    case CALL: {
+      guest_addr(Fanta::Info::Registers::SP, 0, at, k);
+      if (inst.op == PUSH)
+        w.load32(RDX, CPU_PTR, reg(inst.payload));
+      else
+        w.mov_imm32(RDX, at + 4);
+      auto next = inst.op == PUSH ? at + 4 : at + inst.offset;
+      guest_store(next, len - k - 1, [&](bool) {
+        w.alu_mem_imm(SUB, false, CPU_PTR, reg(Fanta::Info::Registers::SP),
+                      4);
+      });
+      if (inst.op == CALL) {
+        chain(w.jmp(), next);
+        terminated = true;
+      }
+      break;
+    }
+    case POP:
+    case RET:
+      guest_addr(Fanta::Info::Registers::SP, 4, at, k);
+      w.store32(CPU_PTR, reg(Fanta::Info::Registers::SP), RAX);
+      w.load32_index(RAX, MEM, RAX);
+      if (inst.op == POP) {
+        w.store32(CPU_PTR, reg(inst.payload), RAX);
+        break;
+      }
+      lookup_jump();
+      terminated = true;
+      break;
+    case NOP:
+      break;
+    case JUMP:
+      chain(w.jmp(), inst.payload);
+      terminated = true;
+      break;
+    case JREL:
+      chain(w.jmp(), at + inst.offset);
+      terminated = true;
+      break;
+    case BEQ:
+    case BNE:
+    case BEC:
+    case BNC:
+    case BMI:
+    case BPL: {
+      auto [f, negated] = flag_of(inst.op);
+      Cond taken;
+      if (f == CPU::CARRY) {
+        w.cmp8_imm(CPU_PTR, field(cpu.flags.carry), 1);
+        taken = E;
+      } else {
+        w.alu_mem_imm(CMP, false, CPU_PTR, field(cpu.flags.result), 0);
+        taken = f == CPU::ZERO ? E : S;
+      }
+      // Skip the 5-byte taken jump when the branch falls through.
+      w.jcc8(static_cast<Cond>(negated ? taken : taken ^ 1), 5);
+      chain(w.jmp(), at + inst.offset);
+      chain(w.jmp(), at + 4);
+      terminated = true;
+      break;
+    }
+    }
+    if (terminated)
+      break;
+  }
+  // Ran off the end of the page.
+  if (!terminated)
+    chain(w.jmp(), pc + 4 * len);
+
+  for (const auto &e : exits) {
+    X64Writer::bind(e.site, w.p);
+    if (e.kind == Exit::DYNAMIC)
+      w.store32(STATE, offsetof(JitState, pc), RAX);
+    else
+      w.store_imm32(STATE, offsetof(JitState, pc), e.pc);
+    if (e.unexecuted) {
+      w.alu_mem_imm(ADD, true, STATE, offsetof(JitState, budget),
+                    e.unexecuted);
+      w.alu_mem_imm(SUB, false, STATE, offsetof(JitState, count),
+                    e.unexecuted);
+    }
+    if (e.kind == Exit::STEP)
+      w.store_imm32(STATE, offsetof(JitState, step), 1);
+    if (e.kind == Exit::CHAIN) {
+      w.mov_imm64(RAX, reinterpret_cast<uint64_t>(e.site));
+      w.store64(STATE, offsetof(JitState, chain_site), RAX);
+    }
+    X64Writer::bind(w.jmp(), exit);
+  }
+
+  used = w.p - code;
+  auto &block = blocks[pc] = Block{checked, body, len};
+  auto &slot = lookup[(pc >> 2) & (LOOKUP_SIZE - 1)];
+  slot.pc = pc;
+  slot.entry = checked;
+  return &block;
+}
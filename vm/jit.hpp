@@ -0,0 +1,115 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+struct CPU;
+struct DecodedInst;
+
+/**
+ * @brief Registers shared between the JIT dispatcher and native code.
+ *
+ * @details Native blocks chain into each other without returning, so they
+ *          do the per-block budget and frame accounting themselves against
+ *          these fields. Every exit back to the dispatcher fills in `pc` and,
+ *          if the jump that led there can be linked, `chain_site`.
+ */
+struct JitState {
+  uint64_t budget = 0;                 ///< Instructions left to run
+  uint32_t count = 0;                  ///< Mirror of the VBLANK frame counter
+  uint32_t pc = 0;                     ///< Guest PC to resume at
+  uint32_t step = 0;                   ///< Interpret the instruction at `pc`
+  uint8_t *chain_site = nullptr;       ///< Jump to link to `pc`, or null
+  uint8_t *memory = nullptr;           ///< Host address of guest address 0
+  const uint8_t *code_pages = nullptr; ///< DecodeCache::code_pages()
+  uint8_t *dirty_pages = nullptr;      ///< Memory::dirty_pages()
+  uint8_t *vram_spans = nullptr;       ///< CPU::vram_dirty_spans()
+};
+
+/**
+ * @brief x86-64 translator for basic blocks of Fanta code.
+ *
+ * @details Blocks are the same ones the BLOCK engine runs (they come from
+ *          the decode cache) and are emitted into one mmap'd buffer that is
+ *          only ever writable or executable, never both. Guest registers and
+ *          flags stay in CPU::registers and the lazy CPU::flags fields
+ *          (result, carry, overflow); native code reaches them through a
+ *          pinned CPU pointer, so it always sees the same state the
+ *          interpreter does.
+ *
+ *          ALU, MUL, MOV, LUI, CMP, shifts by a constant, division by a
+ *          constant power of two, the packed saturating adds and averages (as
+ *          SSE2), LOAD/STORE, NOP and every direct control transfer are
+ *          translated. Anything else goes through the
+ *          `interpret` callback one instruction at a time. Direct jumps are
+ *          linked straight to their target block the first time they are
+ *          taken, and RET/CIP/JMP targets go through a small direct-mapped
+ *          lookup table instead of back to the dispatcher.
+ *
+ *          Code is never patched in place. When a store overwrites a decoded
+ *          instruction word the dispatcher flushes the whole buffer.
+ *
+ * @note Only available when vm_lib is built with FANTA_JIT (x86-64 POSIX).
+ */
+struct Jit {
+  /// Runs one instruction the way the interpreter would and returns the new
+  /// PC, with bit 32 set if the instruction overwrote decoded code.
+  using Interpret = uint64_t (*)(CPU *, const DecodedInst *, uint32_t pc);
+
+  struct Block {
+    const uint8_t *checked; ///< Entry that charges budget and frame first
+    const uint8_t *body;    ///< Entry once the caller has charged them
+    uint32_t len;           ///< Guest instructions in the block
+  };
+
+  Jit(Interpret interpret);
+  ~Jit();
+  Jit(const Jit &) = delete;
+  auto operator=(const Jit &) -> Jit & = delete;
+
+  auto find(uint32_t pc) const -> const Block * {
+    auto it = blocks.find(pc);
+    return it == blocks.end() ? nullptr : &it->second;
+  }
+
+  // Translates `len` decoded instructions starting at guest address `pc`.
+  auto compile(const CPU &cpu, const DecodedInst *insts, uint32_t pc,
+               uint32_t len) -> const Block *;
+
+  // Points a pending chain jump at `target`'s checked entry.
+  auto link(uint8_t *site, const Block &target) -> void;
+
+  // Forgets every translation; `generation` is the decode cache generation
+  // the fresh cache is valid for.
+  auto flush(uint64_t generation) -> void;
+
+  auto enter(CPU &cpu, JitState &state, const uint8_t *entry) -> void;
+
+  uint64_t generation = 0;
+
+private:
+  static constexpr std::size_t CODE_SIZE = 16 * 1024 * 1024;
+  static constexpr std::size_t LOOKUP_SIZE = 4096;
+
+  // Empty slots point at `miss`, so whatever PC they match leaves for the
+  // dispatcher.
+  struct LookupEntry {
+    uint32_t pc = 0;
+    const uint8_t *entry = nullptr;
+  };
+
+  auto writable(bool on) -> void;
+  auto emit_trampoline() -> void;
+
+  Interpret interpret;
+  uint8_t *code = nullptr;
+  std::size_t used = 0;
+  std::size_t trampoline_size = 0;
+  const uint8_t *exit = nullptr;
+  const uint8_t *miss = nullptr; ///< Stores eax as the PC, then exits
+  bool is_writable = false;
+  std::unordered_map<uint32_t, Block> blocks;
+  std::vector<LookupEntry> lookup;
+};
@@ -1,20 +1,120 @@
 #include "line.hpp"
 #include <SDL.h>
 #include "cpu.hpp"
+#include "frame_scheduler.hpp"
+#include "spsc_queue.hpp"
 #include "string_assembler.hpp"
+#include "triple_buffer.hpp"
 #include <SDL_events.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <optional>
+#include <print>
+#include <thread>
 #include <vector>
 #include <fstream>
 #include <string>
 
 constexpr int FPS = 60;
-constexpr int TIMING = 1000 / FPS;
-constexpr int VM_WIDTH = 320;
-constexpr int VM_HEIGHT = 240;
+constexpr int VM_WIDTH = CPU::VRAM_WIDTH;
+constexpr int VM_HEIGHT = CPU::VRAM_HEIGHT;
 constexpr int WINDOW_SCALE = 3;
 
+// A finished frame as handed from the emulation thread to the SDL thread.
+struct PresentedFrame {
+    std::vector<uint32_t> pixels = std::vector<uint32_t>(VM_WIDTH * VM_HEIGHT);
+    CPU::VramRows rows; // Rows that differ from the last frame the SDL thread took
+};
+
+// Host input the emulation thread acts on between frames.
+enum class InputEvent : uint8_t {
+    TOGGLE_PAUSE, // P
+    TOGGLE_TURBO, // Tab: unthrottled while on
+};
+
+static void print_stats(const FrameScheduler::Stats& s, double nominal_mhz) {
+    std::println("Frames: {} ({} skipped) in {:.2f} s | {:.1f} fps | guest {:.2f} MHz (nominal {:.2f})",
+        s.frames, s.skipped, s.seconds, s.fps, s.guest_mhz, nominal_mhz);
+    std::println("Frame time: p50 {:.3f} ms | p95 {:.3f} ms | p99 {:.3f} ms | max {:.3f} ms",
+        s.p50_ms, s.p95_ms, s.p99_ms, s.max_ms);
+}
+
 int main(int argc, char* argv[]) {
+    // fanta [--unthrottled] [--headless [--frames N]] [program.bin|program.asm]
+    FrameScheduler::Config pacing;
+    pacing.fps = FPS;
+    bool headless = false;
+    std::optional<uint64_t> frame_limit;
+    std::string filename;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--unthrottled") {
+            pacing.pacing = FrameScheduler::Pacing::UNTHROTTLED;
+        } else if (arg == "--headless") {
+            // No window, as fast as the host allows.
+            headless = true;
+            pacing.pacing = FrameScheduler::Pacing::UNTHROTTLED;
+        } else if (arg == "--frames" && i + 1 < argc) {
+            frame_limit = std::stoull(argv[++i]);
+        } else {
+            filename = arg;
+        }
+    }
+
+    CPU cpu{};
+    if (!filename.empty()) {
+        if (filename.ends_with(".bin")) {
+            std::ifstream in(filename, std::ios::binary);
+            if (!in) {
+                std::cerr << "Error: Could not open binary file " << filename << "\n";
+                return 1;
+            }
+            std::vector<uint32_t> insts;
+            uint32_t inst;
+            while (in.read(reinterpret_cast<char*>(&inst), sizeof(uint32_t))) {
+                insts.push_back(inst);
+            }
+            for (size_t i = 0; i < insts.size(); ++i) {
+                cpu.store(i * 4, insts[i]);
+            }
+            std::cout << "Loaded compiled binary " << filename << " (" << insts.size() << " instructions)\n";
+        } else {
+            std::ifstream in(filename);
+            if (!in) {
+                std::cerr << "Error: Could not open assembly file " << filename << "\n";
+                return 1;
+            }
+            Assembler assem;
+            auto lines = assem.read_source(in);
+            assem.scan_for_labels(lines);
+            for (size_t i = 0; i < lines.size(); ++i) {
+                uint32_t instr = assem.assemble(lines[i], i * 4);
+                cpu.store(i * 4, (instr != (uint32_t)-1) ? instr : (0x14 << 26)); // Fallback to NOP if assembly fails
+            }
+            std::cout << "Loaded assembly " << filename << " (" << lines.size() << " lines)\n";
+        }
+    } else {
+        cpu.load_rom(generate_line()); 
+        cpu.store(200, 10);
+        cpu.store(204, 20);
+        cpu.store(208, 15);
+        cpu.store(212, 15);
+        cpu.store(216, 0xFFFFFFFF);
+        std::cout << "Running default line demo\n";
+    }
+
+    if (headless) {
+        FrameScheduler scheduler(cpu, pacing);
+        uint64_t frames = 0;
+        while (!cpu.halted && (!frame_limit || frames < *frame_limit)) {
+            frames += scheduler.advance().frames;
+        }
+        print_stats(scheduler.stats(), scheduler.nominal_mhz());
+        return 0;
+    }
 
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         std::cerr << "SDL_Init Error: " << SDL_GetError() << "\n";
@@ -62,78 +162,115 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    bool running = true;
-    SDL_Event event;
-    CPU cpu{};
-  
-    if (argc > 1) {
-        std::string filename = argv[1];
-        if (filename.ends_with(".bin")) {
-            std::ifstream in(filename, std::ios::binary);
-            if (!in) {
-                std::cerr << "Error: Could not open binary file " << filename << "\n";
-                return 1;
+    // The CPU runs on its own thread so presenting (and waiting for vsync)
+    // never holds it up. At every VBLANK it copies VRAM into the back slot
+    // of a triple buffer; this thread only uploads whatever was published
+    // last, and sends input back through a wait-free queue.
+    TripleBuffer<PresentedFrame> frames;
+    SpscQueue<InputEvent, 64> input;
+    std::optional<FrameScheduler::Stats> final_stats;
+    double nominal_mhz = 0;
+
+    std::jthread emulator([&](std::stop_token stop) {
+        FrameScheduler scheduler(cpu, pacing);
+        bool paused = false;
+        CPU::VramRows last_published;
+        // Rows each slot is behind VRAM by: everything published since the
+        // writer last filled it. Slots start out blank.
+        std::array<CPU::VramRows, 3> stale;
+        stale.fill({0, CPU::VRAM_HEIGHT});
+        auto merge = [](CPU::VramRows a, CPU::VramRows b) {
+            if (a.empty()) {
+                return b;
             }
-            std::vector<uint32_t> insts;
-            uint32_t inst;
-            while (in.read(reinterpret_cast<char*>(&inst), sizeof(uint32_t))) {
-                insts.push_back(inst);
+            if (b.empty()) {
+                return a;
             }
-            for (size_t i = 0; i < insts.size(); ++i) {
-                cpu.store(i * 4, insts[i]);
+            return CPU::VramRows{std::min(a.first, b.first), std::max(a.end, b.end)};
+        };
+        while (!stop.stop_requested()) {
+            while (auto event = input.pop()) {
+                if (*event == InputEvent::TOGGLE_PAUSE) {
+                    paused = !paused;
+                } else {
+                    auto turbo = scheduler.config().pacing == FrameScheduler::Pacing::REALTIME;
+                    scheduler.set_pacing(turbo ? FrameScheduler::Pacing::UNTHROTTLED
+                                               : FrameScheduler::Pacing::REALTIME);
+                }
             }
-            std::cout << "Loaded compiled binary " << filename << " (" << insts.size() << " instructions)\n";
-        } else {
-            std::ifstream in(filename);
-            if (!in) {
-                std::cerr << "Error: Could not open assembly file " << filename << "\n";
-                return 1;
+            if (paused) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                continue;
             }
-            std::vector<std::string> lines;
-            std::string line;
-            std::string full_code;
-            while (std::getline(in, line)) {
-                lines.push_back(line);
-                full_code += line + "\n";
+
+            auto frame = scheduler.advance();
+            // Unthrottled, advance() returns at once even when halted; don't
+            // spin on a program that has finished.
+            if (frame.halted &&
+                scheduler.config().pacing == FrameScheduler::Pacing::UNTHROTTLED) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
             }
-            Assembler assem;
-            assem.scan_for_labels(full_code);
-            for (size_t i = 0; i < lines.size(); ++i) {
-                uint32_t instr = assem.assemble(lines[i], i * 4);
-                cpu.store(i * 4, (instr != (uint32_t)-1) ? instr : (0x14 << 26)); // Fallback to NOP if assembly fails
+
+            auto rows = cpu.take_vram_dirty();
+            if (rows.empty()) {
+                continue;
             }
-            std::cout << "Loaded assembly " << filename << " (" << lines.size() << " lines)\n";
+            // The back slot only needs the rows it has missed. The SDL thread
+            // only uploads `rows`, which therefore also has to cover the
+            // previous frame if that one was never picked up.
+            auto slot = frames.back_index();
+            auto copy = merge(stale[slot], rows);
+            for (auto& s : stale) {
+                s = merge(s, rows);
+            }
+            stale[slot] = {};
+            auto& back = frames.back();
+            std::memcpy(back.pixels.data() + copy.first * VM_WIDTH,
+                        cpu.get_vram() + copy.first * CPU::VRAM_ROW_BYTES,
+                        (copy.end - copy.first) * CPU::VRAM_ROW_BYTES);
+            if (frames.unread()) {
+                rows = merge(rows, last_published);
+            }
+            back.rows = last_published = rows;
+            frames.publish();
         }
-    } else {
-        cpu.load_rom(generate_line()); 
-        cpu.store(200, 10);
-        cpu.store(204, 20);
-        cpu.store(208, 15);
-        cpu.store(212, 15);
-        cpu.store(216, 0xFFFFFFFF);
-        std::cout << "Running default line demo\n";
-    }
+        final_stats = scheduler.stats();
+        nominal_mhz = scheduler.nominal_mhz();
+    });
 
+    bool running = true;
+    SDL_Event event;
     while(running) {
         while(SDL_PollEvent(&event)) {
             if(event.type == SDL_QUIT) {
                 running = false;
+            } else if(event.type == SDL_KEYDOWN && !event.key.repeat) {
+                if(event.key.keysym.sym == SDLK_p) {
+                    input.push(InputEvent::TOGGLE_PAUSE);
+                } else if(event.key.keysym.sym == SDLK_TAB) {
+                    input.push(InputEvent::TOGGLE_TURBO);
+                }
             }
         }
 
-        // Run a larger batch of cycles per frame for smooth real-time execution
-        for(int i = 0; i < 50000; i++) {
-            if (!cpu.halted)
-                cpu.run_cycle();
+        if (frames.update()) {
+            const auto& frame = frames.front();
+            SDL_Rect dirty{0, static_cast<int>(frame.rows.first), VM_WIDTH,
+                           static_cast<int>(frame.rows.end - frame.rows.first)};
+            SDL_UpdateTexture(texture, &dirty,
+                              frame.pixels.data() + frame.rows.first * VM_WIDTH,
+                              VM_WIDTH * sizeof(uint32_t));
         }
-
-        SDL_UpdateTexture(texture, nullptr, cpu.get_vram(), VM_WIDTH * sizeof(uint32_t));
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
         SDL_RenderCopy(renderer, texture, nullptr, nullptr);
         SDL_RenderPresent(renderer);
     }
 
+    emulator.request_stop();
+    emulator.join();
+    print_stats(*final_stats, nominal_mhz);
+
     SDL_DestroyTexture(texture);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
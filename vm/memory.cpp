@@ -0,0 +1,148 @@
+#include "cpu.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define FANTA_MMAP_MEMORY 1
+#endif
+
+// The page maps are padded to a multiple of 8 so restore() can scan them a
+// word at a time; the padding is never marked.
+Memory::Memory(std::size_t size)
+    : size(size), dirty(((size >> PAGE_SHIFT) + 7) & ~std::size_t{7}),
+      touched(dirty.size()) {
+#if defined(FANTA_MMAP_MEMORY)
+  // MAP_NORESERVE: nothing is committed until written, so thousands of mostly
+  // idle CPUs (tests, fanta-batch) do not count against overcommit limits.
+  auto *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    throw std::bad_alloc();
+  memory = static_cast<std::uint8_t *>(p);
+#else
+  memory = static_cast<std::uint8_t *>(std::calloc(size, 1));
+  if (!memory)
+    throw std::bad_alloc();
+#endif
+}
+
+Memory::~Memory() { release(); }
+
+auto Memory::release() -> void {
+  if (!memory)
+    return;
+#if defined(FANTA_MMAP_MEMORY)
+  munmap(memory, size);
+#else
+  std::free(memory);
+#endif
+  memory = nullptr;
+}
+
+Memory::Memory(Memory &&other) noexcept
+    : memory(std::exchange(other.memory, nullptr)),
+      size(std::exchange(other.size, 0)), dirty(std::move(other.dirty)),
+      touched(std::move(other.touched)), base_id(other.base_id) {}
+
+auto Memory::operator=(Memory &&other) noexcept -> Memory & {
+  if (this != &other) {
+    release();
+    memory = std::exchange(other.memory, nullptr);
+    size = std::exchange(other.size, 0);
+    dirty = std::move(other.dirty);
+    touched = std::move(other.touched);
+    base_id = other.base_id;
+  }
+  return *this;
+}
+
+auto Memory::sync() -> void {
+  for (std::size_t p = 0; p < dirty.size(); p++) {
+    touched[p] |= dirty[p];
+    dirty[p] = 0;
+  }
+}
+
+auto Memory::capture() -> Image {
+  // Process-wide so an image can never be mistaken for another Memory's.
+  static std::atomic<uint64_t> next_id{1};
+  sync();
+  Image image;
+  image.id = next_id++;
+  image.slot.assign(touched.size(), Image::NONE);
+  for (std::size_t p = 0; p < touched.size(); p++) {
+    if (!touched[p])
+      continue;
+    image.slot[p] = static_cast<uint32_t>(image.data.size() / PAGE_SIZE);
+    image.data.insert(image.data.end(), memory + p * PAGE_SIZE,
+                      memory + (p + 1) * PAGE_SIZE);
+  }
+  base_id = image.id;
+  return image;
+}
+
+auto Memory::restore(const Image &image) -> std::vector<uint32_t> {
+  std::vector<uint32_t> restored;
+  auto put_back = [&](std::size_t p) {
+    auto *page = memory + p * PAGE_SIZE;
+    if (p < image.slot.size() && image.slot[p] != Image::NONE)
+      std::memcpy(page, &image.data[image.slot[p] * PAGE_SIZE], PAGE_SIZE);
+    else
+      std::memset(page, 0, PAGE_SIZE);
+    restored.push_back(static_cast<uint32_t>(p));
+  };
+
+  if (image.id == base_id) {
+    // Only pages dirtied since `image` was captured or restored can differ.
+    // Most of the map is clean, so skip it eight pages at a time.
+    for (std::size_t p = 0; p < dirty.size(); p += sizeof(uint64_t)) {
+      uint64_t chunk;
+      std::memcpy(&chunk, &dirty[p], sizeof(chunk));
+      if (!chunk)
+        continue;
+      for (auto q = p; q < p + sizeof(uint64_t); q++) {
+        if (!dirty[q])
+          continue;
+        put_back(q);
+        touched[q] = 1;
+        dirty[q] = 0;
+      }
+    }
+  } else {
+    // Against any other image, anything either side has written can. Pages
+    // that come from the image count as written, so capture() keeps them.
+    for (std::size_t p = 0; p < dirty.size(); p++) {
+      auto in_image = p < image.slot.size() && image.slot[p] != Image::NONE;
+      if (dirty[p] || touched[p] || in_image)
+        put_back(p);
+      touched[p] |= in_image;
+    }
+    sync();
+  }
+  base_id = image.id;
+  return restored;
+}
+
+auto Memory::committed_bytes() const -> std::size_t {
+#if defined(FANTA_MMAP_MEMORY)
+#if defined(__APPLE__)
+  using Residency = char;
+#else
+  using Residency = unsigned char;
+#endif
+  auto host_page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  std::vector<Residency> resident((size + host_page - 1) / host_page);
+  if (mincore(memory, size, resident.data()) != 0)
+    return size;
+  std::size_t pages = 0;
+  for (auto r : resident)
+    pages += r & 1;
+  return pages * host_page;
+#else
+  return size;
+#endif
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "cpu.hpp"
+
+// write_flags() masks: bit CPU::FLAG is set for every flag the instruction
+// defines, whether or not its value changes.
+constexpr uint8_t FLAGS_ZN = 1 << CPU::ZERO | 1 << CPU::NEGATIVE;
+constexpr uint8_t FLAGS_ZNC = FLAGS_ZN | 1 << CPU::CARRY;
+constexpr uint8_t FLAGS_ALL = FLAGS_ZNC | 1 << CPU::OVFL;
+
+/**
+ * @brief Execution observer that is told nothing.
+ *
+ * @details The reference interpreter (vm/interpreter.hpp) is templated on an
+ *          observer and the handlers report every architectural write to it:
+ *
+ *          - write_reg(cpu, r, value): register r (16 is SP) becomes value.
+ *          - write_flags(cpu, mask): the flags in `mask` get redefined.
+ *          - write_mem(cpu, addr, value): the word at addr becomes value.
+ *          - read_mem(cpu, addr): the word at addr is read (LOAD, POP, RET).
+ *          - write_pc(cpu, target): control transfers to target (taken
+ *            branches, JMP, JREL, CALL, RET, taken CIP). Falling through to
+ *            the next word is not reported.
+ *          - retire(cpu, pc, op): the instruction at pc has finished.
+ *
+ *          The write_* hooks run just before the write lands, so an observer
+ *          can still read the old value out of `cpu`. retire() runs after.
+ *
+ *          Observers derive from this and hide the hooks they care about.
+ *          Every hook here is empty and inlined, so CPU::run_cycle(), which
+ *          is the interpreter with a NullObserver, compiles to the same code
+ *          as an interpreter with no hooks at all.
+ */
+struct NullObserver {
+  auto write_reg(CPU &, uint32_t, uint32_t) -> void {}
+  auto write_flags(CPU &, uint8_t) -> void {}
+  auto write_mem(CPU &, uint32_t, uint32_t) -> void {}
+  auto read_mem(CPU &, uint32_t) -> void {}
+  auto write_pc(CPU &, uint32_t) -> void {}
+  auto retire(CPU &, uint32_t, uint32_t) -> void {}
+};
+
+/**
+ * @brief Execution observer that logs every guest store.
+ *
+ * @details Each STORE, PUSH and CALL appends the word address with the value
+ *          it held and the value written. Derive from it to give another
+ *          observer the memory writes; whoever consumes `stores` clears it.
+ *          Only observed runs fill the log, so the engines pay nothing.
+ *          vm_lib instantiates CPU::run_observed() for it.
+ */
+struct StoreLog : NullObserver {
+  struct Store {
+    uint32_t addr;
+    uint32_t old_value;
+    uint32_t new_value;
+  };
+
+  std::vector<Store> stores;
+
+  auto write_mem(CPU &cpu, uint32_t addr, uint32_t value) -> void {
+    stores.push_back({addr, cpu.load(addr), value});
+  }
+};
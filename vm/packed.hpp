@@ -0,0 +1,116 @@
+#pragma once
+#include <cstdint>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * @brief Per-byte arithmetic on 32-bit words, for the packed pixel
+ *        instructions (PADDUSB, PSUBUSB, PAVGB, PBLEND).
+ *
+ * @details A word is four unsigned 8-bit lanes; for an ARGB8888 pixel, lane 0
+ *          is blue and lane 3 alpha. The functions in Packed use SSE2 when
+ *          the host has it, and Packed::Portable otherwise. The two give
+ *          identical results, which test/cpu.cpp checks.
+ */
+namespace Packed {
+
+namespace Portable {
+
+constexpr auto lane(uint32_t word, int i) -> uint32_t {
+  return word >> (8 * i) & 0xFF;
+}
+
+constexpr auto add_sat(uint32_t a, uint32_t b) -> uint32_t {
+  uint32_t out = 0;
+  for (int i = 0; i < 4; i++) {
+    auto sum = lane(a, i) + lane(b, i);
+    out |= (sum > 0xFF ? 0xFF : sum) << (8 * i);
+  }
+  return out;
+}
+
+constexpr auto sub_sat(uint32_t a, uint32_t b) -> uint32_t {
+  uint32_t out = 0;
+  for (int i = 0; i < 4; i++) {
+    auto x = lane(a, i);
+    auto y = lane(b, i);
+    out |= (x > y ? x - y : 0) << (8 * i);
+  }
+  return out;
+}
+
+// (a + b + 1) / 2 per lane, without the carries crossing lanes.
+constexpr auto avg(uint32_t a, uint32_t b) -> uint32_t {
+  return (a | b) - ((a ^ b) >> 1 & 0x7F7F7F7F);
+}
+
+// x / 255 rounded to nearest, for x <= 255 * 255.
+constexpr auto div255(uint32_t x) -> uint32_t {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+// `src` over `dst` with src's alpha: each colour lane is
+// src * a + dst * (255 - a), and alpha is a + dst_alpha * (255 - a), all
+// divided by 255 with rounding.
+constexpr auto blend(uint32_t src, uint32_t dst) -> uint32_t {
+  auto a = lane(src, 3);
+  uint32_t out = 0;
+  for (int i = 0; i < 4; i++) {
+    auto weight = i == 3 ? 0xFF : a;
+    out |= div255(lane(src, i) * weight + lane(dst, i) * (0xFF - a))
+           << (8 * i);
+  }
+  return out;
+}
+
+} // namespace Portable
+
+#if defined(__SSE2__)
+
+inline auto add_sat(uint32_t a, uint32_t b) -> uint32_t {
+  auto x = _mm_cvtsi32_si128(static_cast<int>(a));
+  auto y = _mm_cvtsi32_si128(static_cast<int>(b));
+  return static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_adds_epu8(x, y)));
+}
+
+inline auto sub_sat(uint32_t a, uint32_t b) -> uint32_t {
+  auto x = _mm_cvtsi32_si128(static_cast<int>(a));
+  auto y = _mm_cvtsi32_si128(static_cast<int>(b));
+  return static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_subs_epu8(x, y)));
+}
+
+inline auto avg(uint32_t a, uint32_t b) -> uint32_t {
+  auto x = _mm_cvtsi32_si128(static_cast<int>(a));
+  auto y = _mm_cvtsi32_si128(static_cast<int>(b));
+  return static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_avg_epu8(x, y)));
+}
+
+// Portable::blend() on 16-bit lanes: the largest sum, 255 * 255 + 128 plus
+// its own high byte, still fits.
+inline auto blend(uint32_t src, uint32_t dst) -> uint32_t {
+  auto zero = _mm_setzero_si128();
+  auto s = _mm_unpacklo_epi8(_mm_cvtsi32_si128(static_cast<int>(src)), zero);
+  auto d = _mm_unpacklo_epi8(_mm_cvtsi32_si128(static_cast<int>(dst)), zero);
+  auto a = static_cast<short>(src >> 24);
+  auto weight = _mm_setr_epi16(a, a, a, 0xFF, 0, 0, 0, 0);
+  auto rest = _mm_set1_epi16(static_cast<short>(0xFF - a));
+  auto sum = _mm_add_epi16(_mm_mullo_epi16(s, weight),
+                           _mm_mullo_epi16(d, rest));
+  sum = _mm_add_epi16(sum, _mm_set1_epi16(128));
+  sum = _mm_srli_epi16(_mm_add_epi16(sum, _mm_srli_epi16(sum, 8)), 8);
+  return static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(sum, zero)));
+}
+
+#else
+
+using Portable::add_sat;
+using Portable::avg;
+using Portable::blend;
+using Portable::sub_sat;
+
+#endif
+
+} // namespace Packed
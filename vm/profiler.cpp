@@ -0,0 +1,52 @@
+#include "profiler.hpp"
+#include "interpreter.hpp"
+#include <algorithm>
+
+template auto CPU::run_observed(uint64_t, Profiler &) -> uint64_t;
+
+auto Profiler::hot_spots(std::size_t limit) const
+    -> std::vector<std::pair<uint32_t, Site>> {
+  std::vector<std::pair<uint32_t, Site>> spots;
+  for (std::size_t p = 0; p < pages.size(); p++) {
+    if (!pages[p])
+      continue;
+    for (uint32_t w = 0; w < WORDS_PER_PAGE; w++) {
+      auto &site = (*pages[p])[w];
+      if (site.count)
+        spots.push_back(
+            {static_cast<uint32_t>((p << PAGE_SHIFT) + w * 4), site});
+    }
+  }
+  auto hotter = [](const auto &a, const auto &b) {
+    return a.second.count != b.second.count ? a.second.count > b.second.count
+                                            : a.first < b.first;
+  };
+  if (spots.size() > limit) {
+    std::partial_sort(spots.begin(), spots.begin() + limit, spots.end(),
+                      hotter);
+    spots.resize(limit);
+  } else {
+    std::sort(spots.begin(), spots.end(), hotter);
+  }
+  return spots;
+}
+
+auto Profiler::folded(const std::function<std::string(uint32_t)> &name) const
+    -> std::string {
+  std::string out;
+  // Depth first with an explicit stack: recursive guest code makes deep
+  // trees.
+  std::vector<std::pair<uint32_t, std::string>> pending{
+      {ROOT, name(nodes[ROOT].entry)}};
+  while (!pending.empty()) {
+    auto [idx, path] = std::move(pending.back());
+    pending.pop_back();
+    auto &node = nodes[idx];
+    if (node.self)
+      out += path + " " + std::to_string(node.self) + "\n";
+    for (auto child = node.children.rbegin(); child != node.children.rend();
+         ++child)
+      pending.push_back({*child, path + ";" + name(nodes[*child].entry)});
+  }
+  return out;
+}
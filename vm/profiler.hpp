@@ -0,0 +1,162 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "cpu.hpp"
+#include "cpu_info.hpp"
+#include "observer.hpp"
+
+/**
+ * @brief Execution observer that counts where a program spends its
+ *        instructions.
+ *
+ * @details Pass it to CPU::run_observed(); vm_lib instantiates that for
+ *          Profiler, so callers need no interpreter header. Every retired
+ *          instruction is counted per PC and per opcode. Branches also count
+ *          how often they were taken. CALLs are counted per target.
+ *
+ *          A calling context tree follows CALL/RET, and taken CIPs count as
+ *          calls into their interrupt vector. Each node is one call path and
+ *          owns the instructions retired while it was innermost. folded()
+ *          turns the tree into flame-graph input.
+ *
+ * @note Counts are kept per word, so a misaligned PC shares a slot with the
+ *       word it falls in.
+ */
+class Profiler : public NullObserver {
+public:
+  // Counts for one instruction word, allocated a guest page at a time.
+  struct Site {
+    uint64_t count = 0;
+    uint64_t taken = 0; ///< Branches only
+  };
+
+  static constexpr uint32_t PAGE_SHIFT = 12;
+  static constexpr uint32_t WORDS_PER_PAGE = (1u << PAGE_SHIFT) / 4;
+  static constexpr uint32_t ROOT = 0;
+
+  // `entry` names the outermost frame, normally the PC the run starts at.
+  explicit Profiler(uint32_t entry = 0)
+      : pages(CPU::MEMORY_SIZE >> PAGE_SHIFT) {
+    nodes.push_back({entry, ROOT});
+  }
+
+  // Called by the interpreter after the instruction at `pc` has executed,
+  // so `cpu` already holds its results.
+  auto retire(CPU &cpu, uint32_t pc, uint32_t op) -> void {
+    using namespace Fanta::Info::Instructions;
+    auto &site = site_at(pc);
+    site.count++;
+    opcodes[op]++;
+    nodes[current].self++;
+    switch (op) {
+    // Branches leave the flags alone, so the condition still reads the same.
+    case BEQ:
+      site.taken += cpu.flag_check(CPU::ZERO, false);
+      break;
+    case BNE:
+      site.taken += cpu.flag_check(CPU::ZERO, true);
+      break;
+    case BEC:
+      site.taken += cpu.flag_check(CPU::CARRY, false);
+      break;
+    case BNC:
+      site.taken += cpu.flag_check(CPU::CARRY, true);
+      break;
+    case BMI:
+      site.taken += cpu.flag_check(CPU::NEGATIVE, false);
+      break;
+    case BPL:
+      site.taken += cpu.flag_check(CPU::NEGATIVE, true);
+      break;
+    case CALL:
+      calls[cpu.get_pc()]++;
+      enter(cpu.get_pc());
+      break;
+    case CIP:
+      if (cpu.get_pc() != pc + 4)
+        enter(cpu.get_pc());
+      break;
+    case RET:
+      if (current != ROOT)
+        current = nodes[current].parent;
+      break;
+    }
+  }
+
+  // Instructions retired under this profile.
+  auto total() const -> uint64_t {
+    uint64_t sum = 0;
+    for (auto n : opcodes)
+      sum += n;
+    return sum;
+  }
+
+  // Counts for the word at `pc`; all zero if it never ran.
+  auto site(uint32_t pc) const -> Site {
+    auto &page = pages[pc >> PAGE_SHIFT];
+    return page ? (*page)[(pc >> 2) & (WORDS_PER_PAGE - 1)] : Site{};
+  }
+
+  // Every word that ran, most executed first, at most `limit` of them.
+  auto hot_spots(std::size_t limit) const
+      -> std::vector<std::pair<uint32_t, Site>>;
+
+  auto opcode_counts() const -> const std::array<uint64_t, 64> & {
+    return opcodes;
+  }
+
+  // Times each CALL target was called.
+  auto call_counts() const -> const std::unordered_map<uint32_t, uint64_t> & {
+    return calls;
+  }
+
+  // One "outer;...;inner count" line per call path with instructions of its
+  // own, frames named by `name(entry address)`. This is the folded-stack
+  // format flamegraph.pl and speedscope read.
+  auto folded(const std::function<std::string(uint32_t)> &name) const
+      -> std::string;
+
+private:
+  using Page = std::array<Site, WORDS_PER_PAGE>;
+
+  struct Node {
+    uint32_t entry;
+    uint32_t parent;
+    uint64_t self = 0;
+    std::vector<uint32_t> children;
+  };
+
+  auto site_at(uint32_t pc) -> Site & {
+    auto &page = pages[pc >> PAGE_SHIFT];
+    if (!page) [[unlikely]]
+      page = std::make_unique<Page>();
+    return (*page)[(pc >> 2) & (WORDS_PER_PAGE - 1)];
+  }
+
+  // Call paths rarely fan out far, so a linear scan beats hashing.
+  auto enter(uint32_t entry) -> void {
+    for (auto child : nodes[current].children) {
+      if (nodes[child].entry == entry) {
+        current = child;
+        return;
+      }
+    }
+    auto child = static_cast<uint32_t>(nodes.size());
+    nodes.push_back({entry, current});
+    nodes[current].children.push_back(child);
+    current = child;
+  }
+
+  std::vector<std::unique_ptr<Page>> pages;
+  std::array<uint64_t, 64> opcodes{};
+  std::unordered_map<uint32_t, uint64_t> calls;
+  std::vector<Node> nodes; ///< nodes[ROOT] is the outermost frame
+  uint32_t current = ROOT;
+};
@@ -0,0 +1,52 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <optional>
+
+/**
+ * @brief Bounded single-producer, single-consumer queue whose push() and
+ *        pop() finish in a fixed number of steps.
+ *
+ * @details A ring of N slots indexed by two free-running counters. Each
+ *          side keeps a cached copy of the other's counter, so the shared
+ *          cache line is only read when the ring looks full (or empty).
+ *
+ * @note One producer thread and one consumer thread. push() drops the value
+ *       and returns false when the ring is full rather than waiting.
+ */
+template <typename T, std::size_t N> class SpscQueue {
+  static_assert(N && !(N & (N - 1)), "capacity must be a power of two");
+
+public:
+  auto push(const T &value) -> bool {
+    auto t = tail.load(std::memory_order_relaxed);
+    if (t - head_seen == N) {
+      head_seen = head.load(std::memory_order_acquire);
+      if (t - head_seen == N)
+        return false;
+    }
+    slots[t & (N - 1)] = value;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  auto pop() -> std::optional<T> {
+    auto h = head.load(std::memory_order_relaxed);
+    if (h == tail_seen) {
+      tail_seen = tail.load(std::memory_order_acquire);
+      if (h == tail_seen)
+        return std::nullopt;
+    }
+    T value = slots[h & (N - 1)];
+    head.store(h + 1, std::memory_order_release);
+    return value;
+  }
+
+private:
+  std::array<T, N> slots{};
+  alignas(64) std::atomic<std::size_t> head{0}; ///< Next slot to pop
+  std::size_t tail_seen = 0;                    ///< Consumer's copy of tail
+  alignas(64) std::atomic<std::size_t> tail{0}; ///< Next slot to push
+  std::size_t head_seen = 0;                    ///< Producer's copy of head
+};
@@ -3,7 +3,9 @@
 #include <algorithm>
 #include <cctype>
 #include <charconv>
+#include <format>
 #include <instructions.hpp>
+#include <istream>
 #include <ranges>
 #include <string>
 #include <vector>
@@ -12,8 +14,11 @@ struct Assembler {
   static constexpr std::string _LITERAL = "#";
 
   auto scan_for_labels(std::string_view code) -> void {
+    scan_for_labels(extract_labels(code));
+  }
+
+  auto scan_for_labels(const std::vector<std::string> &lines) -> void {
     labels_.clear();
-    auto lines = extract_labels(code);
     uint32_t add = 0;
     for (const auto &line : lines) {
       if (is_label_define(line)) {
@@ -58,7 +63,7 @@ struct Assembler {
       case Instructions::STACK_INST:
         return parse_one(tokens, mtdc, address);
       case Instructions::HALT:
-        return 0;
+        return mtdc.reg << 26;
       case Instructions::RET:
         return 0x16 << 26;
       }
@@ -68,6 +73,58 @@ struct Assembler {
     return -1;
   }
 
+  // Rewrites each `LI Rd, imm32` line as the instructions
+  // Instructions::load_imm() picks, one per line, so that every line is still
+  // one word. LI takes a number; with anything else the line is kept and
+  // fails to assemble.
+  auto expand_pseudo_ops(const std::vector<std::string> &lines)
+      -> std::vector<std::string> {
+    std::vector<std::string> out;
+    out.reserve(lines.size());
+    for (const auto &line : lines) {
+      auto tokens = split_inst(line);
+      if (tokens.size() < 3 || tokens[0] != "LI" || is_label(tokens[2])) {
+        out.push_back(line);
+        continue;
+      }
+      auto dest = extract_val(tokens[1], 0);
+      if (!is_register(tokens[1]) || dest < 0) {
+        out.push_back(line);
+        continue;
+      }
+      auto reg = std::string{tokens[1]};
+      auto value = static_cast<uint32_t>(extract_val(tokens[2], 0));
+      auto indent = line.substr(0, line.find_first_not_of(" \t"));
+      auto li = Instructions::load_imm(static_cast<uint8_t>(dest), value);
+      for (std::size_t i = 0; i < li.size; i++) {
+        auto word = li.words[i];
+        auto imm = word & 0xFFFF;
+        switch (word >> 26) {
+        case 0x4:
+          out.push_back(std::format("{}MOV {}, ${:X}", indent, reg, imm));
+          break;
+        case 0x35:
+          out.push_back(std::format("{}LUI {}, ${:X}", indent, reg, imm));
+          break;
+        default:
+          out.push_back(
+              std::format("{}OR {}, {}, ${:X}", indent, reg, reg, imm));
+        }
+      }
+    }
+    return out;
+  }
+
+  // A source file's lines with pseudo-ops expanded: line i is the word at
+  // address 4 * i.
+  auto read_source(std::istream &in) -> std::vector<std::string> {
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(in, line))
+      lines.push_back(line);
+    return expand_pseudo_ops(lines);
+  }
+
   auto get_label_for(int address) -> std::string {
     for (auto const &[label, add] : labels_) {
       if (add == address)
@@ -76,6 +133,11 @@ struct Assembler {
     return "";
   }
 
+  // Label name (upper-cased) -> address, from the last scan_for_labels().
+  auto labels() const -> const std::unordered_map<std::string, int> & {
+    return labels_;
+  }
+
   auto does_label_exist(std::string label) -> bool {
     return labels_.contains(label);
   }
@@ -190,7 +252,8 @@ private:
       forceHex = true;
     }
 
-    int realNum = 0;
+    // Wide enough for a whole 32-bit word (LI); callers keep what they need.
+    int64_t realNum = 0;
     // Default to Hex (base 16) for all literal types per GEMINI.md
     auto [ptr, ec] =
         std::from_chars(token.data(), token.data() + token.size(), realNum, 16);
@@ -200,7 +263,7 @@ private:
       std::from_chars(token.data(), token.data() + token.size(), realNum, 10);
     }
 
-    return isNeg ? -realNum : realNum;
+    return static_cast<int>(isNeg ? -realNum : realNum);
   }
 
   auto parse_one(const std::vector<std::string_view> &tokens,
@@ -218,6 +281,8 @@ private:
       return -1;
     int r1_int = extract_val(tokens[1], address);
     bool isImm = (tokens[2][0] != 'R' && tokens[2][0] != 'r');
+    if (!isImm && mtd.reg == 0)
+      return -1; // Immediate-only, e.g. LUI
     int r2_int = extract_val(tokens[2], address);
     return Instructions::parse_two(isImm ? mtd.imm : mtd.reg, r1_int, r2_int,
                                    isImm);
@@ -230,6 +295,8 @@ private:
     int r1_int = extract_val(tokens[1], address);
     int r2_int = extract_val(tokens[2], address);
     bool isImm = (tokens[3][0] != 'R' && tokens[3][0] != 'r');
+    if (isImm && mtd.imm == 0)
+      return -1; // Register-only, e.g. MEMSET
     int r3_int = extract_val(tokens[3], address);
     return Instructions::parse_three(isImm ? mtd.imm : mtd.reg, r1_int, r2_int,
                                      r3_int, isImm);
@@ -0,0 +1,221 @@
+#include "trace_file.hpp"
+#include "interpreter.hpp"
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+template auto CPU::run_observed(uint64_t, TraceWriter &) -> uint64_t;
+
+namespace {
+template <typename T> auto write_raw(std::ofstream &out, const T &value) {
+  out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T> auto read_raw(std::ifstream &in, T &value) {
+  in.read(reinterpret_cast<char *>(&value), sizeof(T));
+}
+
+constexpr std::streamoff COUNT_OFFSET = 8; // After magic and version
+} // namespace
+
+TraceWriter::TraceWriter(CPU &cpu, const std::string &path)
+    : out(path, std::ios::binary | std::ios::trunc),
+      buffer(std::make_unique<uint8_t[]>(BUFFER_SIZE)), pos(buffer.get()),
+      end(buffer.get() + BUFFER_SIZE) {
+  if (!out)
+    throw std::runtime_error("trace: cannot write " + path);
+  next_pc = cpu.get_pc();
+  flags = TraceFormat::pack_flags(cpu.status_reg());
+
+  out.write(TraceFormat::MAGIC.data(), TraceFormat::MAGIC.size());
+  write_raw(out, TraceFormat::VERSION);
+  write_raw(out, count);
+  write_raw(out, next_pc);
+  write_raw(out, cpu.registers);
+  write_raw(out, flags);
+
+  std::vector<uint32_t> pages;
+  for (uint32_t p = 0; p < cpu.ram.page_count(); p++) {
+    if (cpu.ram.written(p))
+      pages.push_back(p);
+  }
+  write_raw(out, static_cast<uint32_t>(pages.size()));
+  for (auto p : pages) {
+    write_raw(out, p);
+    out.write(reinterpret_cast<const char *>(
+                  cpu.ram.from(std::size_t{p} << Memory::PAGE_SHIFT)),
+              Memory::PAGE_SIZE);
+  }
+  if (!out)
+    throw std::runtime_error("trace: cannot write " + path);
+}
+
+TraceWriter::~TraceWriter() {
+  // Destructors must not throw; finish() reports errors to callers that ask.
+  try {
+    finish();
+  } catch (const std::exception &) {
+  }
+}
+
+auto TraceWriter::flush() -> void {
+  out.write(reinterpret_cast<const char *>(buffer.get()), pos - buffer.get());
+  pos = buffer.get();
+  if (!out)
+    throw std::runtime_error("trace: write failed");
+}
+
+auto TraceWriter::finish() -> void {
+  if (finished)
+    return;
+  finished = true;
+  flush();
+  out.seekp(COUNT_OFFSET);
+  write_raw(out, count);
+  out.close();
+  if (!out)
+    throw std::runtime_error("trace: write failed");
+}
+
+TraceReader::TraceReader(const std::string &path)
+    : path(path), buffer(std::make_unique<uint8_t[]>(BUFFER_SIZE)) {
+  start();
+}
+
+auto TraceReader::start() -> void {
+  in = std::ifstream(path, std::ios::binary);
+  if (!in)
+    throw std::runtime_error("trace: cannot open " + path);
+
+  std::array<char, 4> magic{};
+  uint32_t version = 0;
+  in.read(magic.data(), magic.size());
+  read_raw(in, version);
+  if (!in || magic != TraceFormat::MAGIC || version != TraceFormat::VERSION)
+    throw std::runtime_error("trace: " + path + " is not a version " +
+                             std::to_string(TraceFormat::VERSION) +
+                             " Fanta trace");
+  read_raw(in, total);
+  read_raw(in, next_pc);
+  read_raw(in, regs);
+  read_raw(in, status);
+
+  // A fresh mapping is cheaper than zeroing whatever the last replay wrote.
+  memory = Memory(CPU::MEMORY_SIZE);
+  uint32_t pages = 0;
+  read_raw(in, pages);
+  for (uint32_t i = 0; i < pages && in; i++) {
+    uint32_t page = 0;
+    read_raw(in, page);
+    if (page >= memory.page_count())
+      throw std::runtime_error("trace: corrupt page table in " + path);
+    in.read(reinterpret_cast<char *>(
+                memory.from(std::size_t{page} << Memory::PAGE_SHIFT)),
+            Memory::PAGE_SIZE);
+  }
+  if (!in)
+    throw std::runtime_error("trace: " + path + " is truncated");
+
+  head = tail = 0;
+  last_addr = 0;
+  replayed = 0;
+}
+
+auto TraceReader::fill() -> void {
+  if (tail - head >= TraceFormat::MAX_RECORD || !in)
+    return;
+  std::memmove(buffer.get(), buffer.get() + head, tail - head);
+  tail -= head;
+  head = 0;
+  in.read(reinterpret_cast<char *>(buffer.get() + tail), BUFFER_SIZE - tail);
+  tail += static_cast<std::size_t>(in.gcount());
+}
+
+auto TraceReader::byte() -> uint8_t {
+  if (head == tail)
+    throw std::runtime_error("trace: " + path + " ends inside a record");
+  return buffer[head++];
+}
+
+auto TraceReader::get() -> uint32_t {
+  uint32_t v = 0;
+  for (int shift = 0;; shift += 7) {
+    auto b = byte();
+    if (shift > 28)
+      throw std::runtime_error("trace: corrupt varint in " + path);
+    v |= static_cast<uint32_t>(b & 0x7F) << shift;
+    if (!(b & 0x80))
+      break;
+  }
+  return (v >> 1) ^ (0u - (v & 1));
+}
+
+auto TraceReader::next(Record &record) -> bool {
+  using namespace TraceFormat;
+  fill();
+  if (head == tail)
+    return false;
+  auto tag = byte();
+
+  auto pc = next_pc;
+  if (tag & RESYNC)
+    pc += get();
+  if (pc > CPU::MEMORY_SIZE - 4)
+    throw std::runtime_error("trace: PC out of range in " + path);
+  record.cycle = replayed;
+  record.pc = pc;
+  record.raw = memory.read32(pc);
+  next_pc = pc + 4;
+  if (tag & JUMP)
+    next_pc += get();
+
+  record.flags_changed = 0;
+  if (tag & FLAGS) {
+    auto now = byte();
+    record.flags_changed = now ^ status;
+    status = now;
+  }
+  record.nregs = tag & REG_MASK;
+  for (uint32_t i = 0; i < record.nregs; i++) {
+    uint32_t r = byte();
+    if (r >= regs.size())
+      throw std::runtime_error("trace: corrupt register in " + path);
+    regs[r] += get();
+    record.regs[i] = {r, regs[r]};
+  }
+  record.nmems = tag >> MEM_SHIFT & MEM_MANY;
+  if (record.nmems == MEM_MANY) {
+    record.nmems = get();
+    if (record.nmems < MEM_MANY || record.nmems > MAX_MEMS)
+      throw std::runtime_error("trace: corrupt store count in " + path);
+  }
+  for (uint32_t i = 0; i < record.nmems; i++) {
+    auto addr = last_addr + get();
+    if (addr > CPU::MEMORY_SIZE - 4)
+      throw std::runtime_error("trace: store out of range in " + path);
+    auto value = memory.read32(addr) + get();
+    memory.write32(addr, value);
+    record.mems[i] = {addr, value};
+    last_addr = addr;
+  }
+  replayed++;
+  return true;
+}
+
+auto TraceReader::seek(uint64_t cycle) -> bool {
+  if (cycle < replayed)
+    start();
+  Record record;
+  while (replayed < cycle) {
+    if (!next(record))
+      return false;
+  }
+  return true;
+}
+
+auto TraceReader::flags() const -> std::array<uint8_t, 4> {
+  return {static_cast<uint8_t>(status & 1),
+          static_cast<uint8_t>(status >> 1 & 1),
+          static_cast<uint8_t>(status >> 2 & 1),
+          static_cast<uint8_t>(status >> 3 & 1)};
+}
@@ -0,0 +1,239 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "cpu.hpp"
+#include "observer.hpp"
+
+/**
+ * @brief Binary execution trace: one delta-encoded record per instruction.
+ *
+ * @details A trace file is a header followed by records, all little-endian:
+ *
+ *          - Header: "FTRC", version (u32), record count (u64, patched when
+ *            the writer finishes), PC (u32), R0-R15 and SP (17 x u32), the
+ *            Z/N/V/C bits (u8), then every written guest page as
+ *            (page index u32, 4096 bytes) preceded by their count (u32).
+ *          - Record: a tag byte, then the fields the tag announces, in this
+ *            order: the PC, if something other than the interpreter moved it
+ *            since the last record; the PC it left for, if it was not the
+ *            next word; the new Z/N/V/C bits, if they changed; each register
+ *            write as (index byte, delta); the number of memory writes, if
+ *            three or more (MEMSET/MEMCPY); each memory write as (address
+ *            delta, value delta).
+ *
+ *          Deltas are zigzag LEB128 varints: register and memory values
+ *          against the value they replace, addresses against the previous
+ *          store's and PCs against the fall-through address. So a not-taken
+ *          branch is one byte and a counter increment three.
+ *
+ *          The instruction word is not stored: the reader replays every store
+ *          onto the initial image, so its memory already holds the word that
+ *          ran (self-modifying code included).
+ */
+namespace TraceFormat {
+constexpr std::array<char, 4> MAGIC = {'F', 'T', 'R', 'C'};
+constexpr uint32_t VERSION = 2;
+
+// Tag byte layout.
+constexpr uint8_t REG_MASK = 0x07;  ///< Register writes (at most 7)
+constexpr uint8_t MEM_SHIFT = 3;    ///< Memory writes, 2 bits
+constexpr uint8_t MEM_MANY = 3;     ///< In the memory bits: a count follows
+constexpr uint8_t FLAGS = 1 << 5;   ///< Z/N/V/C byte follows
+constexpr uint8_t JUMP = 1 << 6;    ///< Control transferred; target follows
+constexpr uint8_t RESYNC = 1 << 7;  ///< PC was moved externally; PC follows
+constexpr uint32_t MAX_REGS = REG_MASK;
+constexpr uint32_t MAX_MEMS = CPU::BLOCK_WORDS;
+// Tag, both PCs, flags, then the largest register writes, store count and
+// memory writes.
+constexpr std::size_t MAX_RECORD =
+    1 + 5 + 5 + 1 + MAX_REGS * 6 + 5 + MAX_MEMS * 10;
+
+// Status bytes (CPU::status_reg() order) packed as bit CPU::FLAG.
+inline auto pack_flags(const std::array<uint8_t, 4> &status) -> uint8_t {
+  return static_cast<uint8_t>(status[0] | status[1] << 1 | status[2] << 2 |
+                              status[3] << 3);
+}
+} // namespace TraceFormat
+
+/**
+ * @brief Execution observer that writes a binary trace.
+ *
+ * @details The header is written on construction from the CPU's current
+ *          state, so attach it right before CPU::run_observed(); vm_lib
+ *          instantiates that for TraceWriter. Records go through a 1MB
+ *          buffer, and the hooks only append a few bytes to it, so a capture
+ *          stays within a small multiple of the plain interpreter.
+ *
+ * @throws std::runtime_error if the file cannot be written.
+ */
+class TraceWriter : public NullObserver {
+public:
+  TraceWriter(CPU &cpu, const std::string &path);
+  ~TraceWriter();
+  TraceWriter(const TraceWriter &) = delete;
+  auto operator=(const TraceWriter &) -> TraceWriter & = delete;
+
+  auto write_reg(CPU &cpu, uint32_t r, uint32_t value) -> void {
+    if (nregs < TraceFormat::MAX_REGS)
+      regs[nregs++] = {r, value - cpu.registers[r]};
+  }
+
+  auto write_flags(CPU &, uint8_t) -> void { flags_written = true; }
+
+  auto write_mem(CPU &cpu, uint32_t addr, uint32_t value) -> void {
+    if (nmems < TraceFormat::MAX_MEMS)
+      mems[nmems++] = {addr, value - cpu.load(addr)};
+  }
+
+  auto retire(CPU &cpu, uint32_t pc, uint32_t) -> void {
+    using namespace TraceFormat;
+    if (end - pos < static_cast<std::ptrdiff_t>(MAX_RECORD)) [[unlikely]]
+      flush();
+    auto *tag = pos++;
+    uint8_t bits = static_cast<uint8_t>(
+        nregs | std::min<uint32_t>(nmems, MEM_MANY) << MEM_SHIFT);
+    if (pc != next_pc) [[unlikely]] {
+      bits |= RESYNC;
+      put(pc - next_pc);
+    }
+    next_pc = cpu.get_pc();
+    if (next_pc != pc + 4) {
+      bits |= JUMP;
+      put(next_pc - (pc + 4));
+    }
+    // Only materialize the lazy flags when the instruction defined some.
+    if (flags_written) {
+      auto now = pack_flags(cpu.status_reg());
+      if (now != flags) {
+        bits |= FLAGS;
+        *pos++ = now;
+        flags = now;
+      }
+      flags_written = false;
+    }
+    for (uint32_t i = 0; i < nregs; i++) {
+      *pos++ = static_cast<uint8_t>(regs[i].first);
+      put(regs[i].second);
+    }
+    if (nmems >= MEM_MANY)
+      put(nmems);
+    for (uint32_t i = 0; i < nmems; i++) {
+      put(mems[i].first - last_addr);
+      put(mems[i].second);
+      last_addr = mems[i].first;
+    }
+    *tag = bits;
+    nregs = nmems = 0;
+    count++;
+  }
+
+  // Records written so far.
+  auto records() const -> uint64_t { return count; }
+
+  // Writes out the buffer and the record count. The destructor does this
+  // too; call it to see errors.
+  auto finish() -> void;
+
+private:
+  static constexpr std::size_t BUFFER_SIZE = 1 << 20;
+
+  // Zigzag LEB128 of a wrapped 32-bit difference.
+  auto put(uint32_t delta) -> void {
+    auto v = static_cast<uint32_t>(delta << 1) ^
+             static_cast<uint32_t>(static_cast<int32_t>(delta) >> 31);
+    while (v >= 0x80) {
+      *pos++ = static_cast<uint8_t>(v | 0x80);
+      v >>= 7;
+    }
+    *pos++ = static_cast<uint8_t>(v);
+  }
+
+  auto flush() -> void;
+
+  std::ofstream out;
+  std::unique_ptr<uint8_t[]> buffer;
+  uint8_t *pos;
+  uint8_t *end;
+  std::array<std::pair<uint32_t, uint32_t>, TraceFormat::MAX_REGS> regs{};
+  std::array<std::pair<uint32_t, uint32_t>, TraceFormat::MAX_MEMS> mems{};
+  uint32_t nregs = 0;
+  uint32_t nmems = 0;
+  bool flags_written = false;
+  uint8_t flags = 0;
+  uint32_t next_pc = 0;
+  uint32_t last_addr = 0;
+  uint64_t count = 0;
+  bool finished = false;
+};
+
+/**
+ * @brief Replays a binary trace and rebuilds the machine state as it goes.
+ *
+ * @details After next() returns the record for cycle N, registers(), flags(),
+ *          pc() and load() describe the machine after that instruction, i.e.
+ *          before cycle N + 1. seek() replays without returning records;
+ *          seeking backwards starts over from the header.
+ *
+ * @throws std::runtime_error if the file is missing, not a trace, or corrupt.
+ */
+class TraceReader {
+public:
+  // One decoded instruction. Writes hold the new values.
+  struct Record {
+    uint64_t cycle;
+    uint32_t pc;
+    uint32_t raw;
+    uint32_t nregs;
+    uint32_t nmems;
+    std::array<std::pair<uint32_t, uint32_t>, TraceFormat::MAX_REGS> regs;
+    std::array<std::pair<uint32_t, uint32_t>, TraceFormat::MAX_MEMS> mems;
+    uint8_t flags_changed; ///< Z/N/V/C bits that flipped
+  };
+
+  explicit TraceReader(const std::string &path);
+
+  // Decodes the next record and applies it. False at the end of the trace.
+  auto next(Record &record) -> bool;
+
+  // Replays until `cycle` instructions have run. False if the trace is
+  // shorter, in which case the state is at its end.
+  auto seek(uint64_t cycle) -> bool;
+
+  // Instructions replayed so far.
+  auto cycle() const -> uint64_t { return replayed; }
+  // Records in the file; 0 if the writer never finished.
+  auto records() const -> uint64_t { return total; }
+  auto pc() const -> uint32_t { return next_pc; }
+  auto registers() const -> const std::array<uint32_t, 17> & { return regs; }
+  // Z, N, V, C, one byte each, like CPU::status_reg().
+  auto flags() const -> std::array<uint8_t, 4>;
+  auto load(uint32_t addr) -> uint32_t { return memory.read32(addr); }
+
+private:
+  static constexpr std::size_t BUFFER_SIZE = 1 << 20;
+
+  auto start() -> void;
+  // Makes at least MAX_RECORD bytes readable unless the file ends first.
+  auto fill() -> void;
+  auto get() -> uint32_t;
+  auto byte() -> uint8_t;
+
+  std::string path;
+  std::ifstream in;
+  std::unique_ptr<uint8_t[]> buffer;
+  std::size_t head = 0;
+  std::size_t tail = 0;
+  Memory memory{CPU::MEMORY_SIZE};
+  std::array<uint32_t, 17> regs{};
+  uint8_t status = 0;
+  uint32_t next_pc = 0;
+  uint32_t last_addr = 0;
+  uint64_t replayed = 0;
+  uint64_t total = 0;
+};
@@ -0,0 +1,60 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+/**
+ * @brief Hands the most recent value from one thread to another without
+ *        locks, and without either side ever waiting.
+ *
+ * @details There are three slots. The writer fills back(), the reader
+ *          reads front(), and the third one holds the latest published value.
+ *          publish() swaps back with that slot. update() swaps front with it
+ *          if something new has arrived since. Neither side ever touches a
+ *          slot the other is using. A slow reader just skips values, and a
+ *          slow writer just means update() returns false.
+ *
+ * @note One writer thread and one reader thread.
+ */
+template <typename T> class TripleBuffer {
+public:
+  explicit TripleBuffer(const T &init = T{}) : slots{init, init, init} {}
+
+  // Writer side.
+  auto back() -> T & { return slots[back_idx]; }
+
+  // Writer side: which slot back() is (0-2), for writers that keep track of
+  // what each slot already holds.
+  auto back_index() const -> uint8_t { return back_idx; }
+
+  auto publish() -> void {
+    back_idx = middle.exchange(back_idx | FRESH, std::memory_order_acq_rel) &
+               INDEX;
+  }
+
+  // Writer side: true if the last publish() has not been picked up yet. It
+  // can turn false at any moment, but never back to true on its own.
+  auto unread() const -> bool {
+    return middle.load(std::memory_order_acquire) & FRESH;
+  }
+
+  // Reader side: moves front() to the latest published value, if there is
+  // one it has not seen.
+  auto update() -> bool {
+    if (!(middle.load(std::memory_order_relaxed) & FRESH))
+      return false;
+    front_idx = middle.exchange(front_idx, std::memory_order_acq_rel) & INDEX;
+    return true;
+  }
+
+  auto front() const -> const T & { return slots[front_idx]; }
+
+private:
+  static constexpr uint8_t INDEX = 3;
+  static constexpr uint8_t FRESH = 4; ///< Middle slot not yet read
+
+  std::array<T, 3> slots;
+  alignas(64) std::atomic<uint8_t> middle{1};
+  alignas(64) uint8_t back_idx = 0; ///< Owned by the writer
+  alignas(64) uint8_t front_idx = 2; ///< Owned by the reader
+};